@@ -0,0 +1,101 @@
+/**
+ * @file bench_commands.c
+ * @brief Times execute_command_list() from 1 to N threads.
+ * 
+ * USAGE: bench_commands [max threads] [canvas size] [commands]
+ * 
+ * Defaults to one thread per online CPU, a 4096 x 4096 canvas and 200000
+ * commands. Every run is also checked to produce the pixels of the single
+ * threaded one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "graphic.h"
+
+#define RUNS 3
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static CommandList random_commands(int size, int count)
+{
+    CommandList list = create_command_list();
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t color = RGBA(rand() % 256, rand() % 256, rand() % 256, rand() % 2 ? 255 : 128);
+        int x = rand() % size, y = rand() % size;
+        switch (rand() % 5)
+        {
+        case 0: record_line(&list, x, y, x + rand() % 201 - 100, y + rand() % 201 - 100, color); break;
+        case 1: record_filled_triangle(&list, x, y, x + rand() % 81 - 40, y + rand() % 81, x + rand() % 81, y + rand() % 81 - 40, color); break;
+        case 2: record_rect(&list, x, y, rand() % 60, rand() % 60, color); break;
+        case 3: record_circle(&list, x, y, rand() % 50, color); break;
+        default: record_filled_circle(&list, x, y, rand() % 30, color); break;
+        }
+    }
+    return list;
+}
+
+int main(int argc, char **argv)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int)(cpus > 0 ? cpus : 1);
+    int size = argc > 2 ? atoi(argv[2]) : 4096;
+    int count = argc > 3 ? atoi(argv[3]) : 200000;
+    if (max_threads < 1 || size < 1 || count < 1)
+    {
+        fprintf(stderr, "usage: %s [max threads] [canvas size] [commands]\n", argv[0]);
+        return 2;
+    }
+
+    size_t pixel_count = (size_t)size * size;
+    uint32_t *pixels = malloc(pixel_count * sizeof(uint32_t));
+    uint32_t *reference = malloc(pixel_count * sizeof(uint32_t));
+    if (pixels == NULL || reference == NULL) return 1;
+
+    srand(1);
+    CommandList list = random_commands(size, count);
+    Canvas canvas = create_canvas(pixels, size, size, size);
+    printf("%d commands on %d x %d, %ld online CPUs\n", count, size, size, cpus);
+    printf("threads      ms  speedup\n");
+
+    double single = 0;
+    int identical = 1;
+    for (int threads = 1; threads <= max_threads; threads++)
+    {
+        double best = 0;
+        for (int run = 0; run < RUNS; run++)
+        {
+            memset(pixels, 0xFF, pixel_count * sizeof(uint32_t));
+            double start = now();
+            execute_command_list(canvas, &list, threads);
+            double elapsed = now() - start;
+            if (run == 0 || elapsed < best) best = elapsed;
+        }
+
+        if (threads == 1)
+        {
+            single = best;
+            memcpy(reference, pixels, pixel_count * sizeof(uint32_t));
+        }
+        else if (memcmp(reference, pixels, pixel_count * sizeof(uint32_t)) != 0)
+        {
+            printf("%7d  pixels differ from 1 thread\n", threads);
+            identical = 0;
+        }
+        printf("%7d %7.1f %7.2fx\n", threads, best * 1e3, single / best);
+    }
+
+    free_command_list(&list);
+    free(pixels);
+    free(reference);
+    return identical ? 0 : 1;
+}
@@ -6,11 +6,22 @@
  * 
  */
 
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "graphic.h"
 
+#if defined(__SSE2__) || (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)))
+#include <immintrin.h>
+#endif
+
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
@@ -23,13 +34,11 @@
 #define BLUE_CHAN(color)    (((color)&0x00FF0000)>>(8*2))
 #define ALPHA_CHAN(color)   (((color)&0xFF000000)>>(8*3))
 
-typedef struct
-{
-    int x;
-    int y;
-} Point;
+// Side length, in pixels, of the square tiles batched drawing works on.
+// A 64x64 tile of 32-bit pixels is 16 KiB and stays in L1/L2 while it is drawn.
+#define TILE_SIZE 64
 
-static int MAX_LINE_LENGTH;
+int variable = 0;
 
 /**
  * @brief Creates a canvas with the given width, height, and pixel data array,
@@ -38,509 +47,6425 @@ static int MAX_LINE_LENGTH;
  * @param pixels Pointer to an array of 32-bit integers representing the pixel data of the canvas.
  * @param width Width of the canvas in pixels.
  * @param height Height of the canvas in pixels.
- * @param stride The number of bytes per row in the pixel data array.
+ * @param stride The number of pixels per row in the pixel data array.
  * @return Canvas struct that represents the created canvas.
  */
 Canvas create_canvas(uint32_t *pixels, size_t width, size_t height, size_t stride)
 {
     Canvas canvas = {
-        .pixels = pixels,
-        .width  = width,
-        .height = height,
-        .stride = stride,
+        .pixels     = pixels,
+        .width      = width,
+        .height     = height,
+        .stride     = stride,
+        .format     = PIXEL_STRAIGHT,
+        .blend_mode = BLEND_SRC_OVER,
+        .clip       = { 0, 0, width, height },
+        .clip_stack = NULL,
+        .damage     = NULL,
+        .origin_x   = 0,
+        .origin_y   = 0,
     };
 
-    // Calculates the maximum length of a line that can be drawn on the canvas.
-    MAX_LINE_LENGTH = sqrt(pow(canvas.width, 2) + pow(canvas.height, 2));
-
     return canvas;
 }
 
+struct ClipStack
+{
+    Rect *clips;
+    size_t count;
+    size_t capacity;
+    ClipStack *base;    // clip_stack of the canvas before the first push
+};
+
+// Stack of canvases whose clip was set without push_clip(), like subviews
+// of a clipped canvas. It is never pushed to: there is nothing to pop.
+static ClipStack fixed_clip;
+
 /**
- * @brief Calculates an interpolation between two points.
- * 
- * @param i0 First point's independent variable.
- * @param d0 First point's dependent variable.
- * @param i1 Second point's independent variable.
- * @param d1 Second point's dependent variable.
- * @return A dynamically allocated array of doubles representing the interpolated
- * values of the function along the line segment.
+ * @brief The pixels drawing may touch: the clip rectangle, or the whole canvas
+ * when nothing is pushed.
  */
-double* interpolate(int i0, int d0, int i1, int d1)
+static inline Rect clip_rect(Canvas canvas)
 {
-    // @todo: calculate the exact line length.
-    double* values = malloc(sizeof(double) * MAX_LINE_LENGTH);
+    if (canvas.clip_stack != NULL) return canvas.clip;
+
+    Rect all = { 0, 0, canvas.width, canvas.height };
+    return all;
+}
 
-    // If the line is vertical or horizontal, the dependent variable is constant.
-    if (i0 == i1)
+/**
+ * @brief Limit drawing to a rectangle, within the current clip.
+ * 
+ * The current clip is saved and restored by the matching pop_clip(). Every
+ * primitive clips its geometry to the rectangle once, before its inner loops.
+ * Copies of the canvas keep the clip they were made with.
+ * 
+ * @param canvas Canvas to clip.
+ * @param x X coordinate of the left edge.
+ * @param y Y coordinate of the top edge.
+ * @param width Width of the rectangle.
+ * @param height Height of the rectangle.
+ */
+void push_clip(Canvas *canvas, int x, int y, int width, int height)
+{
+    ClipStack *stack = canvas->clip_stack;
+    int created = stack == NULL || stack == &fixed_clip;
+    if (created)
+    {
+        stack = calloc(1, sizeof(ClipStack));
+        if (stack == NULL) return;
+        stack->base = canvas->clip_stack;
+    }
+    if (stack->count == stack->capacity)
     {
-        for (int i = 0; i <= i1; i++)
+        size_t capacity = stack->capacity ? stack->capacity * 2 : 8;
+        Rect *clips = realloc(stack->clips, sizeof(Rect) * capacity);
+        if (clips == NULL)
         {
-            values[i] = d0;
+            if (created) free(stack);
+            return;
         }
-        return values;
+        stack->clips = clips;
+        stack->capacity = capacity;
     }
 
-    // Calculate the slope of the line.
-    double a = (double)(d1 - d0) / (double)(i1 - i0);
+    Rect current = clip_rect(*canvas);
+    stack->clips[stack->count++] = current;
 
-    double d = d0;
+    // Intersect, in long long so huge rectangles don't overflow.
+    long long x0 = x, y0 = y, x1 = (long long)x + width, y1 = (long long)y + height;
+    if (x0 < current.x0) x0 = current.x0;
+    if (y0 < current.y0) y0 = current.y0;
+    if (x1 > current.x1) x1 = current.x1;
+    if (y1 > current.y1) y1 = current.y1;
+    if (x1 < x0) x1 = x0;
+    if (y1 < y0) y1 = y0;
 
-    // Calculate the dependent variable for each point along the line.
-    for(int i = 0; i <= (i1 - i0); i++)
-    {
-        values[i] = d;
-        d = d + a;
-    }
-    return values;
+    Rect clip = { x0, y0, x1, y1 };
+    canvas->clip = clip;
+    canvas->clip_stack = stack;
 }
 
-int* create_grid(Canvas canvas, int x_count, int y_count, int margin)
+/**
+ * @brief Restore the clip saved by the last push_clip().
+ */
+void pop_clip(Canvas *canvas)
 {
-    int x1 = margin;
-    int x2 = canvas.width - margin;
-    int y1 = margin;
-    int y2 = canvas.height - margin;
-
-    double x_step = (double)(x2 - x1) / x_count;
-    double y_step = (double)(y2 - y1) / y_count;
-
-    // Multiply by 2 because each point has an X and Y coordinate.
-    int* grid = malloc(sizeof(int) * (x_count + 1) * (y_count + 1) * 2);
+    ClipStack *stack = canvas->clip_stack;
+    if (stack == NULL || stack->count == 0) return;
 
-    int i = 0;
-    for(int y = 0; y <= y_count; y++)
+    canvas->clip = stack->clips[--stack->count];
+    if (stack->count == 0)
     {
-        for(int x = 0; x <= x_count; x++)
-        {
-            grid[i++] = x1 + x * x_step;
-            grid[i++] = y1 + y * y_step;
-        }
+        canvas->clip_stack = stack->base;
+        free(stack->clips);
+        free(stack);
     }
-
-    return grid;
 }
 
 /**
- * @brief Change the color of a specific pixel.
+ * @brief Returns a canvas aliasing the w * h pixels at (x, y) of the given canvas.
  * 
- * @param canvas Canvas to draw on.
- * @param x X coordinate of the pixel.
- * @param y Y coordinate of the pixel.
- * @param color Color to change the pixel to.
+ * Nothing is copied: the view shares the pixels and the stride of the canvas,
+ * so threads can each draw into their own view of a shared framebuffer. The
+ * rectangle is clipped to the canvas. The view starts with the current clip of
+ * the canvas translated to its origin, and clips pushed on either of them don't
+ * affect the other.
+ * 
+ * @param canvas Canvas to look into.
+ * @param x X coordinate of the left edge of the view.
+ * @param y Y coordinate of the top edge of the view.
+ * @param w Width of the view.
+ * @param h Height of the view.
  */
-void draw_pixel(Canvas canvas, int x, int y, uint32_t color)
+Canvas canvas_subview(Canvas canvas, int x, int y, int w, int h)
 {
-    if (x > canvas.width   || x < 0) return;   // x is outside of canvas
-    if (y > canvas.height  || y < 0) return;   // y is outside of canvas
+    // Clip the view to the canvas, in long long so huge rectangles don't overflow.
+    long long x0 = x < 0 ? 0 : x, y0 = y < 0 ? 0 : y;
+    long long x1 = (long long)x + w, y1 = (long long)y + h;
+    if (x0 > (long long)canvas.width) x0 = canvas.width;
+    if (y0 > (long long)canvas.height) y0 = canvas.height;
+    if (x1 > (long long)canvas.width) x1 = canvas.width;
+    if (y1 > (long long)canvas.height) y1 = canvas.height;
+    if (x1 < x0) x1 = x0;
+    if (y1 < y0) y1 = y0;
 
-    canvas.pixels[x + (y * canvas.stride)] = color;
+    Canvas view = canvas;
+    view.pixels = &PIXEL(canvas, x0, y0);
+    view.origin_x = canvas.origin_x + x0;
+    view.origin_y = canvas.origin_y + y0;
+    view.width  = x1 - x0;
+    view.height = y1 - y0;
+    view.clip_stack = NULL;
+    if (canvas.clip_stack != NULL)
+    {
+        Rect clip = canvas.clip;
+        view.clip.x0 = clip.x0 - x0 < 0 ? 0 : clip.x0 - x0;
+        view.clip.y0 = clip.y0 - y0 < 0 ? 0 : clip.y0 - y0;
+        view.clip.x1 = clip.x1 - x0 > (long long)view.width ? (long long)view.width : clip.x1 - x0;
+        view.clip.y1 = clip.y1 - y0 > (long long)view.height ? (long long)view.height : clip.y1 - y0;
+        if (view.clip.x1 < view.clip.x0) view.clip.x1 = view.clip.x0;
+        if (view.clip.y1 < view.clip.y0) view.clip.y1 = view.clip.y0;
+        view.clip_stack = &fixed_clip;
+    }
+    return view;
 }
 
-void blend_pixel(Canvas canvas, int x, int y, uint32_t src)
+// Rectangles drawn on since they were last taken by the one reading them.
+typedef struct
 {
-    if (x > canvas.width   || x < 0) return;   // x is outside of canvas
-    if (y > canvas.height  || y < 0) return;   // y is outside of canvas
-
-    uint32_t *dest = &PIXEL(canvas, x, y);
+    Rect rects[DAMAGE_RECTS];
+    size_t count;
+    int used;
+} DamageSet;
 
-    // TODO: If src is transparent, don't blend.
-    uint32_t a2 = ALPHA_CHAN(src); if (a2 == 0) return; // src is fully transparent, nothing to blend
-    uint32_t r2 = RED_CHAN(src);
-    uint32_t g2 = GREEN_CHAN(src);
-    uint32_t b2 = BLUE_CHAN(src);
-
-    uint32_t a1 = ALPHA_CHAN(*dest);
-    uint32_t r1 = RED_CHAN(*dest);
-    uint32_t g1 = GREEN_CHAN(*dest);
-    uint32_t b1 = BLUE_CHAN(*dest);
+struct Damage
+{
+    pthread_mutex_t lock;   // views drawn on by several threads share the damage
+    const uint32_t *pixels; // of the tracked canvas, views are located from it
+    size_t stride;
+    size_t width, height;   // of the tracked canvas, granules are clamped to it
+    uint64_t serial;        // unique among all damages, for damage_hint
+    atomic_uint_fast64_t generation; // bumped when a set is emptied, see damage_hint
+    DamageSet *sets;        // sets[0] is get_damage()'s, the others belong to writers such as IncrementalPng
+    size_t set_count;
+    int refs;               // the canvas and every attached set, freed at 0
+};
 
-    
-    r1 = (r1 * (255 - a2) + r2 * a2)/255; if (r1 > 255) r1 = 255;
-    g1 = (g1 * (255 - a2) + g2 * a2)/255; if (g1 > 255) g1 = 255;
-    b1 = (b1 * (255 - a2) + b2 * a2)/255; if (b1 > 255) b1 = 255;
+// Rectangle this thread last recorded, in every set of the damage with that
+// serial until its generation changes. Drawing inside it again needs no lock.
+static _Thread_local struct
+{
+    uint64_t serial;
+    uint64_t generation;
+    Rect rect;
+} damage_hint;
 
-    *dest = RGBA(r1, g1, b1, a1);
-}
+static atomic_uint_fast64_t damage_serial;
 
 /**
- * @brief Draw a line between two points.
+ * @brief Starts recording the rectangles drawn on a canvas.
  * 
- * @param canvas Canvas to draw on.
- * @param x0 X coordinate of the first point.
- * @param y0 Y coordinate of the first point.
- * @param x1 X coordinate of the second point.
- * @param y1 Y coordinate of the second point.
- * @param color Color of the line.
+ * Every draw_* function adds the clipped bounding box of what it drew, rounded
+ * out to DAMAGE_GRANULE pixels, which get_damage() returns until
+ * checkpoint_damage(). Views made from the canvas
+ * afterwards share its damage. Pixels written directly are not tracked.
+ * 
+ * @return 1 on success, 0 if out of memory.
  */
-void draw_line(Canvas canvas, int x0, int y0, int x1, int y1, uint32_t color)
+int track_damage(Canvas *canvas)
 {
-    // Line is horizontal-ish
-    if(abs(x1 - x0) > abs(y1 - y0))
+    if (canvas->damage != NULL) return 1;
+
+    Damage *damage = calloc(1, sizeof(Damage));
+    DamageSet *sets = calloc(1, sizeof(DamageSet));
+    if (damage == NULL || sets == NULL)
     {
-        if (x0 > x1)
-        {
-            SWAP(int, x0, x1);
-            SWAP(int, y0, y1);
-        }
-        
-        // Array returned by fn interpolate is allocated in heap memory.
-        // TODO: Check if this memory is still allocated after fn draw_line returns
-        double *ys = interpolate(x0, y0, x1, y1);
-        for(int x = x0; x <= x1; x++)
-        {
-            int y = ys[x - x0];
-            blend_pixel(canvas, x, y, color);
-        }
+        free(damage);
+        free(sets);
+        return 0;
     }
-    // Line is vertical-ish
-    else
-    {
-        if(y0 > y1)
-        {
-            SWAP(int, x0, x1);
-            SWAP(int, y0, y1);
-        }
+    pthread_mutex_init(&damage->lock, NULL);
+    damage->pixels = canvas->pixels;
+    damage->stride = canvas->stride;
+    damage->width = canvas->width;
+    damage->height = canvas->height;
+    damage->serial = atomic_fetch_add(&damage_serial, 1) + 1;
+    atomic_init(&damage->generation, 0);
+    damage->sets = sets;
+    damage->sets[0].used = 1;
+    damage->set_count = 1;
+    damage->refs = 1;
+    canvas->damage = damage;
+    return 1;
+}
 
-        // Array returned by fn interpolate is allocated in heap memory.
-        // TODO: Check if this memory is still allocated after fn draw_line returns
-        double *xs = interpolate(y0, x0, y1, x1);
-        for(int y = y0; y <= y1; y++)
-        {
-            int x = xs[y - y0];
-            blend_pixel(canvas, x, y, color);
-        }
-    }
-    
+static void release_damage(Damage *damage)
+{
+    pthread_mutex_lock(&damage->lock);
+    int refs = --damage->refs;
+    pthread_mutex_unlock(&damage->lock);
+    if (refs > 0) return;
+
+    pthread_mutex_destroy(&damage->lock);
+    free(damage->sets);
+    free(damage);
 }
 
 /**
- * @brief Draw a wireframe triangle.
- * 
- * @param canvas Canvas to draw on.
- * @param x0 X coordinate of the first point.
- * @param y0 Y coordinate of the first point.
- * @param x1 X coordinate of the second point.
- * @param y1 Y coordinate of the second point.
- * @param x2 X coordinate of the third point.
- * @param y2 Y coordinate of the third point.
- * @param color Color of the triangle.
+ * @brief Stops recording damage. Views sharing it must not be drawn on anymore.
  */
-void draw_triangle(Canvas canvas, int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color)
+void untrack_damage(Canvas *canvas)
 {
-    draw_line(canvas, x0, y0, x1, y1, color);
-    draw_line(canvas, x1, y1, x2, y2, color);
-    draw_line(canvas, x2, y2, x0, y0, color);
+    if (canvas->damage == NULL) return;
+    release_damage(canvas->damage);
+    canvas->damage = NULL;
 }
 
 /**
- * @brief Draw a filled triangle.
+ * @brief Adds an empty set to the damage, recording from now on independently
+ * of get_damage() and checkpoint_damage(). The set keeps the damage alive
+ * until detach_damage().
  * 
- * @param canvas Canvas to draw on.
- * @param x0 X coordinate of the first point.
- * @param y0 Y coordinate of the first point.
- * @param x1 X coordinate of the second point.
- * @param y1 Y coordinate of the second point.
- * @param x2 X coordinate of the third point.
- * @param y2 Y coordinate of the third point.
- * @param color Color of the triangle.
+ * @return 1 on success, 0 if out of memory.
  */
-void draw_filled_triangle(Canvas canvas, int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color)
+static int attach_damage(Damage *damage, size_t *set)
 {
-    // Sort the points so that y0 <= y1 <= y2
-    if (y1 < y0)
-    {
-        SWAP(int, x1, x0);
-        SWAP(int, y1, y0);
-    }
-    if (y2 < y0)
-    {
-        SWAP(int, x2, x0);
-        SWAP(int, y2, y0);
-    }
-    if (y2 < y1)
-    {
-        SWAP(int, x2, x1);
-        SWAP(int, y2, y1);
-    }
-
-    // Compute the x coordinates of the triangle edges
-    double* x01 = interpolate(y0, x0, y1, x1);
-    double* x12 = interpolate(y1, x1, y2, x2);
-    double* x02 = interpolate(y0, x0, y2, x2);
-
-    // Concatenate x01 and x12
-    double* x012 = malloc(sizeof(double) * (y2 - y0));
-    memcpy(x012, x01, sizeof(double) * (y1 - y0));
-    memcpy(x012 + (y1 - y0), x12, sizeof(double) * (y2 - y1));
-
-    // Determine which is the left and right edge
-    double* left_edge;
-    double* right_edge;
-    int middle = (y2 - y0) / 2;
-    if (x02[middle] < x012[middle])
+    pthread_mutex_lock(&damage->lock);
+    size_t s = 1;
+    while (s < damage->set_count && damage->sets[s].used) s++;
+    if (s == damage->set_count)
     {
-        left_edge = x02;
-        right_edge = x012;
-    }
-    else
-    {
-        left_edge = x012;
-        right_edge = x02;
-    }
-
-    // Draw the triangle
-    for (int y = y0; y < y2; y++)
-    {
-        for (int x = left_edge[y - y0]; x <= right_edge[y - y0]; x++)
+        DamageSet *sets = realloc(damage->sets, sizeof(DamageSet) * (s + 1));
+        if (sets == NULL)
         {
-            // draw_pixel(canvas, x, y, color);
-            blend_pixel(canvas, x, y, color);
+            pthread_mutex_unlock(&damage->lock);
+            return 0;
         }
+        damage->sets = sets;
+        damage->set_count = s + 1;
     }
-
-    free(x01);
-    free(x12);
-    free(x02);
-    free(x012);
+    damage->sets[s].count = 0;
+    damage->sets[s].used = 1;
+    damage->refs++;
+    atomic_fetch_add(&damage->generation, 1);
+    pthread_mutex_unlock(&damage->lock);
+    *set = s;
+    return 1;
 }
 
-void draw_rect(Canvas canvas, int x1, int y1, int width, int height, uint32_t color)
+static void detach_damage(Damage *damage, size_t set)
 {
-    // TODO: use normalised rectange.
-    // Rectangles can have negative widths/heights, which means that the starting location
-    // will not always be at the top left corner. Normalizing the rectangle will ensure
-    // that the X and Y co-ordinates of the rectangle are at the top left.
-
-    int x2 = x1 + width;
-    int y2 = y1 + height;
-
-    // If width and/or height is negative
-    // if (x1 > x2) SWAP(int, x1, x2);
-    // if (y1 > y2) SWAP(int, y1, y2);
-
-    for(int y = y1; y <= y2; y++)
-    {
-        for(int x = x1; x <= x2; x++)
-        {
-            blend_pixel(canvas, x, y, color);
-        }
-    }
+    pthread_mutex_lock(&damage->lock);
+    damage->sets[set].used = 0;
+    pthread_mutex_unlock(&damage->lock);
+    release_damage(damage);
 }
 
-void plot_points(Canvas canvas, int x0, int y0, int x, int y, uint32_t color) {
-    blend_pixel(canvas, x0 + x, y0 + y, color);
-    blend_pixel(canvas, x0 - x, y0 + y, color);
-    blend_pixel(canvas, x0 + x, y0 - y, color);
-    blend_pixel(canvas, x0 - x, y0 - y, color);
-    blend_pixel(canvas, x0 + y, y0 + x, color);
-    blend_pixel(canvas, x0 - y, y0 + x, color);
-    blend_pixel(canvas, x0 + y, y0 - x, color);
-    blend_pixel(canvas, x0 - y, y0 - x, color);
+static inline long long rect_area(Rect r)
+{
+    return (long long)(r.x1 - r.x0) * (r.y1 - r.y0);
 }
 
-void draw_circle(Canvas canvas, int x0, int y0, int radius, uint32_t color) {
-    int x = 0;
-    int y = radius;
-    int d = 3 - 2 * radius;
-
-    while (x <= y) {
-        plot_points(canvas, x0, y0, x, y, color);
-        if (d < 0) {
-            d = d + 4 * x + 6;
-        } else {
-            d = d + 4 * (x - y) + 10;
-            y--;
-        }
-        x++;
-    }
+static inline Rect rect_union(Rect a, Rect b)
+{
+    Rect r = {
+        a.x0 < b.x0 ? a.x0 : b.x0, a.y0 < b.y0 ? a.y0 : b.y0,
+        a.x1 > b.x1 ? a.x1 : b.x1, a.y1 > b.y1 ? a.y1 : b.y1,
+    };
+    return r;
 }
 
-void add_grain(Canvas canvas, int amount)
+/**
+ * @brief Adds a rectangle to the damage, merging it with the rectangles it
+ * overlaps or touches. When all slots are taken it is merged with the one that
+ * grows the damaged area the least.
+ * 
+ * @return The rectangle of the set now holding r.
+ */
+static Rect merge_damage(DamageSet *set, Rect r)
 {
-    for(int x = 0; x < canvas.width; x++)
+    for (;;)
     {
-        for(int y = 0; y < canvas.height; y++)
+        size_t merge = set->count;
+        for (size_t i = 0; i < set->count && merge == set->count; i++)
         {
-            uint32_t r1 = RED_CHAN(PIXEL(canvas, x, y));
-            uint32_t g1 = GREEN_CHAN(PIXEL(canvas, x, y));
-            uint32_t b1 = BLUE_CHAN(PIXEL(canvas, x, y));
-            uint32_t a1 = ALPHA_CHAN(PIXEL(canvas, x, y));
-
-            int grain = rand() % amount;
-            int sign = rand() % 2;
-
-            if (sign == 0)
+            Rect d = set->rects[i];
+            if (d.x0 <= r.x1 && r.x0 <= d.x1 && d.y0 <= r.y1 && r.y0 <= d.y1) merge = i;
+        }
+        if (merge == set->count && set->count == DAMAGE_RECTS)
+        {
+            long long best = -1;
+            for (size_t i = 0; i < set->count; i++)
             {
-                grain = -grain;
+                Rect d = set->rects[i];
+                long long growth = rect_area(rect_union(d, r)) - rect_area(d);
+                if (best < 0 || growth < best)
+                {
+                    best = growth;
+                    merge = i;
+                }
             }
-
-            int r2 = r1 + grain; if (r2 > 255) r2 = 255; if(r2 < 0) r2 = 0;
-            int g2 = g1 + grain; if (g2 > 255) g2 = 255; if(g2 < 0) g2 = 0;
-            int b2 = b1 + grain; if (b2 > 255) b2 = 255; if(b2 < 0) b2 = 0;
-
-            PIXEL(canvas, x, y) = RGBA(r2, g2, b2, a1);
-
         }
+        if (merge == set->count) break;
+
+        // The union may now touch other rectangles, look again.
+        r = rect_union(r, set->rects[merge]);
+        set->rects[merge] = set->rects[--set->count];
     }
+    set->rects[set->count++] = r;
+    return r;
 }
 
+/**
+ * @brief Position of a view in the canvas its damage is tracked for.
+ */
+static void damage_origin(Canvas canvas, long long *dx, long long *dy)
+{
+    size_t offset = canvas.pixels - canvas.damage->pixels;
+    *dx = offset % canvas.damage->stride;
+    *dy = offset / canvas.damage->stride;
+}
 
-void draw_filled_circle(Canvas canvas, int x, int y, int radius, uint32_t color)
+static void record_damage(Canvas canvas, long long x0, long long y0, long long x1, long long y1)
 {
-    int x1 = 0;
-    int y1 = radius;
-    int d = 3 - 2 * radius;
+    Rect clip = clip_rect(canvas);
+    if (x0 < clip.x0) x0 = clip.x0;
+    if (y0 < clip.y0) y0 = clip.y0;
+    if (x1 > clip.x1) x1 = clip.x1;
+    if (y1 > clip.y1) y1 = clip.y1;
+    if (x0 >= x1 || y0 >= y1) return;
 
-    while (y1 >= x1)
-    {
-        draw_line(canvas, x - x1, y - y1, x + x1, y - y1, color);
-        draw_line(canvas, x - y1, y - x1, x + y1, y - x1, color);
-        draw_line(canvas, x - y1, y + x1, x + y1, y + x1, color);
-        draw_line(canvas, x - x1, y + y1, x + x1, y + y1, color);
+    // Views record in the coordinates of the tracked canvas.
+    Damage *damage = canvas.damage;
+    long long dx, dy;
+    damage_origin(canvas, &dx, &dy);
+    Rect r = { x0 + dx, y0 + dy, x1 + dx, y1 + dy };
 
-        if (d < 0)
-            d += 4 * x1 + 6;
-        else
-        {
-            d += 4 * (x1 - y1) + 10;
-            y1--;
-        }
-        x1++;
+    Rect hint = damage_hint.rect;
+    if (damage_hint.serial == damage->serial &&
+        damage_hint.generation == atomic_load_explicit(&damage->generation, memory_order_relaxed) &&
+        hint.x0 <= r.x0 && hint.y0 <= r.y0 && r.x1 <= hint.x1 && r.y1 <= hint.y1) return;
+
+    r.x0 &= ~(DAMAGE_GRANULE - 1);
+    r.y0 &= ~(DAMAGE_GRANULE - 1);
+    r.x1 = (r.x1 + DAMAGE_GRANULE - 1) & ~(DAMAGE_GRANULE - 1);
+    r.y1 = (r.y1 + DAMAGE_GRANULE - 1) & ~(DAMAGE_GRANULE - 1);
+    if ((size_t)r.x1 > damage->width) r.x1 = damage->width;
+    if ((size_t)r.y1 > damage->height) r.y1 = damage->height;
+
+    // The hint is where the sets holding r overlap.
+    hint = r;
+    pthread_mutex_lock(&damage->lock);
+    for (size_t i = 0; i < damage->set_count; i++)
+    {
+        if (!damage->sets[i].used) continue;
+        Rect merged = merge_damage(&damage->sets[i], r);
+        if (merged.x0 > hint.x0) hint.x0 = merged.x0;
+        if (merged.y0 > hint.y0) hint.y0 = merged.y0;
+        if (merged.x1 < hint.x1) hint.x1 = merged.x1;
+        if (merged.y1 < hint.y1) hint.y1 = merged.y1;
     }
+    damage_hint.serial = damage->serial;
+    damage_hint.generation = atomic_load_explicit(&damage->generation, memory_order_relaxed);
+    damage_hint.rect = hint;
+    pthread_mutex_unlock(&damage->lock);
 }
 
-void draw_grid(Canvas canvas, int x_count, int y_count, int margin, uint32_t color)
+/**
+ * @brief Records that [x0, x1) x [y0, y1) of the canvas may have changed.
+ */
+static inline void add_damage(Canvas canvas, long long x0, long long y0, long long x1, long long y1)
 {
-    int x1 = margin;
-    int x2 = canvas.width - margin;
-    int y1 = margin;
-    int y2 = canvas.height - margin;
+    if (canvas.damage != NULL) record_damage(canvas, x0, y0, x1, y1);
+}
 
-    double x_step = (double)(x2 - x1) / x_count;
-    double y_step = (double)(y2 - y1) / y_count;
+/**
+ * @brief Copies the rectangles of a set within the view, in its coordinates,
+ * and empties the set if clear is set.
+ */
+static size_t copy_damage(Canvas canvas, size_t set, Rect *rects, size_t max, int clear)
+{
+    Damage *damage = canvas.damage;
+    long long dx, dy;
+    damage_origin(canvas, &dx, &dy);
 
-    for(int i = 0; i <= x_count; i++)
+    size_t count = 0;
+    pthread_mutex_lock(&damage->lock);
+    DamageSet *from = &damage->sets[set];
+    for (size_t i = 0; i < from->count && count < max; i++)
     {
-        draw_line(canvas, x1 + i * x_step, y1, x1 + i * x_step, y2, color);
-    }
+        long long x0 = from->rects[i].x0 - dx, y0 = from->rects[i].y0 - dy;
+        long long x1 = from->rects[i].x1 - dx, y1 = from->rects[i].y1 - dy;
+        if (x0 < 0) x0 = 0;
+        if (y0 < 0) y0 = 0;
+        if (x1 > (long long)canvas.width) x1 = canvas.width;
+        if (y1 > (long long)canvas.height) y1 = canvas.height;
+        if (x0 >= x1 || y0 >= y1) continue;
 
-    for(int i = 0; i <= y_count; i++)
+        Rect r = { x0, y0, x1, y1 };
+        rects[count++] = r;
+    }
+    if (clear)
     {
-        draw_line(canvas, x1, y1 + i * y_step, x2, y1 + i * y_step, color);
+        from->count = 0;
+        atomic_fetch_add(&damage->generation, 1);
     }
+    pthread_mutex_unlock(&damage->lock);
+    return count;
 }
 
-void fill_canvas(Canvas canvas, uint32_t color)
+/**
+ * @brief Returns the rectangles drawn on since the last checkpoint_damage().
+ * 
+ * The rectangles don't overlap and cover every pixel changed by the draw_*
+ * functions, possibly more. For a view, only the damage within the view is
+ * returned, in its coordinates.
+ * 
+ * @param rects Receives up to max rectangles, DAMAGE_RECTS are always enough.
+ * @return Number of rectangles, 0 when nothing changed or damage isn't tracked.
+ */
+size_t get_damage(Canvas canvas, Rect *rects, size_t max)
 {
-    for(size_t i = 0; i < canvas.width * canvas.height; i++)
-    {
-        canvas.pixels[i] = color;
-    }
+    if (canvas.damage == NULL) return 0;
+    return copy_damage(canvas, 0, rects, max, 0);
 }
 
-void insert_image(Canvas canvas, char *image, int x, int y)
+/**
+ * @brief Forgets the damage recorded so far, for the canvas and its views.
+ * 
+ * Writers keeping their own damage, such as write_canvas_png_incremental(),
+ * aren't affected.
+ */
+void checkpoint_damage(Canvas canvas)
 {
-    // Read image from file to memory.
-    int image_x, image_y, image_channels;
-    unsigned char *data = stbi_load(image, &image_x, &image_y, &image_channels, 4);
+    Damage *damage = canvas.damage;
+    if (damage == NULL) return;
 
-    if(data == NULL)
-    {
-        printf("Error: Could not load image '%s'.\n", image);
-        return;
-    }
+    pthread_mutex_lock(&damage->lock);
+    damage->sets[0].count = 0;
+    atomic_fetch_add(&damage->generation, 1);
+    pthread_mutex_unlock(&damage->lock);
+}
 
-    // Copy image pixel channel values to canvas.
-    for(int i = 0; i < image_y; i++)
-    {
-        for(int j = 0; j < image_x; j++)
-        {
-            int index = (i * image_x + j) * 4;
-            uint32_t r = data[index + 0];
-            uint32_t g = data[index + 1];
-            uint32_t b = data[index + 2];
-            uint32_t a = data[index + 3];
+// Canvas file: a 64 byte header followed by width * height pixels, packed like
+// canvas pixels (RGBA bytes on little-endian hosts), row after row.
+#define CANVAS_FILE_MAGIC   "GCANVAS"
+#define CANVAS_FILE_VERSION 2   // 1 had no format, its pixels are straight
+#define CANVAS_FILE_HEADER  64
 
-            blend_pixel(canvas, x + j, y + i, RGBA(r, g, b, a));
-        }
-    }
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;   // offset of the first pixel
+    uint64_t width;
+    uint64_t height;
+    uint32_t format;        // PixelFormat of the pixels, since version 2
+} CanvasFileHeader;
 
-    // Free image data.
-    stbi_image_free(data);
-}
+struct MappedCanvas
+{
+    Canvas canvas;          // over the pixels of the mapping
+    void *mapping;          // the whole file, header first
+    size_t size;
+};
 
-void save_canvas(Canvas canvas, const char *filename)
+/**
+ * @brief Maps a canvas file read/write and returns the handle of its canvas.
+ */
+static MappedCanvas *map_canvas_file(int fd, size_t size)
 {
-    if (!stbi_write_png(filename, canvas.width, canvas.height, 4, canvas.pixels, sizeof(uint32_t) * canvas.width))
+    MappedCanvas *mapped = malloc(sizeof(MappedCanvas));
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == NULL || mapping == MAP_FAILED)
     {
-        fprintf(stderr, "ERROR: could not write %s\n", filename);
+        if (mapping != MAP_FAILED) munmap(mapping, size);
+        free(mapped);
+        return NULL;
     }
+
+    const CanvasFileHeader *header = mapping;
+    mapped->mapping = mapping;
+    mapped->size = size;
+    mapped->canvas = create_canvas((uint32_t *)((char *)mapping + CANVAS_FILE_HEADER),
+                                   header->width, header->height, header->width);
+    mapped->canvas.format = header->version >= 2 ? (PixelFormat)header->format : PIXEL_STRAIGHT;
+    return mapped;
 }
 
-// TODO: Use Bresenham's line algorithm in the actual draw_line function.
-void bresenham_line(Canvas canvas, int x0, int y0, int x1, int y1, u_int32_t color)
+/**
+ * @brief Create a canvas file and map it into memory.
+ * 
+ * The file is sized but not written, so pages are allocated and read in lazily
+ * as they are drawn and written back by the OS. New pixels are 0.
+ * Close with close_mapped_canvas(), reopen with open_mapped_canvas().
+ * 
+ * @param filename File to create, an existing file is truncated.
+ * @param width Width in pixels.
+ * @param height Height in pixels.
+ * @param format Format of the pixels, recorded in the file.
+ * @return The mapped canvas, see mapped_canvas(), or NULL on failure.
+ */
+MappedCanvas *create_mapped_canvas(const char *filename, size_t width, size_t height, PixelFormat format)
 {
-    if (x0 > x1 || y0 > y1)
+    if (width == 0 || height == 0) return NULL;
+    if (height > (SIZE_MAX - CANVAS_FILE_HEADER) / sizeof(uint32_t) / width) return NULL;
+    size_t size = CANVAS_FILE_HEADER + width * height * sizeof(uint32_t);
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return NULL;
+
+    CanvasFileHeader header = {
+        .magic       = CANVAS_FILE_MAGIC,
+        .version     = CANVAS_FILE_VERSION,
+        .header_size = CANVAS_FILE_HEADER,
+        .width       = width,
+        .height      = height,
+        .format      = format,
+    };
+    if (ftruncate(fd, size) != 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
     {
-        SWAP(int, x0, x1);
-        SWAP(int, y0, y1);
+        close(fd);
+        return NULL;
     }
-    
-    int xi = 1;
-    int dx = x1 - x0;
-    if (dx < 0)
+
+    return map_canvas_file(fd, size);
+}
+
+/**
+ * @brief Map an existing canvas file, see create_mapped_canvas().
+ * 
+ * @param filename File written by create_mapped_canvas().
+ * @return The mapped canvas, or NULL if the file can't be opened or isn't a canvas file.
+ */
+MappedCanvas *open_mapped_canvas(const char *filename)
+{
+    int fd = open(filename, O_RDWR);
+    if (fd < 0) return NULL;
+
+    CanvasFileHeader header;
+    struct stat info;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || fstat(fd, &info) != 0 ||
+        memcmp(header.magic, CANVAS_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version < 1 || header.version > CANVAS_FILE_VERSION || header.header_size != CANVAS_FILE_HEADER ||
+        (header.version >= 2 && header.format != PIXEL_STRAIGHT && header.format != PIXEL_PREMULTIPLIED) ||
+        header.width == 0 || header.height == 0 ||
+        header.height > (SIZE_MAX - CANVAS_FILE_HEADER) / sizeof(uint32_t) / header.width ||
+        (uint64_t)info.st_size < CANVAS_FILE_HEADER + header.width * header.height * sizeof(uint32_t))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    return map_canvas_file(fd, CANVAS_FILE_HEADER + header.width * header.height * sizeof(uint32_t));
+}
+
+/**
+ * @brief Returns the canvas over the pixels of a mapped canvas file.
+ * 
+ * Draw on it, copies of it or views of it. Its format is written to the file by
+ * sync_mapped_canvas() and close_mapped_canvas(), convert it in place with
+ * convert_canvas() to change it.
+ */
+Canvas *mapped_canvas(MappedCanvas *mapped)
+{
+    return &mapped->canvas;
+}
+
+/**
+ * @brief Records the format of the canvas in the header of its file.
+ */
+static void store_mapped_format(MappedCanvas *mapped)
+{
+    CanvasFileHeader *header = mapped->mapping;
+    header->version = CANVAS_FILE_VERSION;
+    header->format = mapped->canvas.format;
+}
+
+/**
+ * @brief Flush the pixels of a mapped canvas to its file and wait for the write.
+ * 
+ * @return 1 on success, 0 on failure.
+ */
+int sync_mapped_canvas(MappedCanvas *mapped)
+{
+    store_mapped_format(mapped);
+    return msync(mapped->mapping, mapped->size, MS_SYNC) == 0;
+}
+
+/**
+ * @brief Unmap a canvas returned by create_mapped_canvas() or open_mapped_canvas()
+ * and free the handle. Canvases and views of it must not be used anymore.
+ * 
+ * Changes reach the file without a sync, the OS writes them back.
+ */
+void close_mapped_canvas(MappedCanvas *mapped)
+{
+    if (mapped == NULL) return;
+
+    store_mapped_format(mapped);
+    munmap(mapped->mapping, mapped->size);
+    free(mapped);
+}
+
+int* create_grid(Canvas canvas, int x_count, int y_count, int margin)
+{
+    int x1 = margin;
+    int x2 = canvas.width - margin;
+    int y1 = margin;
+    int y2 = canvas.height - margin;
+
+    double x_step = (double)(x2 - x1) / x_count;
+    double y_step = (double)(y2 - y1) / y_count;
+
+    // Multiply by 2 because each point has an X and Y coordinate.
+    int* grid = malloc(sizeof(int) * (x_count + 1) * (y_count + 1) * 2);
+
+    int i = 0;
+    for(int y = 0; y <= y_count; y++)
+    {
+        for(int x = 0; x <= x_count; x++)
+        {
+            grid[i++] = x1 + x * x_step;
+            grid[i++] = y1 + y * y_step;
+        }
+    }
+
+    return grid;
+}
+
+/**
+ * @brief Blends src over dest, keeping the alpha of dest.
+ */
+static inline uint32_t blend_color(uint32_t dest, uint32_t src)
+{
+    uint32_t a2 = ALPHA_CHAN(src);
+    uint32_t r2 = RED_CHAN(src);
+    uint32_t g2 = GREEN_CHAN(src);
+    uint32_t b2 = BLUE_CHAN(src);
+
+    uint32_t a1 = ALPHA_CHAN(dest);
+    uint32_t r1 = RED_CHAN(dest);
+    uint32_t g1 = GREEN_CHAN(dest);
+    uint32_t b1 = BLUE_CHAN(dest);
+
+    r1 = (r1 * (255 - a2) + r2 * a2)/255;
+    g1 = (g1 * (255 - a2) + g2 * a2)/255;
+    b1 = (b1 * (255 - a2) + b2 * a2)/255;
+
+    return RGBA(r1, g1, b1, a1);
+}
+
+/**
+ * @brief x / 255 rounded to nearest, exact for every x in [0, 255 * 255].
+ */
+static inline uint32_t div255(uint32_t x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+/**
+ * @brief Multiplies the color channels of a straight color by its alpha.
+ */
+static inline uint32_t premultiply(uint32_t color)
+{
+    uint32_t a = ALPHA_CHAN(color);
+    if (a == 255) return color;
+    return RGBA(div255(RED_CHAN(color) * a), div255(GREEN_CHAN(color) * a), div255(BLUE_CHAN(color) * a), a);
+}
+
+/**
+ * @brief Divides the color channels of a premultiplied color by its alpha.
+ */
+static inline uint32_t unpremultiply(uint32_t color)
+{
+    uint32_t a = ALPHA_CHAN(color);
+    if (a == 255) return color;
+    if (a == 0) return 0;
+    return RGBA((RED_CHAN(color) * 255 + a / 2) / a, (GREEN_CHAN(color) * 255 + a / 2) / a,
+                (BLUE_CHAN(color) * 255 + a / 2) / a, a);
+}
+
+/**
+ * @brief Blends premultiplied src over premultiplied dest, alpha included.
+ * 
+ * Every channel is src + dest * (255 - alpha of src) / 255, a single
+ * multiply-add. Red and blue, then green and alpha, share one 32-bit multiply.
+ */
+static inline uint32_t blend_premultiplied(uint32_t dest, uint32_t src)
+{
+    uint32_t inv = 255 - ALPHA_CHAN(src);
+    uint32_t rb = (dest & 0x00FF00FF) * inv + 0x00800080;
+    uint32_t ga = ((dest >> 8) & 0x00FF00FF) * inv + 0x00800080;
+    rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+    ga = (ga + ((ga >> 8) & 0x00FF00FF)) & 0xFF00FF00;
+    return (rb | ga) + src;
+}
+
+/**
+ * @brief A straight color as stored in the pixels of the canvas.
+ */
+static inline uint32_t source_color(Canvas canvas, uint32_t color)
+{
+    return canvas.format == PIXEL_PREMULTIPLIED ? premultiply(color) : color;
+}
+
+/**
+ * @brief A pixel of the canvas as a straight color, the inverse of source_color().
+ */
+static inline uint32_t straight_color(Canvas canvas, uint32_t pixel)
+{
+    return canvas.format == PIXEL_PREMULTIPLIED ? unpremultiply(pixel) : pixel;
+}
+
+// Blends src, already converted by source_color(), with a pixel of a canvas.
+typedef uint32_t (*PixelBlend)(uint32_t dest, uint32_t src);
+
+static inline PixelBlend pixel_blend(Canvas canvas);
+
+/**
+ * @brief Change the color of a specific pixel.
+ * 
+ * @param canvas Canvas to draw on.
+ * @param x X coordinate of the pixel.
+ * @param y Y coordinate of the pixel.
+ * @param color Color to change the pixel to.
+ */
+void draw_pixel(Canvas canvas, int x, int y, uint32_t color)
+{
+    Rect clip = clip_rect(canvas);
+    if (x < clip.x0 || x >= clip.x1 || y < clip.y0 || y >= clip.y1) return;
+
+    canvas.pixels[x + (y * canvas.stride)] = source_color(canvas, color);
+    add_damage(canvas, x, y, (long long)x + 1, (long long)y + 1);
+}
+
+/**
+ * @brief blend_pixel without recording damage, for primitives that record
+ * their bounding box once.
+ */
+static inline void blend_pixel_untracked(Canvas canvas, int x, int y, uint32_t src)
+{
+    Rect clip = clip_rect(canvas);
+    if (x < clip.x0 || x >= clip.x1 || y < clip.y0 || y >= clip.y1) return;
+
+    if (ALPHA_CHAN(src) == 0) return; // src is fully transparent, nothing to blend
+
+    uint32_t *dest = &PIXEL(canvas, x, y);
+    *dest = pixel_blend(canvas)(*dest, source_color(canvas, src));
+}
+
+void blend_pixel(Canvas canvas, int x, int y, uint32_t src)
+{
+    blend_pixel_untracked(canvas, x, y, src);
+    add_damage(canvas, x, y, (long long)x + 1, (long long)y + 1);
+}
+
+/**
+ * @brief Converts the pixels of a canvas to another format and sets its format.
+ * 
+ * Drawing on a PIXEL_PREMULTIPLIED canvas blends with one multiply-add per
+ * channel and accumulates alpha, so layers composite correctly. Images are
+ * premultiplied when loaded and the writers output straight colors, so only
+ * pixels written directly need converting. Going back to straight colors
+ * loses the precision of low alpha pixels.
+ * 
+ * @param canvas Canvas to convert, all of its pixels regardless of the clip.
+ * @param format Format to convert to.
+ */
+void convert_canvas(Canvas *canvas, PixelFormat format)
+{
+    if (canvas->format == format) return;
+
+    for (size_t y = 0; y < canvas->height; y++)
+    {
+        uint32_t *row = &PIXEL(*canvas, 0, y);
+        for (size_t x = 0; x < canvas->width; x++)
+        {
+            row[x] = format == PIXEL_PREMULTIPLIED ? premultiply(row[x]) : unpremultiply(row[x]);
+        }
+    }
+    canvas->format = format;
+
+    // Low alpha pixels may round differently, the whole canvas counts as changed.
+    Canvas whole = *canvas;
+    whole.clip_stack = NULL;
+    add_damage(whole, 0, 0, canvas->width, canvas->height);
+}
+
+typedef void (*BlendSpanKernel)(uint32_t *dest, size_t len, uint32_t src);
+typedef void (*FillKernel)(uint32_t *dest, size_t len, uint32_t color);
+typedef void (*BlendPixelsKernel)(uint32_t *dest, const uint32_t *src, size_t len);
+typedef void (*GrainKernel)(uint32_t *dest, const uint32_t *add, const uint32_t *sub, size_t len);
+
+// Fills of at least this many bytes bypass the cache, see fill_canvas().
+#define STREAMING_FILL_BYTES (8 << 20)
+
+/**
+ * @brief Stores color into len pixels.
+ */
+static void fill_row(uint32_t *dest, size_t len, uint32_t color)
+{
+    // Colors made of four equal bytes, like black or white, are a memset.
+    if (color == (color & 0xFF) * 0x01010101u)
+    {
+        memset(dest, color & 0xFF, len * sizeof(uint32_t));
+        return;
+    }
+
+    for (size_t i = 0; i < len; i++)
+    {
+        dest[i] = color;
+    }
+}
+
+/**
+ * @brief Blends a translucent color over len pixels, one pixel at a time.
+ * Reference for the SIMD kernels, which must produce identical bytes.
+ */
+static void blend_span_scalar(uint32_t *dest, size_t len, uint32_t src)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        dest[i] = blend_color(dest[i], src);
+    }
+}
+
+/**
+ * @brief Blends len source pixels over len destination pixels, one at a time.
+ */
+static void blend_pixels_scalar(uint32_t *dest, const uint32_t *src, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (ALPHA_CHAN(src[i]) != 0) dest[i] = blend_color(dest[i], src[i]);
+    }
+}
+
+/**
+ * @brief Copies the color channels of len opaque source pixels, keeping the alpha
+ * of dest. This is what blending opaque pixels amounts to.
+ */
+static void copy_opaque_scalar(uint32_t *dest, const uint32_t *src, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        dest[i] = (dest[i] & 0xFF000000) | (src[i] & 0x00FFFFFF);
+    }
+}
+
+/**
+ * @brief Blends a premultiplied color over len premultiplied pixels.
+ * Reference for the SIMD kernels, which must produce identical bytes.
+ */
+static void blend_span_premul_scalar(uint32_t *dest, size_t len, uint32_t src)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        dest[i] = blend_premultiplied(dest[i], src);
+    }
+}
+
+/**
+ * @brief Blends len premultiplied source pixels over len premultiplied pixels.
+ * Transparent source pixels are 0 and leave dest as it is, no branch needed.
+ */
+static void blend_pixels_premul_scalar(uint32_t *dest, const uint32_t *src, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        dest[i] = blend_premultiplied(dest[i], src[i]);
+    }
+}
+
+static inline uint32_t add_saturated(uint32_t x, uint32_t y)
+{
+    uint32_t sum = x + y;
+    return sum > 255 ? 255 : sum;
+}
+
+#define BLEND_MODE_COUNT (BLEND_CLEAR + 1)
+
+/**
+ * @brief One channel of premultiplied src composited with dest by a blend mode.
+ * 
+ * sa and da are the alphas of src and dest. Every mode rounds the same way as
+ * the SIMD kernels, see composite_sse2().
+ */
+static inline __attribute__((always_inline))
+uint32_t composite_channel(uint32_t s, uint32_t d, uint32_t sa, uint32_t da, BlendMode mode)
+{
+    switch (mode)
+    {
+    case BLEND_SRC_OVER: return s + div255(d * (255 - sa));
+    case BLEND_DST_OVER: return d + div255(s * (255 - da));
+    case BLEND_MULTIPLY: return div255(s * d + s * (255 - da) + d * (255 - sa));
+    case BLEND_SCREEN:   return s + d - div255(s * d);
+    case BLEND_ADD:      return add_saturated(s, d);
+    case BLEND_CLEAR:    return div255(d * (255 - sa));
+    }
+    return d;
+}
+
+/**
+ * @brief Premultiplied src composited with premultiplied dest, alpha included.
+ */
+static inline __attribute__((always_inline))
+uint32_t composite(uint32_t dest, uint32_t src, BlendMode mode)
+{
+    uint32_t sa = ALPHA_CHAN(src), da = ALPHA_CHAN(dest);
+    return RGBA(composite_channel(RED_CHAN(src),   RED_CHAN(dest),   sa, da, mode),
+                composite_channel(GREEN_CHAN(src), GREEN_CHAN(dest), sa, da, mode),
+                composite_channel(BLUE_CHAN(src),  BLUE_CHAN(dest),  sa, da, mode),
+                composite_channel(sa,              da,               sa, da, mode));
+}
+
+/**
+ * @brief Straight src composited with straight dest. The mode is applied to the
+ * premultiplied colors, the result is converted back.
+ */
+static inline __attribute__((always_inline))
+uint32_t composite_straight(uint32_t dest, uint32_t src, BlendMode mode)
+{
+    return unpremultiply(composite(premultiply(dest), premultiply(src), mode));
+}
+
+static inline __attribute__((always_inline))
+void blend_span_mode_scalar(uint32_t *dest, size_t len, uint32_t src, BlendMode mode)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        dest[i] = composite(dest[i], src, mode);
+    }
+}
+
+static inline __attribute__((always_inline))
+void blend_pixels_mode_scalar(uint32_t *dest, const uint32_t *src, size_t len, BlendMode mode)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        dest[i] = composite(dest[i], src[i], mode);
+    }
+}
+
+static inline __attribute__((always_inline))
+void blend_span_mode_straight(uint32_t *dest, size_t len, uint32_t src, BlendMode mode)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        dest[i] = composite_straight(dest[i], src, mode);
+    }
+}
+
+static inline __attribute__((always_inline))
+void blend_pixels_mode_straight(uint32_t *dest, const uint32_t *src, size_t len, BlendMode mode)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        dest[i] = composite_straight(dest[i], src[i], mode);
+    }
+}
+
+/**
+ * Defines the span and pixels kernels of one blend mode for one instruction set
+ * from the always inlined generic versions: the mode is a constant in each of
+ * them, so their loops have no per-pixel mode switch.
+ */
+#define DEFINE_MODE_KERNELS(attributes, name, isa, mode)                                            \
+    attributes static void blend_span_##name##_##isa(uint32_t *dest, size_t len, uint32_t src)      \
+    {                                                                                               \
+        blend_span_mode_##isa(dest, len, src, mode);                                                \
+    }                                                                                               \
+    attributes static void blend_pixels_##name##_##isa(uint32_t *dest, const uint32_t *src, size_t len) \
+    {                                                                                               \
+        blend_pixels_mode_##isa(dest, src, len, mode);                                              \
+    }
+
+/**
+ * Defines the single pixel blends of one blend mode, for primitives that pick
+ * theirs once with pixel_blend() and blend scattered pixels.
+ */
+#define DEFINE_PIXEL_BLENDS(name, mode)                                                             \
+    static uint32_t blend_##name##_premul(uint32_t dest, uint32_t src)                              \
+    {                                                                                               \
+        return composite(dest, src, mode);                                                          \
+    }                                                                                               \
+    static uint32_t blend_##name##_straight(uint32_t dest, uint32_t src)                            \
+    {                                                                                               \
+        return composite_straight(dest, src, mode);                                                 \
+    }
+
+DEFINE_PIXEL_BLENDS(dst_over, BLEND_DST_OVER)
+DEFINE_PIXEL_BLENDS(multiply, BLEND_MULTIPLY)
+DEFINE_PIXEL_BLENDS(screen,   BLEND_SCREEN)
+DEFINE_PIXEL_BLENDS(add,      BLEND_ADD)
+DEFINE_PIXEL_BLENDS(clear,    BLEND_CLEAR)
+
+static const PixelBlend pixel_blends[2][BLEND_MODE_COUNT] = {
+    [PIXEL_STRAIGHT] = {
+        [BLEND_SRC_OVER] = blend_color,
+        [BLEND_DST_OVER] = blend_dst_over_straight,
+        [BLEND_MULTIPLY] = blend_multiply_straight,
+        [BLEND_SCREEN]   = blend_screen_straight,
+        [BLEND_ADD]      = blend_add_straight,
+        [BLEND_CLEAR]    = blend_clear_straight,
+    },
+    [PIXEL_PREMULTIPLIED] = {
+        [BLEND_SRC_OVER] = blend_premultiplied,
+        [BLEND_DST_OVER] = blend_dst_over_premul,
+        [BLEND_MULTIPLY] = blend_multiply_premul,
+        [BLEND_SCREEN]   = blend_screen_premul,
+        [BLEND_ADD]      = blend_add_premul,
+        [BLEND_CLEAR]    = blend_clear_premul,
+    },
+};
+
+/**
+ * @brief The single pixel blend of the format and blend mode of a canvas.
+ */
+static inline PixelBlend pixel_blend(Canvas canvas)
+{
+    return pixel_blends[canvas.format][canvas.blend_mode];
+}
+
+// Source over is blend_span/blend_pixels, straight, or the *_premul kernels.
+DEFINE_MODE_KERNELS(, dst_over, scalar, BLEND_DST_OVER)
+DEFINE_MODE_KERNELS(, multiply, scalar, BLEND_MULTIPLY)
+DEFINE_MODE_KERNELS(, screen,   scalar, BLEND_SCREEN)
+DEFINE_MODE_KERNELS(, add,      scalar, BLEND_ADD)
+DEFINE_MODE_KERNELS(, clear,    scalar, BLEND_CLEAR)
+
+// Straight canvases convert every pixel, only source over has a fast path there.
+DEFINE_MODE_KERNELS(, dst_over, straight, BLEND_DST_OVER)
+DEFINE_MODE_KERNELS(, multiply, straight, BLEND_MULTIPLY)
+DEFINE_MODE_KERNELS(, screen,   straight, BLEND_SCREEN)
+DEFINE_MODE_KERNELS(, add,      straight, BLEND_ADD)
+DEFINE_MODE_KERNELS(, clear,    straight, BLEND_CLEAR)
+
+static inline uint32_t sub_saturated(uint32_t x, uint32_t y)
+{
+    return x > y ? x - y : 0;
+}
+
+/**
+ * @brief Adds add[i] and then subtracts sub[i] from dest[i], channel by channel,
+ * saturating at 0 and 255.
+ */
+static void apply_grain_scalar(uint32_t *dest, const uint32_t *add, const uint32_t *sub, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        uint32_t d = dest[i];
+        uint32_t r = sub_saturated(add_saturated(RED_CHAN(d),   RED_CHAN(add[i])),   RED_CHAN(sub[i]));
+        uint32_t g = sub_saturated(add_saturated(GREEN_CHAN(d), GREEN_CHAN(add[i])), GREEN_CHAN(sub[i]));
+        uint32_t b = sub_saturated(add_saturated(BLUE_CHAN(d),  BLUE_CHAN(add[i])),  BLUE_CHAN(sub[i]));
+        uint32_t a = sub_saturated(add_saturated(ALPHA_CHAN(d), ALPHA_CHAN(add[i])), ALPHA_CHAN(sub[i]));
+        dest[i] = RGBA(r, g, b, a);
+    }
+}
+
+#if defined(__SSE2__)
+/**
+ * @brief SSE2 version of blend_span_scalar, 4 pixels per iteration.
+ * 
+ * Channels are widened to 16 bits and d * (255 - a) + s * a, at most 255 * 255,
+ * is divided by 255 with (x + 1 + (x >> 8)) >> 8, which equals x / 255 rounded
+ * down for every x in [0, 255 * 255].
+ */
+static void blend_span_sse2(uint32_t *dest, size_t len, uint32_t src)
+{
+    uint32_t a = ALPHA_CHAN(src);
+    const __m128i zero       = _mm_setzero_si128();
+    const __m128i one        = _mm_set1_epi16(1);
+    const __m128i inv_alpha  = _mm_set1_epi16(255 - a);
+    const __m128i alpha_mask = _mm_set1_epi32(0xFF000000);
+    const __m128i src_term   = _mm_set_epi16(0, BLUE_CHAN(src) * a, GREEN_CHAN(src) * a, RED_CHAN(src) * a,
+                                             0, BLUE_CHAN(src) * a, GREEN_CHAN(src) * a, RED_CHAN(src) * a);
+
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4)
+    {
+        __m128i d  = _mm_loadu_si128((const __m128i *)&dest[i]);
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), inv_alpha), src_term);
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), inv_alpha), src_term);
+        lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(lo, one), _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(hi, one), _mm_srli_epi16(hi, 8)), 8);
+
+        // Keep the alpha of dest.
+        __m128i result = _mm_packus_epi16(lo, hi);
+        result = _mm_or_si128(_mm_andnot_si128(alpha_mask, result), _mm_and_si128(alpha_mask, d));
+        _mm_storeu_si128((__m128i *)&dest[i], result);
+    }
+    blend_span_scalar(dest + i, len - i, src);
+}
+
+/**
+ * @brief SSE2 version of blend_pixels_scalar, 4 pixels per iteration.
+ * 
+ * Same arithmetic as blend_span_sse2, with the alpha of every source pixel
+ * broadcast to its own channels. A transparent pixel yields d * 255 / 255 = d,
+ * so no per-pixel branch is needed.
+ */
+static void blend_pixels_sse2(uint32_t *dest, const uint32_t *src, size_t len)
+{
+    const __m128i zero       = _mm_setzero_si128();
+    const __m128i one        = _mm_set1_epi16(1);
+    const __m128i full       = _mm_set1_epi16(255);
+    const __m128i alpha_mask = _mm_set1_epi32(0xFF000000);
+
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4)
+    {
+        __m128i d = _mm_loadu_si128((const __m128i *)&dest[i]);
+        __m128i s = _mm_loadu_si128((const __m128i *)&src[i]);
+
+        __m128i s_lo = _mm_unpacklo_epi8(s, zero);
+        __m128i s_hi = _mm_unpackhi_epi8(s, zero);
+        __m128i a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, 0xFF), 0xFF);
+        __m128i a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, 0xFF), 0xFF);
+
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(full, a_lo)),
+                                   _mm_mullo_epi16(s_lo, a_lo));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(full, a_hi)),
+                                   _mm_mullo_epi16(s_hi, a_hi));
+        lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(lo, one), _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(hi, one), _mm_srli_epi16(hi, 8)), 8);
+
+        // Keep the alpha of dest.
+        __m128i result = _mm_packus_epi16(lo, hi);
+        result = _mm_or_si128(_mm_andnot_si128(alpha_mask, result), _mm_and_si128(alpha_mask, d));
+        _mm_storeu_si128((__m128i *)&dest[i], result);
+    }
+    blend_pixels_scalar(dest + i, src + i, len - i);
+}
+
+/**
+ * @brief SSE2 version of blend_span_premul_scalar, 4 pixels per iteration.
+ * 
+ * d * (255 - a) is divided by 255 rounded with (x + 128 + ((x + 128) >> 8)) >> 8,
+ * then the premultiplied source is added to the packed bytes.
+ */
+static void blend_span_premul_sse2(uint32_t *dest, size_t len, uint32_t src)
+{
+    const __m128i zero      = _mm_setzero_si128();
+    const __m128i half      = _mm_set1_epi16(128);
+    const __m128i inv_alpha = _mm_set1_epi16(255 - ALPHA_CHAN(src));
+    const __m128i s         = _mm_set1_epi32(src);
+
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4)
+    {
+        __m128i d  = _mm_loadu_si128((const __m128i *)&dest[i]);
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), inv_alpha), half);
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), inv_alpha), half);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        _mm_storeu_si128((__m128i *)&dest[i], _mm_add_epi8(_mm_packus_epi16(lo, hi), s));
+    }
+    blend_span_premul_scalar(dest + i, len - i, src);
+}
+
+/**
+ * @brief SSE2 version of blend_pixels_premul_scalar, 4 pixels per iteration.
+ */
+static void blend_pixels_premul_sse2(uint32_t *dest, const uint32_t *src, size_t len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi16(128);
+    const __m128i full = _mm_set1_epi16(255);
+
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4)
+    {
+        __m128i d = _mm_loadu_si128((const __m128i *)&dest[i]);
+        __m128i s = _mm_loadu_si128((const __m128i *)&src[i]);
+
+        __m128i a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(_mm_unpacklo_epi8(s, zero), 0xFF), 0xFF);
+        __m128i a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(_mm_unpackhi_epi8(s, zero), 0xFF), 0xFF);
+
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(full, a_lo)), half);
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(full, a_hi)), half);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        _mm_storeu_si128((__m128i *)&dest[i], _mm_add_epi8(_mm_packus_epi16(lo, hi), s));
+    }
+    blend_pixels_premul_scalar(dest + i, src + i, len - i);
+}
+
+/**
+ * @brief composite_channel() on the 16-bit channels of two pixels.
+ */
+static inline __attribute__((always_inline))
+__m128i composite_half_sse2(__m128i d, __m128i s, __m128i sa, __m128i da, BlendMode mode)
+{
+    const __m128i full = _mm_set1_epi16(255);
+    const __m128i half = _mm_set1_epi16(128);
+    __m128i x;
+    switch (mode)
+    {
+    case BLEND_SRC_OVER: x = _mm_mullo_epi16(d, _mm_sub_epi16(full, sa)); break;
+    case BLEND_DST_OVER: x = _mm_mullo_epi16(s, _mm_sub_epi16(full, da)); break;
+    case BLEND_MULTIPLY: x = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s, d), _mm_mullo_epi16(s, _mm_sub_epi16(full, da))),
+                                           _mm_mullo_epi16(d, _mm_sub_epi16(full, sa))); break;
+    case BLEND_SCREEN:   x = _mm_mullo_epi16(s, d); break;
+    case BLEND_CLEAR:    x = _mm_mullo_epi16(d, _mm_sub_epi16(full, sa)); break;
+    default:             return d;  // BLEND_ADD works on bytes, see composite_sse2()
+    }
+
+    // x / 255 rounded, like div255().
+    x = _mm_add_epi16(x, half);
+    x = _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+    switch (mode)
+    {
+    case BLEND_SRC_OVER: return _mm_add_epi16(s, x);
+    case BLEND_DST_OVER: return _mm_add_epi16(d, x);
+    case BLEND_SCREEN:   return _mm_sub_epi16(_mm_add_epi16(s, d), x);
+    default:             return x;
+    }
+}
+
+/**
+ * @brief composite() on 4 pixels. Channels are widened to 16 bits, products
+ * of two channels fit and the sums of BLEND_MULTIPLY stay below 255 * 255 for
+ * valid premultiplied colors.
+ */
+static inline __attribute__((always_inline))
+__m128i composite_sse2(__m128i d, __m128i s, BlendMode mode)
+{
+    if (mode == BLEND_ADD) return _mm_adds_epu8(d, s);
+
+    const __m128i zero = _mm_setzero_si128();
+    __m128i d_lo = _mm_unpacklo_epi8(d, zero), d_hi = _mm_unpackhi_epi8(d, zero);
+    __m128i s_lo = _mm_unpacklo_epi8(s, zero), s_hi = _mm_unpackhi_epi8(s, zero);
+    __m128i sa_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, 0xFF), 0xFF);
+    __m128i sa_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, 0xFF), 0xFF);
+    __m128i da_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(d_lo, 0xFF), 0xFF);
+    __m128i da_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(d_hi, 0xFF), 0xFF);
+    return _mm_packus_epi16(composite_half_sse2(d_lo, s_lo, sa_lo, da_lo, mode),
+                            composite_half_sse2(d_hi, s_hi, sa_hi, da_hi, mode));
+}
+
+static inline __attribute__((always_inline))
+void blend_span_mode_sse2(uint32_t *dest, size_t len, uint32_t src, BlendMode mode)
+{
+    const __m128i s = _mm_set1_epi32(src);
+
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4)
+    {
+        __m128i d = _mm_loadu_si128((const __m128i *)&dest[i]);
+        _mm_storeu_si128((__m128i *)&dest[i], composite_sse2(d, s, mode));
+    }
+    blend_span_mode_scalar(dest + i, len - i, src, mode);
+}
+
+static inline __attribute__((always_inline))
+void blend_pixels_mode_sse2(uint32_t *dest, const uint32_t *src, size_t len, BlendMode mode)
+{
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4)
+    {
+        __m128i d = _mm_loadu_si128((const __m128i *)&dest[i]);
+        __m128i s = _mm_loadu_si128((const __m128i *)&src[i]);
+        _mm_storeu_si128((__m128i *)&dest[i], composite_sse2(d, s, mode));
+    }
+    blend_pixels_mode_scalar(dest + i, src + i, len - i, mode);
+}
+
+DEFINE_MODE_KERNELS(, dst_over, sse2, BLEND_DST_OVER)
+DEFINE_MODE_KERNELS(, multiply, sse2, BLEND_MULTIPLY)
+DEFINE_MODE_KERNELS(, screen,   sse2, BLEND_SCREEN)
+DEFINE_MODE_KERNELS(, add,      sse2, BLEND_ADD)
+DEFINE_MODE_KERNELS(, clear,    sse2, BLEND_CLEAR)
+
+/**
+ * @brief SSE2 version of copy_opaque_scalar.
+ */
+static void copy_opaque_sse2(uint32_t *dest, const uint32_t *src, size_t len)
+{
+    const __m128i alpha_mask = _mm_set1_epi32(0xFF000000);
+
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4)
+    {
+        __m128i d = _mm_loadu_si128((const __m128i *)&dest[i]);
+        __m128i s = _mm_loadu_si128((const __m128i *)&src[i]);
+        _mm_storeu_si128((__m128i *)&dest[i], _mm_or_si128(_mm_andnot_si128(alpha_mask, s), _mm_and_si128(alpha_mask, d)));
+    }
+    copy_opaque_scalar(dest + i, src + i, len - i);
+}
+
+/**
+ * @brief SSE2 version of apply_grain_scalar, saturating byte arithmetic on 4 pixels.
+ */
+static void apply_grain_sse2(uint32_t *dest, const uint32_t *add, const uint32_t *sub, size_t len)
+{
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4)
+    {
+        __m128i d = _mm_loadu_si128((const __m128i *)&dest[i]);
+        d = _mm_adds_epu8(d, _mm_loadu_si128((const __m128i *)&add[i]));
+        d = _mm_subs_epu8(d, _mm_loadu_si128((const __m128i *)&sub[i]));
+        _mm_storeu_si128((__m128i *)&dest[i], d);
+    }
+    apply_grain_scalar(dest + i, add + i, sub + i, len - i);
+}
+
+/**
+ * @brief Stores color into len pixels with non-temporal 16 byte stores.
+ */
+static void fill_stream_sse2(uint32_t *dest, size_t len, uint32_t color)
+{
+    size_t i = 0;
+    for (; i < len && ((uintptr_t)&dest[i] & 15) != 0; i++)
+    {
+        dest[i] = color;
+    }
+
+    const __m128i value = _mm_set1_epi32(color);
+    for (; i + 4 <= len; i += 4)
+    {
+        _mm_stream_si128((__m128i *)&dest[i], value);
+    }
+    _mm_sfence();
+
+    fill_row(dest + i, len - i, color);
+}
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2_KERNELS
+
+/**
+ * @brief AVX2 version of blend_span_sse2, 8 pixels per iteration.
+ */
+__attribute__((target("avx2")))
+static void blend_span_avx2(uint32_t *dest, size_t len, uint32_t src)
+{
+    uint32_t a = ALPHA_CHAN(src);
+    const __m256i zero       = _mm256_setzero_si256();
+    const __m256i one        = _mm256_set1_epi16(1);
+    const __m256i inv_alpha  = _mm256_set1_epi16(255 - a);
+    const __m256i alpha_mask = _mm256_set1_epi32(0xFF000000);
+    const __m256i src_term   = _mm256_set1_epi64x(((uint64_t)(BLUE_CHAN(src)  * a) << 32) |
+                                                  ((uint64_t)(GREEN_CHAN(src) * a) << 16) |
+                                                  ((uint64_t)(RED_CHAN(src)   * a)));
+
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        __m256i d  = _mm256_loadu_si256((const __m256i *)&dest[i]);
+        __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), inv_alpha), src_term);
+        __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), inv_alpha), src_term);
+        lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(lo, one), _mm256_srli_epi16(lo, 8)), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(hi, one), _mm256_srli_epi16(hi, 8)), 8);
+
+        // Keep the alpha of dest.
+        __m256i result = _mm256_packus_epi16(lo, hi);
+        result = _mm256_or_si256(_mm256_andnot_si256(alpha_mask, result), _mm256_and_si256(alpha_mask, d));
+        _mm256_storeu_si256((__m256i *)&dest[i], result);
+    }
+
+    // Leave the upper halves of the registers clean before running SSE code.
+    _mm256_zeroupper();
+#if defined(__SSE2__)
+    blend_span_sse2(dest + i, len - i, src);
+#else
+    blend_span_scalar(dest + i, len - i, src);
+#endif
+}
+
+/**
+ * @brief AVX2 version of blend_pixels_sse2, 8 pixels per iteration.
+ */
+__attribute__((target("avx2")))
+static void blend_pixels_avx2(uint32_t *dest, const uint32_t *src, size_t len)
+{
+    const __m256i zero       = _mm256_setzero_si256();
+    const __m256i one        = _mm256_set1_epi16(1);
+    const __m256i full       = _mm256_set1_epi16(255);
+    const __m256i alpha_mask = _mm256_set1_epi32(0xFF000000);
+
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        __m256i d = _mm256_loadu_si256((const __m256i *)&dest[i]);
+        __m256i s = _mm256_loadu_si256((const __m256i *)&src[i]);
+
+        __m256i s_lo = _mm256_unpacklo_epi8(s, zero);
+        __m256i s_hi = _mm256_unpackhi_epi8(s, zero);
+        __m256i a_lo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_lo, 0xFF), 0xFF);
+        __m256i a_hi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_hi, 0xFF), 0xFF);
+
+        __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_sub_epi16(full, a_lo)),
+                                      _mm256_mullo_epi16(s_lo, a_lo));
+        __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_sub_epi16(full, a_hi)),
+                                      _mm256_mullo_epi16(s_hi, a_hi));
+        lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(lo, one), _mm256_srli_epi16(lo, 8)), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(hi, one), _mm256_srli_epi16(hi, 8)), 8);
+
+        // Keep the alpha of dest.
+        __m256i result = _mm256_packus_epi16(lo, hi);
+        result = _mm256_or_si256(_mm256_andnot_si256(alpha_mask, result), _mm256_and_si256(alpha_mask, d));
+        _mm256_storeu_si256((__m256i *)&dest[i], result);
+    }
+
+    _mm256_zeroupper();
+    blend_pixels_scalar(dest + i, src + i, len - i);
+}
+
+/**
+ * @brief AVX2 version of blend_span_premul_sse2, 8 pixels per iteration.
+ */
+__attribute__((target("avx2")))
+static void blend_span_premul_avx2(uint32_t *dest, size_t len, uint32_t src)
+{
+    const __m256i zero      = _mm256_setzero_si256();
+    const __m256i half      = _mm256_set1_epi16(128);
+    const __m256i inv_alpha = _mm256_set1_epi16(255 - ALPHA_CHAN(src));
+    const __m256i s         = _mm256_set1_epi32(src);
+
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        __m256i d  = _mm256_loadu_si256((const __m256i *)&dest[i]);
+        __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), inv_alpha), half);
+        __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), inv_alpha), half);
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+        _mm256_storeu_si256((__m256i *)&dest[i], _mm256_add_epi8(_mm256_packus_epi16(lo, hi), s));
+    }
+
+    _mm256_zeroupper();
+#if defined(__SSE2__)
+    blend_span_premul_sse2(dest + i, len - i, src);
+#else
+    blend_span_premul_scalar(dest + i, len - i, src);
+#endif
+}
+
+/**
+ * @brief AVX2 version of blend_pixels_premul_sse2, 8 pixels per iteration.
+ */
+__attribute__((target("avx2")))
+static void blend_pixels_premul_avx2(uint32_t *dest, const uint32_t *src, size_t len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i half = _mm256_set1_epi16(128);
+    const __m256i full = _mm256_set1_epi16(255);
+
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        __m256i d = _mm256_loadu_si256((const __m256i *)&dest[i]);
+        __m256i s = _mm256_loadu_si256((const __m256i *)&src[i]);
+
+        __m256i a_lo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(_mm256_unpacklo_epi8(s, zero), 0xFF), 0xFF);
+        __m256i a_hi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(_mm256_unpackhi_epi8(s, zero), 0xFF), 0xFF);
+
+        __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_sub_epi16(full, a_lo)), half);
+        __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_sub_epi16(full, a_hi)), half);
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+        _mm256_storeu_si256((__m256i *)&dest[i], _mm256_add_epi8(_mm256_packus_epi16(lo, hi), s));
+    }
+
+    _mm256_zeroupper();
+    blend_pixels_premul_scalar(dest + i, src + i, len - i);
+}
+
+/**
+ * @brief AVX2 version of composite_half_sse2().
+ */
+static inline __attribute__((always_inline, target("avx2")))
+__m256i composite_half_avx2(__m256i d, __m256i s, __m256i sa, __m256i da, BlendMode mode)
+{
+    const __m256i full = _mm256_set1_epi16(255);
+    const __m256i half = _mm256_set1_epi16(128);
+    __m256i x;
+    switch (mode)
+    {
+    case BLEND_SRC_OVER: x = _mm256_mullo_epi16(d, _mm256_sub_epi16(full, sa)); break;
+    case BLEND_DST_OVER: x = _mm256_mullo_epi16(s, _mm256_sub_epi16(full, da)); break;
+    case BLEND_MULTIPLY: x = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s, d), _mm256_mullo_epi16(s, _mm256_sub_epi16(full, da))),
+                                              _mm256_mullo_epi16(d, _mm256_sub_epi16(full, sa))); break;
+    case BLEND_SCREEN:   x = _mm256_mullo_epi16(s, d); break;
+    case BLEND_CLEAR:    x = _mm256_mullo_epi16(d, _mm256_sub_epi16(full, sa)); break;
+    default:             return d;
+    }
+
+    x = _mm256_add_epi16(x, half);
+    x = _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+    switch (mode)
+    {
+    case BLEND_SRC_OVER: return _mm256_add_epi16(s, x);
+    case BLEND_DST_OVER: return _mm256_add_epi16(d, x);
+    case BLEND_SCREEN:   return _mm256_sub_epi16(_mm256_add_epi16(s, d), x);
+    default:             return x;
+    }
+}
+
+/**
+ * @brief AVX2 version of composite_sse2(), 8 pixels.
+ */
+static inline __attribute__((always_inline, target("avx2")))
+__m256i composite_avx2(__m256i d, __m256i s, BlendMode mode)
+{
+    if (mode == BLEND_ADD) return _mm256_adds_epu8(d, s);
+
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i d_lo = _mm256_unpacklo_epi8(d, zero), d_hi = _mm256_unpackhi_epi8(d, zero);
+    __m256i s_lo = _mm256_unpacklo_epi8(s, zero), s_hi = _mm256_unpackhi_epi8(s, zero);
+    __m256i sa_lo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_lo, 0xFF), 0xFF);
+    __m256i sa_hi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_hi, 0xFF), 0xFF);
+    __m256i da_lo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(d_lo, 0xFF), 0xFF);
+    __m256i da_hi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(d_hi, 0xFF), 0xFF);
+    return _mm256_packus_epi16(composite_half_avx2(d_lo, s_lo, sa_lo, da_lo, mode),
+                               composite_half_avx2(d_hi, s_hi, sa_hi, da_hi, mode));
+}
+
+static inline __attribute__((always_inline, target("avx2")))
+void blend_span_mode_avx2(uint32_t *dest, size_t len, uint32_t src, BlendMode mode)
+{
+    const __m256i s = _mm256_set1_epi32(src);
+
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        __m256i d = _mm256_loadu_si256((const __m256i *)&dest[i]);
+        _mm256_storeu_si256((__m256i *)&dest[i], composite_avx2(d, s, mode));
+    }
+
+    _mm256_zeroupper();
+    blend_span_mode_scalar(dest + i, len - i, src, mode);
+}
+
+static inline __attribute__((always_inline, target("avx2")))
+void blend_pixels_mode_avx2(uint32_t *dest, const uint32_t *src, size_t len, BlendMode mode)
+{
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        __m256i d = _mm256_loadu_si256((const __m256i *)&dest[i]);
+        __m256i s = _mm256_loadu_si256((const __m256i *)&src[i]);
+        _mm256_storeu_si256((__m256i *)&dest[i], composite_avx2(d, s, mode));
+    }
+
+    _mm256_zeroupper();
+    blend_pixels_mode_scalar(dest + i, src + i, len - i, mode);
+}
+
+DEFINE_MODE_KERNELS(__attribute__((target("avx2"))), dst_over, avx2, BLEND_DST_OVER)
+DEFINE_MODE_KERNELS(__attribute__((target("avx2"))), multiply, avx2, BLEND_MULTIPLY)
+DEFINE_MODE_KERNELS(__attribute__((target("avx2"))), screen,   avx2, BLEND_SCREEN)
+DEFINE_MODE_KERNELS(__attribute__((target("avx2"))), add,      avx2, BLEND_ADD)
+DEFINE_MODE_KERNELS(__attribute__((target("avx2"))), clear,    avx2, BLEND_CLEAR)
+
+/**
+ * @brief AVX2 version of copy_opaque_sse2.
+ */
+__attribute__((target("avx2")))
+static void copy_opaque_avx2(uint32_t *dest, const uint32_t *src, size_t len)
+{
+    const __m256i alpha_mask = _mm256_set1_epi32(0xFF000000);
+
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        __m256i d = _mm256_loadu_si256((const __m256i *)&dest[i]);
+        __m256i s = _mm256_loadu_si256((const __m256i *)&src[i]);
+        _mm256_storeu_si256((__m256i *)&dest[i], _mm256_or_si256(_mm256_andnot_si256(alpha_mask, s), _mm256_and_si256(alpha_mask, d)));
+    }
+
+    _mm256_zeroupper();
+    copy_opaque_scalar(dest + i, src + i, len - i);
+}
+
+/**
+ * @brief AVX2 version of apply_grain_sse2.
+ */
+__attribute__((target("avx2")))
+static void apply_grain_avx2(uint32_t *dest, const uint32_t *add, const uint32_t *sub, size_t len)
+{
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        __m256i d = _mm256_loadu_si256((const __m256i *)&dest[i]);
+        d = _mm256_adds_epu8(d, _mm256_loadu_si256((const __m256i *)&add[i]));
+        d = _mm256_subs_epu8(d, _mm256_loadu_si256((const __m256i *)&sub[i]));
+        _mm256_storeu_si256((__m256i *)&dest[i], d);
+    }
+
+    _mm256_zeroupper();
+    apply_grain_scalar(dest + i, add + i, sub + i, len - i);
+}
+
+/**
+ * @brief Stores color into len pixels with non-temporal 32 byte stores.
+ */
+__attribute__((target("avx2")))
+static void fill_stream_avx2(uint32_t *dest, size_t len, uint32_t color)
+{
+    size_t i = 0;
+    for (; i < len && ((uintptr_t)&dest[i] & 31) != 0; i++)
+    {
+        dest[i] = color;
+    }
+
+    const __m256i value = _mm256_set1_epi32(color);
+    for (; i + 8 <= len; i += 8)
+    {
+        _mm256_stream_si256((__m256i *)&dest[i], value);
+    }
+    _mm_sfence();
+    _mm256_zeroupper();
+
+    fill_row(dest + i, len - i, color);
+}
+#endif
+
+// SIMD kernels for the running CPU, see select_kernels().
+typedef struct
+{
+    BlendSpanKernel blend_span;
+    FillKernel fill_stream;
+    BlendPixelsKernel blend_pixels;
+    BlendPixelsKernel copy_opaque;
+    GrainKernel apply_grain;
+    // Kernels of every pixel format and blend mode, see blend_row().
+    BlendSpanKernel span_modes[2][BLEND_MODE_COUNT];
+    BlendPixelsKernel pixels_modes[2][BLEND_MODE_COUNT];
+} Kernels;
+
+#define SET_MODE_KERNELS(isa)                                                                   \
+    do {                                                                                        \
+        kernels.span_modes[PIXEL_PREMULTIPLIED][BLEND_SRC_OVER]   = blend_span_premul_##isa;    \
+        kernels.span_modes[PIXEL_PREMULTIPLIED][BLEND_DST_OVER]   = blend_span_dst_over_##isa;  \
+        kernels.span_modes[PIXEL_PREMULTIPLIED][BLEND_MULTIPLY]   = blend_span_multiply_##isa;  \
+        kernels.span_modes[PIXEL_PREMULTIPLIED][BLEND_SCREEN]     = blend_span_screen_##isa;    \
+        kernels.span_modes[PIXEL_PREMULTIPLIED][BLEND_ADD]        = blend_span_add_##isa;       \
+        kernels.span_modes[PIXEL_PREMULTIPLIED][BLEND_CLEAR]      = blend_span_clear_##isa;     \
+        kernels.pixels_modes[PIXEL_PREMULTIPLIED][BLEND_SRC_OVER] = blend_pixels_premul_##isa;  \
+        kernels.pixels_modes[PIXEL_PREMULTIPLIED][BLEND_DST_OVER] = blend_pixels_dst_over_##isa;\
+        kernels.pixels_modes[PIXEL_PREMULTIPLIED][BLEND_MULTIPLY] = blend_pixels_multiply_##isa;\
+        kernels.pixels_modes[PIXEL_PREMULTIPLIED][BLEND_SCREEN]   = blend_pixels_screen_##isa;  \
+        kernels.pixels_modes[PIXEL_PREMULTIPLIED][BLEND_ADD]      = blend_pixels_add_##isa;     \
+        kernels.pixels_modes[PIXEL_PREMULTIPLIED][BLEND_CLEAR]    = blend_pixels_clear_##isa;   \
+    } while (0)
+
+static Kernels kernels;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Picks the widest kernels the CPU supports.
+ */
+static void select_kernels(void)
+{
+    kernels.blend_span   = blend_span_scalar;
+    kernels.fill_stream  = fill_row;
+    kernels.blend_pixels = blend_pixels_scalar;
+    kernels.copy_opaque  = copy_opaque_scalar;
+    kernels.apply_grain  = apply_grain_scalar;
+    SET_MODE_KERNELS(scalar);
+#if defined(__SSE2__)
+    kernels.blend_span   = blend_span_sse2;
+    kernels.fill_stream  = fill_stream_sse2;
+    kernels.blend_pixels = blend_pixels_sse2;
+    kernels.copy_opaque  = copy_opaque_sse2;
+    kernels.apply_grain  = apply_grain_sse2;
+    SET_MODE_KERNELS(sse2);
+#endif
+#if defined(HAVE_AVX2_KERNELS)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernels.blend_span   = blend_span_avx2;
+        kernels.fill_stream  = fill_stream_avx2;
+        kernels.blend_pixels = blend_pixels_avx2;
+        kernels.copy_opaque  = copy_opaque_avx2;
+        kernels.apply_grain  = apply_grain_avx2;
+        SET_MODE_KERNELS(avx2);
+    }
+#endif
+
+    // Straight source over is the legacy blend, which keeps the alpha of the
+    // pixels, the other modes go through premultiplied colors.
+    kernels.span_modes[PIXEL_STRAIGHT][BLEND_SRC_OVER]   = kernels.blend_span;
+    kernels.span_modes[PIXEL_STRAIGHT][BLEND_DST_OVER]   = blend_span_dst_over_straight;
+    kernels.span_modes[PIXEL_STRAIGHT][BLEND_MULTIPLY]   = blend_span_multiply_straight;
+    kernels.span_modes[PIXEL_STRAIGHT][BLEND_SCREEN]     = blend_span_screen_straight;
+    kernels.span_modes[PIXEL_STRAIGHT][BLEND_ADD]        = blend_span_add_straight;
+    kernels.span_modes[PIXEL_STRAIGHT][BLEND_CLEAR]      = blend_span_clear_straight;
+    kernels.pixels_modes[PIXEL_STRAIGHT][BLEND_SRC_OVER] = kernels.blend_pixels;
+    kernels.pixels_modes[PIXEL_STRAIGHT][BLEND_DST_OVER] = blend_pixels_dst_over_straight;
+    kernels.pixels_modes[PIXEL_STRAIGHT][BLEND_MULTIPLY] = blend_pixels_multiply_straight;
+    kernels.pixels_modes[PIXEL_STRAIGHT][BLEND_SCREEN]   = blend_pixels_screen_straight;
+    kernels.pixels_modes[PIXEL_STRAIGHT][BLEND_ADD]      = blend_pixels_add_straight;
+    kernels.pixels_modes[PIXEL_STRAIGHT][BLEND_CLEAR]    = blend_pixels_clear_straight;
+}
+
+static inline const Kernels *cpu_kernels(void)
+{
+    pthread_once(&kernels_once, select_kernels);
+    return &kernels;
+}
+
+/**
+ * @brief Blends a straight color over len pixels that are known to be on the canvas.
+ */
+static inline void blend_row(Canvas canvas, uint32_t *dest, size_t len, uint32_t src)
+{
+    uint32_t a = ALPHA_CHAN(src);
+    if (a == 0) return; // src is fully transparent, every mode leaves dest as it is
+
+    if (canvas.blend_mode != BLEND_SRC_OVER)
+    {
+        cpu_kernels()->span_modes[canvas.format][canvas.blend_mode](dest, len, source_color(canvas, src));
+        return;
+    }
+
+    if (canvas.format == PIXEL_PREMULTIPLIED)
+    {
+        // An opaque color replaces the pixels, alpha included.
+        if (a == 255) fill_row(dest, len, src);
+        else          cpu_kernels()->span_modes[PIXEL_PREMULTIPLIED][BLEND_SRC_OVER](dest, len, premultiply(src));
+        return;
+    }
+
+    // An opaque color replaces the color channels and keeps the alpha of dest.
+    if (a == 255)
+    {
+        for (size_t i = 0; i < len; i++)
+        {
+            dest[i] = (dest[i] & 0xFF000000) | (src & 0x00FFFFFF);
+        }
+        return;
+    }
+
+    cpu_kernels()->blend_span(dest, len, src);
+}
+
+/**
+ * @brief Blend a color over a horizontal run of pixels.
+ * 
+ * The run is clipped once, then blended by a SIMD kernel chosen
+ * for the running CPU. The result is identical to calling blend_pixel on every
+ * pixel of the run.
+ * 
+ * @param canvas Canvas to draw on.
+ * @param x X coordinate of the first pixel.
+ * @param y Y coordinate of the run.
+ * @param len Number of pixels.
+ * @param src Color to blend.
+ */
+static inline void blend_span_untracked(Canvas canvas, int x, int y, int len, uint32_t src)
+{
+    Rect clip = clip_rect(canvas);
+    if (y < clip.y0 || y >= clip.y1) return;
+
+    long long x0 = x;
+    long long x1 = (long long)x + len;
+    if (x0 < clip.x0) x0 = clip.x0;
+    if (x1 > clip.x1) x1 = clip.x1;
+    if (x0 >= x1) return;
+
+    blend_row(canvas, &PIXEL(canvas, x0, y), x1 - x0, src);
+}
+
+void blend_span(Canvas canvas, int x, int y, int len, uint32_t src)
+{
+    blend_span_untracked(canvas, x, y, len, src);
+    add_damage(canvas, x, y, (long long)x + len, (long long)y + 1);
+}
+
+/**
+ * @brief Integer DDA that walks value = floor(start + num * i / den) one step of i
+ * at a time, using only additions. The denominator must be positive.
+ */
+typedef struct
+{
+    long long value;        // floor of the current position
+    long long error;        // remainder of the current position, in [0, den)
+    long long step;         // floor(num / den)
+    long long error_step;   // num mod den, in [0, den)
+    long long den;
+} Stepper;
+
+static inline __int128 floor_div(__int128 a, __int128 b)
+{
+    // Operands nearly always fit in 64 bits, whose division is a lot cheaper.
+    if (a > LLONG_MIN && a <= LLONG_MAX && b >= LLONG_MIN && b <= LLONG_MAX)
+    {
+        long long q = (long long)a / (long long)b;
+        if (((long long)a % (long long)b != 0) && ((a < 0) != (b < 0))) q--;
+        return q;
+    }
+
+    __int128 q = a / b;
+    if ((a % b != 0) && ((a < 0) != (b < 0))) q--;
+    return q;
+}
+
+/**
+ * @brief Creates a stepper positioned at index i.
+ *
+ * @param start Value at index 0.
+ * @param num Change of the value over den steps.
+ * @param den Number of steps, must be positive.
+ * @param i Index to start walking from.
+ */
+static inline Stepper stepper_init(long long start, long long num, long long den, long long i)
+{
+    __int128 offset = (__int128)num * i;
+    __int128 q = floor_div(offset, den);
+
+    Stepper stepper = {
+        .value      = start + (long long)q,
+        .error      = (long long)(offset - q * den),
+        .step       = (long long)floor_div(num, den),
+        .den        = den,
+    };
+    stepper.error_step = num - stepper.step * den;
+
+    return stepper;
+}
+
+static inline void stepper_next(Stepper *stepper)
+{
+    stepper->value += stepper->step;
+    stepper->error += stepper->error_step;
+    if (stepper->error >= stepper->den)
+    {
+        stepper->error -= stepper->den;
+        stepper->value++;
+    }
+}
+
+/**
+ * @brief Narrows [*first, *last] to the steps i where lo <= floor(start + num * i / den) < hi.
+ * The denominator must be positive.
+ */
+static void clip_steps(long long start, long long num, long long den, int lo, int hi, long long *first, long long *last)
+{
+    __int128 below = (__int128)(lo - start) * den; // i where the value reaches lo
+    __int128 above = (__int128)(hi - start) * den; // i where the value reaches hi
+
+    if (num == 0)
+    {
+        if (start < lo || start >= hi) *last = *first - 1;
+        return;
+    }
+    if (num > 0)
+    {
+        __int128 from = -floor_div(-below, num);      // ceil
+        __int128 to   = -floor_div(-above, num) - 1;
+        if (from > *first) *first = from;
+        if (to < *last) *last = to;
+    }
+    else
+    {
+        __int128 from = floor_div(above, num) + 1;
+        __int128 to   = floor_div(below, num);
+        if (from > *first) *first = from;
+        if (to < *last) *last = to;
+    }
+}
+
+static inline __attribute__((always_inline))
+void blend_steps(Canvas canvas, PixelBlend blend, uint32_t source, int steep, int start, Stepper minor, long long first, long long last)
+{
+    for (long long i = first; i <= last; i++)
+    {
+        uint32_t *dest = steep ? &PIXEL(canvas, minor.value, start + i) : &PIXEL(canvas, start + i, minor.value);
+        *dest = blend(*dest, source);
+        stepper_next(&minor);
+    }
+}
+
+/**
+ * @brief Blends the steps first to last of a line, major coordinate start + i
+ * and minor one stepped by minor. Source over, the common case, is inlined.
+ */
+static inline __attribute__((always_inline))
+void blend_line_steps(Canvas canvas, PixelBlend blend, uint32_t source, int steep, int start, Stepper minor, long long first, long long last)
+{
+    if (blend == blend_color)              blend_steps(canvas, blend_color, source, steep, start, minor, first, last);
+    else if (blend == blend_premultiplied) blend_steps(canvas, blend_premultiplied, source, steep, start, minor, first, last);
+    else                                   blend_steps(canvas, blend, source, steep, start, minor, first, last);
+}
+
+/**
+ * @brief Draw a line between two points.
+ * 
+ * The line is stepped along its major axis one pixel at a time, the minor
+ * coordinate being the exact rational position rounded down. The steps that
+ * land inside the clip rectangle are found up front, so the loop blends without
+ * any bounds checks and clipping doesn't change which pixels are drawn. No
+ * memory is allocated.
+ * 
+ * @param canvas Canvas to draw on.
+ * @param x0 X coordinate of the first point.
+ * @param y0 Y coordinate of the first point.
+ * @param x1 X coordinate of the second point.
+ * @param y1 Y coordinate of the second point.
+ * @param color Color of the line.
+ */
+void draw_line(Canvas canvas, int x0, int y0, int x1, int y1, uint32_t color)
+{
+    if (ALPHA_CHAN(color) == 0) return;
+    Rect clip = clip_rect(canvas);
+    uint32_t source = source_color(canvas, color);
+    PixelBlend blend = pixel_blend(canvas);
+    add_damage(canvas, x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1,
+               (long long)(x0 > x1 ? x0 : x1) + 1, (long long)(y0 > y1 ? y0 : y1) + 1);
+
+    // Differences of two ints need 33 bits.
+    long long dx = (long long)x1 - x0, dy = (long long)y1 - y0;
+
+    // Line is horizontal-ish
+    if (llabs(dx) > llabs(dy))
+    {
+        if (dx < 0)
+        {
+            SWAP(int, x0, x1);
+            SWAP(int, y0, y1);
+            dx = -dx;
+            dy = -dy;
+        }
+
+        long long first = 0, last = dx;
+        clip_steps(x0, 1, 1, clip.x0, clip.x1, &first, &last);
+        clip_steps(y0, dy, dx, clip.y0, clip.y1, &first, &last);
+
+        Stepper ys = stepper_init(y0, dy, dx, first);
+        blend_line_steps(canvas, blend, source, 0, x0, ys, first, last);
+    }
+    // Line is a single point
+    else if (dy == 0)
+    {
+        blend_pixel_untracked(canvas, x0, y0, color);
+    }
+    // Line is vertical-ish
+    else
+    {
+        if (dy < 0)
+        {
+            SWAP(int, x0, x1);
+            SWAP(int, y0, y1);
+            dx = -dx;
+            dy = -dy;
+        }
+
+        long long first = 0, last = dy;
+        clip_steps(y0, 1, 1, clip.y0, clip.y1, &first, &last);
+        clip_steps(x0, dx, dy, clip.x0, clip.x1, &first, &last);
+
+        Stepper xs = stepper_init(x0, dx, dy, first);
+        blend_line_steps(canvas, blend, source, 1, y0, xs, first, last);
+    }
+}
+
+/**
+ * @brief Draw a wireframe triangle.
+ * 
+ * @param canvas Canvas to draw on.
+ * @param x0 X coordinate of the first point.
+ * @param y0 Y coordinate of the first point.
+ * @param x1 X coordinate of the second point.
+ * @param y1 Y coordinate of the second point.
+ * @param x2 X coordinate of the third point.
+ * @param y2 Y coordinate of the third point.
+ * @param color Color of the triangle.
+ */
+void draw_triangle(Canvas canvas, int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color)
+{
+    draw_line(canvas, x0, y0, x1, y1, color);
+    draw_line(canvas, x1, y1, x2, y2, color);
+    draw_line(canvas, x2, y2, x0, y0, color);
+}
+
+/**
+ * @brief Blends the pixels left to right of row y, edges that may lie far off
+ * the canvas are clamped to the clip first.
+ */
+static inline void blend_edge_span(Canvas canvas, Rect clip, long long left, long long right, int y, uint32_t color)
+{
+    if (left < clip.x0) left = clip.x0;
+    if (right >= clip.x1) right = clip.x1 - 1;
+    if (left <= right) blend_span_untracked(canvas, left, y, right - left + 1, color);
+}
+
+/**
+ * @brief Draw a filled triangle.
+ * 
+ * @param canvas Canvas to draw on.
+ * @param x0 X coordinate of the first point.
+ * @param y0 Y coordinate of the first point.
+ * @param x1 X coordinate of the second point.
+ * @param y1 Y coordinate of the second point.
+ * @param x2 X coordinate of the third point.
+ * @param y2 Y coordinate of the third point.
+ * @param color Color of the triangle.
+ */
+void draw_filled_triangle(Canvas canvas, int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color)
+{
+    // Sort the points so that y0 <= y1 <= y2
+    if (y1 < y0)
+    {
+        SWAP(int, x1, x0);
+        SWAP(int, y1, y0);
+    }
+    if (y2 < y0)
+    {
+        SWAP(int, x2, x0);
+        SWAP(int, y2, y0);
+    }
+    if (y2 < y1)
+    {
+        SWAP(int, x2, x1);
+        SWAP(int, y2, y1);
+    }
+
+    // Rows y0 <= y < y2 are covered, nothing to draw for a flat triangle.
+    if (y2 == y0) return;
+
+    // Determine whether the long edge (p0-p2) is the left one by comparing the
+    // exact edge positions on the middle row. Differences of two ints need 33
+    // bits, the products up to 98.
+    long long height = (long long)y2 - y0;
+    long long middle = height / 2;
+    __int128 long_x = (__int128)x0 * height + (__int128)((long long)x2 - x0) * middle; // scaled by height
+    __int128 short_x;                                                                 // scaled by height
+    if (y0 + middle < y1)
+        short_x = ((__int128)x0 * ((long long)y1 - y0) + (__int128)((long long)x1 - x0) * middle) * height;
+    else
+        short_x = ((__int128)x1 * ((long long)y2 - y1) + (__int128)((long long)x2 - x1) * (y0 + middle - y1)) * height;
+    int long_is_left = long_x * (y0 + middle < y1 ? (long long)y1 - y0 : (long long)y2 - y1) < short_x;
+
+    // Only walk the rows that are on the canvas.
+    Rect clip  = clip_rect(canvas);
+    int top    = y0 < clip.y0 ? clip.y0 : y0;
+    int bottom = y2 > clip.y1 ? clip.y1 : y2;
+    if (top >= bottom) return;
+
+    int left  = x0 < x1 ? (x0 < x2 ? x0 : x2) : (x1 < x2 ? x1 : x2);
+    int right = x0 > x1 ? (x0 > x2 ? x0 : x2) : (x1 > x2 ? x1 : x2);
+    add_damage(canvas, left, top, (long long)right + 1, bottom);
+
+    // The x coordinate of every edge is stepped exactly, one row at a time.
+    Stepper long_edge = stepper_init(x0, (long long)x2 - x0, height, (long long)top - y0);
+    Stepper short_edge;
+
+    int y = top;
+    if (y < y1)
+    {
+        short_edge = stepper_init(x0, (long long)x1 - x0, (long long)y1 - y0, (long long)y - y0);
+        int end = y1 < bottom ? y1 : bottom;
+        for (; y < end; y++)
+        {
+            if (long_is_left) blend_edge_span(canvas, clip, long_edge.value, short_edge.value, y, color);
+            else              blend_edge_span(canvas, clip, short_edge.value, long_edge.value, y, color);
+            stepper_next(&long_edge);
+            stepper_next(&short_edge);
+        }
+    }
+    if (y < bottom)
+    {
+        short_edge = stepper_init(x1, (long long)x2 - x1, (long long)y2 - y1, (long long)y - y1);
+        for (; y < bottom; y++)
+        {
+            if (long_is_left) blend_edge_span(canvas, clip, long_edge.value, short_edge.value, y, color);
+            else              blend_edge_span(canvas, clip, short_edge.value, long_edge.value, y, color);
+            stepper_next(&long_edge);
+            stepper_next(&short_edge);
+        }
+    }
+}
+
+/**
+ * @brief Returns the canvas view of tile t, t counting tiles row by row.
+ */
+static Canvas canvas_tile(Canvas canvas, size_t t, int *tx, int *ty)
+{
+    size_t tiles_x = (canvas.width + TILE_SIZE - 1) / TILE_SIZE;
+    *tx = (t % tiles_x) * TILE_SIZE;
+    *ty = (t / tiles_x) * TILE_SIZE;
+    int tw = canvas.width  - *tx < TILE_SIZE ? canvas.width  - *tx : TILE_SIZE;
+    int th = canvas.height - *ty < TILE_SIZE ? canvas.height - *ty : TILE_SIZE;
+    return canvas_subview(canvas, *tx, *ty, tw, th);
+}
+
+/**
+ * @brief Records the damage of a tile once, the union of the bounds of the
+ * items binned into it, instead of once per item drawn on it.
+ */
+static void add_tile_damage(Canvas canvas, Canvas tile, int tx, int ty, const Rect *bounds,
+                            const size_t *bins, size_t first, size_t last)
+{
+    if (canvas.damage == NULL || first == last) return;
+
+    Rect box = bounds[bins[first]];
+    for (size_t b = first + 1; b < last; b++)
+    {
+        box = rect_union(box, bounds[bins[b]]);
+    }
+    add_damage(canvas, box.x0 > tx ? box.x0 : tx, box.y0 > ty ? box.y0 : ty,
+               box.x1 < tx + (long long)tile.width ? box.x1 : tx + (long long)tile.width,
+               box.y1 < ty + (long long)tile.height ? box.y1 : ty + (long long)tile.height);
+}
+
+/**
+ * @brief Sorts items into the canvas tiles their bounding boxes touch.
+ * 
+ * @param canvas Canvas whose TILE_SIZE x TILE_SIZE tiles are the bins.
+ * @param bounds Bounding box of every item, [x0, x1) x [y0, y1).
+ * @param count Number of items.
+ * @param ends Receives, for every tile t, the end of its items in the returned array:
+ * tile t holds bins[t == 0 ? 0 : ends[t - 1] .. ends[t]).
+ * @return Array of item indices grouped per tile and in item order within a tile,
+ * or NULL if out of memory. Both arrays must be freed by the caller.
+ */
+static size_t *bin_rects(Canvas canvas, const Rect *bounds, size_t count, size_t **ends)
+{
+    Rect clip = clip_rect(canvas);
+    size_t tiles_x = (canvas.width  + TILE_SIZE - 1) / TILE_SIZE;
+    size_t tiles_y = (canvas.height + TILE_SIZE - 1) / TILE_SIZE;
+    size_t tile_count = tiles_x * tiles_y;
+
+    // After the prefix sum offsets[t] is where the items touching tile t start in bins.
+    size_t *offsets = calloc(tile_count + 1, sizeof(size_t));
+    if (offsets == NULL) return NULL;
+
+    // First pass counts the items per tile, the second one fills the bins.
+    size_t *bins = NULL;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            int x0 = bounds[i].x0 < clip.x0 ? clip.x0 : bounds[i].x0;
+            int y0 = bounds[i].y0 < clip.y0 ? clip.y0 : bounds[i].y0;
+            int x1 = bounds[i].x1 > clip.x1 ? clip.x1 : bounds[i].x1;
+            int y1 = bounds[i].y1 > clip.y1 ? clip.y1 : bounds[i].y1;
+            if (x0 >= x1 || y0 >= y1) continue;
+
+            for (int ty = y0 / TILE_SIZE; ty <= (y1 - 1) / TILE_SIZE; ty++)
+            {
+                for (int tx = x0 / TILE_SIZE; tx <= (x1 - 1) / TILE_SIZE; tx++)
+                {
+                    size_t tile = ty * tiles_x + tx;
+                    if (pass == 0) offsets[tile + 1]++;
+                    else           bins[offsets[tile]++] = i;
+                }
+            }
+        }
+
+        if (pass == 0)
+        {
+            for (size_t t = 0; t < tile_count; t++)
+            {
+                offsets[t + 1] += offsets[t];
+            }
+            bins = malloc(sizeof(size_t) * (offsets[tile_count] + 1));
+            if (bins == NULL)
+            {
+                free(offsets);
+                return NULL;
+            }
+        }
+    }
+
+    // Filling advanced offsets[t] to the end of bin t.
+    *ends = offsets;
+    return bins;
+}
+
+/**
+ * @brief Draw a batch of filled triangles.
+ * 
+ * Triangles are binned into TILE_SIZE x TILE_SIZE tiles by their bounding box
+ * and rasterized one tile at a time, so only a tile worth of canvas memory is
+ * touched at once. Within every tile triangles are drawn in submission order,
+ * the result is identical to calling draw_filled_triangle for each of them.
+ * 
+ * @param canvas Canvas to draw on.
+ * @param points Vertices of the triangles, three per triangle.
+ * @param colors Color of each triangle.
+ * @param count Number of triangles.
+ */
+void draw_triangles(Canvas canvas, const Point *points, const uint32_t *colors, size_t count)
+{
+    size_t tile_count = ((canvas.width  + TILE_SIZE - 1) / TILE_SIZE) *
+                        ((canvas.height + TILE_SIZE - 1) / TILE_SIZE);
+    if (count == 0 || tile_count == 0) return;
+
+    size_t *ends = NULL;
+    size_t *bins = NULL;
+    Rect *bounds = malloc(sizeof(Rect) * count);
+    if (bounds != NULL)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            const Point *p = &points[i * 3];
+
+            // Covered rows are [min_y, max_y), covered columns [min_x, max_x].
+            Rect box = { p[0].x, p[0].y, p[0].x, p[0].y };
+            for (int k = 1; k < 3; k++)
+            {
+                if (p[k].x < box.x0) box.x0 = p[k].x;
+                if (p[k].x > box.x1) box.x1 = p[k].x;
+                if (p[k].y < box.y0) box.y0 = p[k].y;
+                if (p[k].y > box.y1) box.y1 = p[k].y;
+            }
+            box.x1++;
+            bounds[i] = box;
+        }
+        bins = bin_rects(canvas, bounds, count, &ends);
+    }
+
+    // Out of memory, draw the triangles unbinned.
+    if (bins == NULL)
+    {
+        free(bounds);
+        for (size_t i = 0; i < count; i++)
+        {
+            const Point *p = &points[i * 3];
+            draw_filled_triangle(canvas, p[0].x, p[0].y, p[1].x, p[1].y, p[2].x, p[2].y, colors[i]);
+        }
+        return;
+    }
+
+    for (size_t t = 0; t < tile_count; t++)
+    {
+        int tx, ty;
+        Canvas tile = canvas_tile(canvas, t, &tx, &ty);
+        tile.damage = NULL;
+        add_tile_damage(canvas, tile, tx, ty, bounds, bins, t == 0 ? 0 : ends[t - 1], ends[t]);
+
+        for (size_t b = (t == 0 ? 0 : ends[t - 1]); b < ends[t]; b++)
+        {
+            const Point *p = &points[bins[b] * 3];
+            draw_filled_triangle(tile,
+                                 p[0].x - tx, p[0].y - ty,
+                                 p[1].x - tx, p[1].y - ty,
+                                 p[2].x - tx, p[2].y - ty,
+                                 colors[bins[b]]);
+        }
+    }
+
+    free(bins);
+    free(ends);
+    free(bounds);
+}
+
+/**
+ * @brief Draw a filled rectangle.
+ * 
+ * The rectangle covers the pixels from (x1, y1) to (x1 + width, y1 + height),
+ * both corners included. Negative sizes extend the rectangle to the left/up.
+ * It is clipped once and then blended row by row, opaque
+ * colors taking a plain store path.
+ * 
+ * @param canvas Canvas to draw on.
+ * @param x1 X coordinate of the corner.
+ * @param y1 Y coordinate of the corner.
+ * @param width Horizontal extent of the rectangle.
+ * @param height Vertical extent of the rectangle.
+ * @param color Color of the rectangle.
+ */
+void draw_rect(Canvas canvas, int x1, int y1, int width, int height, uint32_t color)
+{
+    // Normalize the rectangle so that (x1, y1) is its top left corner.
+    long long left = x1, top = y1;
+    long long right = (long long)x1 + width;
+    long long bottom = (long long)y1 + height;
+    if (left > right) SWAP(long long, left, right);
+    if (top > bottom) SWAP(long long, top, bottom);
+
+    // Clip once, the rows are then blended without checks.
+    Rect clip = clip_rect(canvas);
+    if (left < clip.x0) left = clip.x0;
+    if (top < clip.y0) top = clip.y0;
+    if (right >= clip.x1) right = (long long)clip.x1 - 1;
+    if (bottom >= clip.y1) bottom = (long long)clip.y1 - 1;
+    if (left > right || top > bottom) return;
+    add_damage(canvas, left, top, right + 1, bottom + 1);
+
+    for (long long y = top; y <= bottom; y++)
+    {
+        blend_row(canvas, &PIXEL(canvas, left, y), right - left + 1, color);
+    }
+}
+
+/**
+ * @brief Whether the square of half size radius around (x, y) misses the clip.
+ */
+static inline int circle_outside(Rect clip, int x, int y, int radius)
+{
+    return (long long)x + radius < clip.x0 || (long long)x - radius >= clip.x1 ||
+           (long long)y + radius < clip.y0 || (long long)y - radius >= clip.y1;
+}
+
+/**
+ * @brief Blends source, converted by source_color(), at the columns cx +- a of
+ * the rows cy +- b. Every row and column is checked against the clip once.
+ * 
+ * @param once Blend a position once when +a and -a, or +b and -b, are the same.
+ */
+static inline void blend_mirrored_pair(Canvas canvas, Rect clip, PixelBlend blend, int cx, int cy, int a, int b, uint32_t source, int once)
+{
+    int left = cx - a, right = cx + a;
+    int blend_left = left >= clip.x0 && left < clip.x1;
+    int blend_right = right >= clip.x0 && right < clip.x1 && !(once && a == 0);
+
+    int rows[2] = { cy + b, cy - b };
+    int row_count = once && b == 0 ? 1 : 2;
+    for (int i = 0; i < row_count; i++)
+    {
+        if (rows[i] < clip.y0 || rows[i] >= clip.y1) continue;
+
+        uint32_t *row = &PIXEL(canvas, 0, rows[i]);
+        if (blend_right) row[right] = blend(row[right], source);
+        if (blend_left)  row[left]  = blend(row[left], source);
+    }
+}
+
+void draw_circle(Canvas canvas, int x0, int y0, int radius, uint32_t color) {
+    Rect clip = clip_rect(canvas);
+    if (radius < 0 || ALPHA_CHAN(color) == 0 || circle_outside(clip, x0, y0, radius)) return;
+    add_damage(canvas, (long long)x0 - radius, (long long)y0 - radius,
+               (long long)x0 + radius + 1, (long long)y0 + radius + 1);
+
+    uint32_t source = source_color(canvas, color);
+    PixelBlend blend = pixel_blend(canvas);
+    int x = 0;
+    int y = radius;
+    int d = 3 - 2 * radius;
+
+    while (x <= y) {
+        // The 8 octants, positions they share are blended twice.
+        blend_mirrored_pair(canvas, clip, blend, x0, y0, x, y, source, 0);
+        blend_mirrored_pair(canvas, clip, blend, x0, y0, y, x, source, 0);
+        if (d < 0) {
+            d = d + 4 * x + 6;
+        } else {
+            d = d + 4 * (x - y) + 10;
+            y--;
+        }
+        x++;
+    }
+}
+
+/**
+ * @brief Largest s with s * s <= n, for n >= 0.
+ */
+static inline long long isqrt_wide(__int128 n)
+{
+    long long s = (long long)sqrt((double)n);
+    while ((__int128)s * s > n) s--;
+    while ((__int128)(s + 1) * (s + 1) <= n) s++;
+    return s;
+}
+
+/**
+ * @brief Last column of the first octant of the midpoint walk of a circle, the
+ * largest x whose row y >= x, see circle_half_width().
+ */
+static long long circle_octant_end(long long radius)
+{
+    __int128 limit = (__int128)4 * radius * radius;
+    long long x = (long long)(radius / sqrt(2.0));
+    while (x > 0 && (__int128)8 * x * x - 4 * x + 2 >= limit) x--;
+    while ((__int128)8 * (x + 1) * (x + 1) - 4 * (x + 1) + 2 < limit) x++;
+    return x;
+}
+
+/**
+ * @brief Half width of the rows k above and below the center of a filled
+ * circle, the one the midpoint walk finds, without walking.
+ * 
+ * At column x of the first octant the walk is on the largest row y with
+ * 4x^2 + (2y - 1)^2 < 4r^2 - 1. Rows up to the end of the octant are as wide as
+ * the row of column k, the others reach the last column whose row is at least k.
+ */
+static long long circle_half_width(long long radius, long long octant_end, long long k)
+{
+    if (radius == 0) return 0;
+
+    __int128 limit = (__int128)4 * radius * radius - 1;
+    if (k <= octant_end) return (isqrt_wide(limit - (__int128)4 * k * k - 1) + 1) / 2;
+
+    long long x = isqrt_wide(limit - (__int128)(2 * k - 1) * (2 * k - 1) - 1) / 2;
+    return x < octant_end ? x : octant_end;
+}
+
+/**
+ * @brief Draws a filled circle, blending every pixel once.
+ * 
+ * The outline is the one of draw_circle(). Its midpoint walk only records the half
+ * width of every row, then each row is blended as a single span. Circles much
+ * taller than the clip get the half widths of the clipped rows computed
+ * directly instead, so neither time nor memory depends on the radius.
+ * 
+ * @param canvas Canvas to draw on.
+ * @param x X coordinate of the center.
+ * @param y Y coordinate of the center.
+ * @param radius Radius in pixels.
+ * @param color Color to blend.
+ */
+void draw_filled_circle(Canvas canvas, int x, int y, int radius, uint32_t color)
+{
+    Rect clip = clip_rect(canvas);
+    if (radius < 0 || ALPHA_CHAN(color) == 0 || circle_outside(clip, x, y, radius)) return;
+
+    long long top = (long long)y - radius, bottom = (long long)y + radius;
+    if (top < clip.y0) top = clip.y0;
+    if (bottom > (long long)clip.y1 - 1) bottom = (long long)clip.y1 - 1;
+    add_damage(canvas, (long long)x - radius, top, (long long)x + radius + 1, bottom + 1);
+
+    if (radius > bottom - top)
+    {
+        long long octant_end = circle_octant_end(radius);
+        for (long long row = top; row <= bottom; row++)
+        {
+            long long half = circle_half_width(radius, octant_end, row < y ? y - row : row - y);
+            blend_edge_span(canvas, clip, x - half, x + half, row, color);
+        }
+        return;
+    }
+
+    // half[k] is the half width of the rows k above and below the center.
+    int small[256];
+    int *half = radius < 256 ? small : malloc(sizeof(int) * (radius + 1));
+    if (half == NULL) return;
+    for (int k = 0; k <= radius; k++)
+    {
+        half[k] = -1;
+    }
+
+    int x1 = 0;
+    int y1 = radius;
+    long long d = 3 - 2 * (long long)radius;
+
+    while (y1 >= x1)
+    {
+        if (x1 > half[y1]) half[y1] = x1;
+        if (y1 > half[x1]) half[x1] = y1;
+
+        if (d < 0)
+            d += 4 * (long long)x1 + 6;
+        else
+        {
+            d += 4 * ((long long)x1 - y1) + 10;
+            y1--;
+        }
+        x1++;
+    }
+
+    for (long long row = top; row <= bottom; row++)
+    {
+        int k = row < y ? y - row : row - y;
+        if (half[k] >= 0) blend_edge_span(canvas, clip, (long long)x - half[k], (long long)x + half[k], row, color);
+    }
+
+    if (half != small) free(half);
+}
+
+/**
+ * @brief Draws a filled axis-aligned ellipse, blending every pixel once.
+ * 
+ * Covers the pixels whose offset (dx, dy) from the center satisfies
+ * (dx / (rx + 0.5))^2 + (dy / (ry + 0.5))^2 <= 1, one span per row.
+ * 
+ * @param canvas Canvas to draw on.
+ * @param x X coordinate of the center.
+ * @param y Y coordinate of the center.
+ * @param rx Horizontal radius in pixels.
+ * @param ry Vertical radius in pixels.
+ * @param color Color to blend.
+ */
+void draw_filled_ellipse(Canvas canvas, int x, int y, int rx, int ry, uint32_t color)
+{
+    if (rx < 0 || ry < 0) return;
+
+    Rect clip = clip_rect(canvas);
+    long long top = (long long)y - ry, bottom = (long long)y + ry;
+    if (top < clip.y0) top = clip.y0;
+    if (bottom > (long long)clip.y1 - 1) bottom = (long long)clip.y1 - 1;
+    add_damage(canvas, (long long)x - rx, top, (long long)x + rx + 1, bottom + 1);
+
+    double a = rx + 0.5, b = ry + 0.5;
+    for (long long row = top; row <= bottom; row++)
+    {
+        double t = (row - y) / b;
+        int half = (int)floor(a * sqrt(1.0 - t * t));
+        if (half > rx) half = rx;
+        blend_span_untracked(canvas, x - half, row, 2 * half + 1, color);
+    }
+}
+
+/**
+ * @brief Scales the alpha of a color by a coverage in [0, 255].
+ */
+static inline uint32_t with_coverage(uint32_t color, uint32_t coverage)
+{
+    uint32_t alpha = ALPHA_CHAN(color) * coverage + 128;
+    alpha = (alpha + (alpha >> 8)) >> 8;
+    return (color & 0x00FFFFFF) | (alpha << 24);
+}
+
+/**
+ * @brief Draw an anti-aliased line between two points (Xiaolin Wu's algorithm).
+ * 
+ * The line runs through the centers of the end pixels. Along the major axis each
+ * step covers two pixels, weighted by the distance of the exact position to them.
+ * 
+ * @param canvas Canvas to draw on.
+ * @param x0 X coordinate of the first point.
+ * @param y0 Y coordinate of the first point.
+ * @param x1 X coordinate of the second point.
+ * @param y1 Y coordinate of the second point.
+ * @param color Color of the line, its alpha is scaled by the coverage.
+ */
+void draw_line_aa(Canvas canvas, int x0, int y0, int x1, int y1, uint32_t color)
+{
+    // The minor axis covers the pixel after the exact position too.
+    add_damage(canvas, x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1,
+               (long long)(x0 > x1 ? x0 : x1) + 2, (long long)(y0 > y1 ? y0 : y1) + 2);
+
+    int steep = llabs((long long)y1 - y0) > llabs((long long)x1 - x0);
+    if (steep)
+    {
+        SWAP(int, x0, y0);
+        SWAP(int, x1, y1);
+    }
+    if (x0 > x1)
+    {
+        SWAP(int, x0, x1);
+        SWAP(int, y0, y1);
+    }
+
+    // Only walk the part of the major axis that is inside the clip, the two
+    // pixels of every step are checked against the minor axis range.
+    Rect clip = clip_rect(canvas);
+    int lower = steep ? clip.y0 : clip.x0;
+    int limit = steep ? clip.y1 : clip.x1;
+    int minor_lower = steep ? clip.x0 : clip.y0;
+    int minor_limit = steep ? clip.x1 : clip.y1;
+    int start = x0 < lower ? lower : x0;
+    int end = x1 >= limit ? limit - 1 : x1;
+    if (start > end) return;
+
+    // Minor coordinate in 32.32 fixed point. The gradient is at most one, but
+    // the deltas and the distance to the clipped start take up to 33 bits each,
+    // so products with them are done in 128 bits unless they fit.
+    long long dx = (long long)x1 - x0, dy = (long long)y1 - y0;
+    int64_t gradient = 0;
+    if (dx != 0 && llabs(dy) <= INT_MAX)
+        gradient = dy * ((int64_t)1 << 32) / dx;
+    else if (dx != 0)
+        gradient = (int64_t)((__int128)dy * ((int64_t)1 << 32) / dx);
+    int64_t position = (int64_t)((__int128)y0 * ((int64_t)1 << 32) + (__int128)gradient * ((long long)start - x0));
+    PixelBlend blend = pixel_blend(canvas);
+
+    for (int x = start; x <= end; x++, position += gradient)
+    {
+        int y = (int)(position >> 32);
+        uint32_t fraction = (uint32_t)(position >> 24) & 0xFF;
+        uint32_t coverage[2] = { 255 - fraction, fraction };
+        for (int k = 0; k < 2; k++)
+        {
+            int minor = y + k;
+            uint32_t src = with_coverage(color, coverage[k]);
+            if (minor < minor_lower || minor >= minor_limit || ALPHA_CHAN(src) == 0) continue;
+
+            uint32_t *dest = steep ? &PIXEL(canvas, minor, x) : &PIXEL(canvas, x, minor);
+            *dest = blend(*dest, source_color(canvas, src));
+        }
+    }
+}
+
+/**
+ * @brief Blends the pixels at the up to 8 mirrored positions (+-a, +-b) and
+ * (+-b, +-a) around a center, each position once.
+ */
+static void blend_mirrored(Canvas canvas, Rect clip, PixelBlend blend, int cx, int cy, int a, int b, uint32_t color, uint32_t coverage)
+{
+    uint32_t src = with_coverage(color, coverage);
+    if (ALPHA_CHAN(src) == 0) return;
+
+    uint32_t source = source_color(canvas, src);
+    blend_mirrored_pair(canvas, clip, blend, cx, cy, a, b, source, 1);
+    if (a != b) blend_mirrored_pair(canvas, clip, blend, cx, cy, b, a, source, 1);
+}
+
+/**
+ * @brief Draw an anti-aliased circle outline (Xiaolin Wu's algorithm).
+ * 
+ * For every column of the first octant the exact height sqrt(r^2 - x^2) is split
+ * between the two pixels around it, then mirrored to the other octants.
+ * 
+ * @param canvas Canvas to draw on.
+ * @param x X coordinate of the center.
+ * @param y Y coordinate of the center.
+ * @param radius Radius in pixels.
+ * @param color Color of the outline, its alpha is scaled by the coverage.
+ */
+void draw_circle_aa(Canvas canvas, int x, int y, int radius, uint32_t color)
+{
+    Rect clip = clip_rect(canvas);
+    if (radius < 0 || circle_outside(clip, x, y, radius)) return;
+    add_damage(canvas, (long long)x - radius, (long long)y - radius,
+               (long long)x + radius + 1, (long long)y + radius + 1);
+    PixelBlend blend = pixel_blend(canvas);
+
+    // Columns of the first octant, where i <= height.
+    for (int i = 0; 2.0 * i * i <= (double)radius * radius; i++)
+    {
+        double height = sqrt((double)radius * radius - (double)i * i);
+
+        int j = (int)height;
+        uint32_t fraction = (uint32_t)((height - j) * 255 + 0.5);
+        blend_mirrored(canvas, clip, blend, x, y, i, j, color, 255 - fraction);
+        if (fraction != 0) blend_mirrored(canvas, clip, blend, x, y, i, j + 1, color, fraction);
+    }
+}
+
+// Coverage cell: value is added to the running sum of row y from pixel x on.
+typedef struct
+{
+    int x;
+    int y;
+    float value;
+} Cell;
+
+// Sparse cells of a shape being rasterized, in no particular order.
+typedef struct
+{
+    Cell *cells;
+    size_t count;
+    size_t capacity;
+    int left;       // canvas column of cell column 0
+    int top;        // canvas row of cell row 0
+    int width;      // of the clip, cells are in columns [0, width + 1]
+    int height;     // of the clip, cells are in rows [0, height)
+    int failed;     // set when growing the buffer failed
+} CellBuffer;
+
+static inline void add_cell(CellBuffer *buffer, int x, int y, float value)
+{
+    if (buffer->count == buffer->capacity)
+    {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+        Cell *cells = realloc(buffer->cells, sizeof(Cell) * capacity);
+        if (cells == NULL)
+        {
+            buffer->failed = 1;
+            return;
+        }
+        buffer->cells = cells;
+        buffer->capacity = capacity;
+    }
+
+    Cell cell = { .x = x, .y = y, .value = value };
+    buffer->cells[buffer->count++] = cell;
+}
+
+/**
+ * @brief Adds the signed area of a segment within pixel row y.
+ * 
+ * y0 and y1 are in [0, 1], relative to the row. A segment going down adds its
+ * coverage to the cells it crosses, the running sum of the cells then gives the
+ * coverage of every pixel (the method of font-rs and stb_truetype). Parts left
+ * of the clip count as lying on its left edge, parts right of it are dropped.
+ */
+static void accumulate_segment(CellBuffer *buffer, int y, float x0, float y0, float x1, float y1)
+{
+    if (y0 == y1) return;
+    float width = buffer->width;
+
+    // Split off the part left of the clip, it covers the whole row.
+    if ((x0 < 0) != (x1 < 0))
+    {
+        float split = y0 + (y1 - y0) * (0 - x0) / (x1 - x0);
+        if (x0 < 0)
+        {
+            accumulate_segment(buffer, y, 0, y0, 0, split);
+            x0 = 0;
+            y0 = split;
+        }
+        else
+        {
+            accumulate_segment(buffer, y, 0, split, 0, y1);
+            x1 = 0;
+            y1 = split;
+        }
+    }
+    if (x0 < 0) x0 = x1 = 0;
+
+    // Parts right of the clip only reach cells past its last pixel.
+    if ((x0 > width) != (x1 > width))
+    {
+        float split = y0 + (y1 - y0) * (width - x0) / (x1 - x0);
+        if (x0 > width)
+        {
+            x0 = width;
+            y0 = split;
+        }
+        else
+        {
+            x1 = width;
+            y1 = split;
+        }
+    }
+    if (x0 > width) return;
+
+    float d = y1 - y0;
+    if (x0 > x1)
+    {
+        SWAP(float, x0, x1);
+    }
+
+    int i0 = (int)x0;
+    int i1 = (int)ceilf(x1);
+    if (i1 <= i0 + 1)
+    {
+        // Within one cell: the part right of the segment's middle is covered.
+        float middle = 0.5f * (x0 + x1) - i0;
+        add_cell(buffer, i0, y, d * (1 - middle));
+        add_cell(buffer, i0 + 1, y, d * middle);
+        return;
+    }
+
+    // Across cells: the covered area grows linearly between the end cells.
+    float slope = 1 / (x1 - x0);
+    float f0 = x0 - i0;
+    float a0 = 0.5f * slope * (1 - f0) * (1 - f0);
+    float f1 = x1 - i1 + 1;
+    float a_end = 0.5f * slope * f1 * f1;
+
+    add_cell(buffer, i0, y, d * a0);
+    if (i1 == i0 + 2)
+    {
+        add_cell(buffer, i0 + 1, y, d * (1 - a0 - a_end));
+    }
+    else
+    {
+        float a1 = slope * (1.5f - f0);
+        add_cell(buffer, i0 + 1, y, d * (a1 - a0));
+        for (int i = i0 + 2; i < i1 - 1; i++)
+        {
+            add_cell(buffer, i, y, d * slope);
+        }
+        float a2 = a1 + (i1 - i0 - 3) * slope;
+        add_cell(buffer, i1 - 1, y, d * (1 - a2 - a_end));
+    }
+    add_cell(buffer, i1, y, d * a_end);
+}
+
+/**
+ * @brief Adds the cells of an edge, clipped to the rows of the clip.
+ */
+static void accumulate_edge(CellBuffer *buffer, float ax, float ay, float bx, float by)
+{
+    if (ay == by) return;
+    ax -= buffer->left, bx -= buffer->left;
+    ay -= buffer->top, by -= buffer->top;
+
+    float top = fmaxf(floorf(fminf(ay, by)), 0);
+    float bottom = fminf(ceilf(fmaxf(ay, by)), buffer->height);
+    float slope = (bx - ax) / (by - ay);
+
+    for (int y = (int)top; y < (int)bottom; y++)
+    {
+        // Part of the edge within the row, in the direction of the edge.
+        float lo = fmaxf(fminf(ay, by), y), hi = fminf(fmaxf(ay, by), y + 1);
+        float sy = ay < by ? lo : hi, ey = ay < by ? hi : lo;
+        accumulate_segment(buffer, y, ax + (sy - ay) * slope, sy - y, ax + (ey - ay) * slope, ey - y);
+    }
+}
+
+/**
+ * @brief Coverage in [0, 255] of an accumulated cell sum.
+ */
+static inline uint32_t cell_coverage(float sum, FillRule rule)
+{
+    float amount = fabsf(sum);
+    if (rule == FILL_EVEN_ODD)
+    {
+        amount = fmodf(amount, 2);
+        if (amount > 1) amount = 2 - amount;
+    }
+    return amount >= 1 ? 255 : (uint32_t)(amount * 255 + 0.5f);
+}
+
+/**
+ * @brief Blends pixels x to end of a row with the same coverage.
+ */
+static inline void blend_covered_run(Canvas canvas, uint32_t *row, int x, int end, uint32_t color, uint32_t coverage)
+{
+    if (x >= end || coverage == 0) return;
+    blend_row(canvas, row + x, end - x, coverage == 255 ? color : with_coverage(color, coverage));
+}
+
+/**
+ * @brief Orders the cells of a row by column, keeping the order of equal columns.
+ * 
+ * Short rows use insertion sort, long ones an LSD radix sort on bytes of the
+ * column through scratch, which has room for count cells.
+ */
+static void sort_cells(Cell *cells, Cell *scratch, size_t count, int max_column)
+{
+    if (count <= 32)
+    {
+        for (size_t i = 1; i < count; i++)
+        {
+            Cell cell = cells[i];
+            size_t j = i;
+            for (; j > 0 && cells[j - 1].x > cell.x; j--)
+            {
+                cells[j] = cells[j - 1];
+            }
+            cells[j] = cell;
+        }
+        return;
+    }
+
+    Cell *from = cells, *to = scratch;
+    for (int shift = 0; (max_column >> shift) > 0; shift += 8)
+    {
+        size_t offsets[256] = { 0 };
+        for (size_t i = 0; i < count; i++)
+        {
+            offsets[(from[i].x >> shift) & 0xFF]++;
+        }
+        size_t total = 0;
+        for (int b = 0; b < 256; b++)
+        {
+            size_t n = offsets[b];
+            offsets[b] = total;
+            total += n;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            to[offsets[(from[i].x >> shift) & 0xFF]++] = from[i];
+        }
+        SWAP(Cell *, from, to);
+    }
+    if (from != cells) memcpy(cells, from, sizeof(Cell) * count);
+}
+
+/**
+ * @brief Blends the coverage of a cell buffer onto the canvas.
+ * 
+ * Cells are bucketed by row with a counting sort and ordered by column within
+ * their row. Between two cells the coverage is constant, so those runs are
+ * blended as spans. The cost follows the number of cells, the length of the
+ * edges, and the covered pixels, not the area of the bounding box.
+ */
+static void resolve_cells(Canvas canvas, CellBuffer *buffer, FillRule rule, uint32_t color)
+{
+    if (buffer->count == 0 || buffer->failed) return;
+
+    int top = buffer->height, bottom = 0, left = buffer->width, right = 0;
+    for (size_t i = 0; i < buffer->count; i++)
+    {
+        if (buffer->cells[i].y < top) top = buffer->cells[i].y;
+        if (buffer->cells[i].y >= bottom) bottom = buffer->cells[i].y + 1;
+        if (buffer->cells[i].x < left) left = buffer->cells[i].x;
+    }
+
+    // ends[r] is one past the last cell of row top + r once sorted.
+    // One allocation: the sorted cells, radix sort scratch, then ends.
+    size_t rows = bottom - top;
+    Cell *sorted = malloc(sizeof(Cell) * buffer->count * 2 + sizeof(size_t) * rows);
+    if (sorted == NULL) return;
+    Cell *scratch = sorted + buffer->count;
+    size_t *ends = (size_t *)(scratch + buffer->count);
+    memset(ends, 0, sizeof(size_t) * rows);
+
+    for (size_t i = 0; i < buffer->count; i++)
+    {
+        ends[buffer->cells[i].y - top]++;
+    }
+    for (size_t r = 1; r < rows; r++)
+    {
+        ends[r] += ends[r - 1];
+    }
+    for (size_t i = buffer->count; i-- > 0; )
+    {
+        sorted[--ends[buffer->cells[i].y - top]] = buffer->cells[i];
+    }
+    // ends[r] is now the first cell of row top + r.
+
+    int width = buffer->width;
+    PixelBlend blend = pixel_blend(canvas);
+    for (size_t r = 0; r < rows; r++)
+    {
+        size_t first = ends[r];
+        size_t last = r + 1 < rows ? ends[r + 1] : buffer->count;
+        Cell *cells = &sorted[first];
+        size_t count = last - first;
+        sort_cells(cells, scratch, count, width + 1);
+
+        uint32_t *row = &PIXEL(canvas, buffer->left, buffer->top + top + (int)r);
+        float sum = 0;
+        int x = 0;  // first pixel not blended yet
+        for (size_t i = 0; i < count; )
+        {
+            int column = cells[i].x;
+            if (column >= width) break;
+
+            blend_covered_run(canvas, row, x, column, color, cell_coverage(sum, rule));
+            for (; i < count && cells[i].x == column; i++)
+            {
+                sum += cells[i].value;
+            }
+
+            uint32_t coverage = cell_coverage(sum, rule);
+            if (coverage != 0) row[column] = blend(row[column], source_color(canvas, with_coverage(color, coverage)));
+            x = column + 1;
+        }
+        uint32_t coverage = cell_coverage(sum, rule);
+        blend_covered_run(canvas, row, x, width, color, coverage);
+        if (coverage != 0) x = width;
+        if (x > right) right = x;
+    }
+
+    add_damage(canvas, (long long)buffer->left + left, (long long)buffer->top + top,
+               (long long)buffer->left + right, (long long)buffer->top + bottom);
+    free(sorted);
+}
+
+static CellBuffer create_cell_buffer(Canvas canvas)
+{
+    Rect clip = clip_rect(canvas);
+    CellBuffer buffer = {
+        .cells    = NULL,
+        .count    = 0,
+        .capacity = 0,
+        .left     = clip.x0,
+        .top      = clip.y0,
+        .width    = clip.x1 - clip.x0,
+        .height   = clip.y1 - clip.y0,
+        .failed   = 0,
+    };
+    return buffer;
+}
+
+/**
+ * @brief Draw a filled triangle with anti-aliased edges.
+ * 
+ * Vertices are at the centers of their pixels, like draw_line_aa(). Edge pixels
+ * blend the color with their exact covered area, inner runs are blended as spans.
+ * 
+ * @param canvas Canvas to draw on.
+ * @param color Color of the triangle, its alpha is scaled by the coverage.
+ */
+void draw_filled_triangle_aa(Canvas canvas, int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color)
+{
+    if (ALPHA_CHAN(color) == 0) return;
+
+    float points[6] = {
+        x0 + 0.5f, y0 + 0.5f,
+        x1 + 0.5f, y1 + 0.5f,
+        x2 + 0.5f, y2 + 0.5f,
+    };
+
+    CellBuffer buffer = create_cell_buffer(canvas);
+    for (int i = 0; i < 3; i++)
+    {
+        int j = i == 2 ? 0 : i + 1;
+        accumulate_edge(&buffer, points[2 * i], points[2 * i + 1], points[2 * j], points[2 * j + 1]);
+    }
+    resolve_cells(canvas, &buffer, FILL_NONZERO, color);
+    free(buffer.cells);
+}
+
+/**
+ * @brief Creates an empty path.
+ */
+Path create_path(void)
+{
+    Path path = {
+        .segments = NULL,
+        .count    = 0,
+        .capacity = 0,
+        .start_x  = 0,
+        .start_y  = 0,
+        .x        = 0,
+        .y        = 0,
+    };
+    return path;
+}
+
+/**
+ * @brief Frees the segments of a path and empties it.
+ */
+void free_path(Path *path)
+{
+    free(path->segments);
+    *path = create_path();
+}
+
+static void push_segment(Path *path, float x, float y)
+{
+    if (path->count == path->capacity)
+    {
+        size_t capacity = path->capacity ? path->capacity * 2 : 16;
+        PathSegment *segments = realloc(path->segments, sizeof(PathSegment) * capacity);
+        if (segments == NULL) return;
+        path->segments = segments;
+        path->capacity = capacity;
+    }
+
+    PathSegment segment = { .x0 = path->x, .y0 = path->y, .x1 = x, .y1 = y };
+    path->segments[path->count++] = segment;
+    path->x = x;
+    path->y = y;
+}
+
+/**
+ * @brief Closes the current contour with a line back to its first point.
+ */
+void path_close(Path *path)
+{
+    if (path->x != path->start_x || path->y != path->start_y)
+    {
+        push_segment(path, path->start_x, path->start_y);
+    }
+}
+
+/**
+ * @brief Closes the current contour and starts a new one at (x, y).
+ * 
+ * Path coordinates are in pixels, pixel (x, y) covers [x, x + 1] x [y, y + 1].
+ */
+void path_move_to(Path *path, float x, float y)
+{
+    path_close(path);
+    path->start_x = path->x = x;
+    path->start_y = path->y = y;
+}
+
+/**
+ * @brief Adds a line from the current point to (x, y).
+ */
+void path_line_to(Path *path, float x, float y)
+{
+    push_segment(path, x, y);
+}
+
+// Largest distance, in pixels, between a curve and the lines that replace it.
+#define CURVE_TOLERANCE 0.25f
+
+/**
+ * @brief Adds a quadratic Bezier curve from the current point to (x, y),
+ * flattened to lines.
+ */
+void path_quad_to(Path *path, float cx, float cy, float x, float y)
+{
+    // n lines deviate at most |p0 - 2 p1 + p2| / (8 n^2) from the curve.
+    float x0 = path->x, y0 = path->y;
+    float dd = hypotf(x0 - 2 * cx + x, y0 - 2 * cy + y);
+    int n = (int)ceilf(sqrtf(dd / (8 * CURVE_TOLERANCE)));
+    if (n < 1) n = 1;
+    if (n > 1024) n = 1024;
+
+    for (int i = 1; i < n; i++)
+    {
+        float t = (float)i / n, u = 1 - t;
+        push_segment(path, u * u * x0 + 2 * u * t * cx + t * t * x,
+                           u * u * y0 + 2 * u * t * cy + t * t * y);
+    }
+    push_segment(path, x, y);
+}
+
+/**
+ * @brief Adds a cubic Bezier curve from the current point to (x, y),
+ * flattened to lines.
+ */
+void path_cubic_to(Path *path, float cx0, float cy0, float cx1, float cy1, float x, float y)
+{
+    // n lines deviate at most 3/4 max |p(i) - 2 p(i+1) + p(i+2)| / n^2 from the curve.
+    float x0 = path->x, y0 = path->y;
+    float dd = fmaxf(hypotf(x0 - 2 * cx0 + cx1, y0 - 2 * cy0 + cy1),
+                     hypotf(cx0 - 2 * cx1 + x, cy0 - 2 * cy1 + y));
+    int n = (int)ceilf(sqrtf(0.75f * dd / CURVE_TOLERANCE));
+    if (n < 1) n = 1;
+    if (n > 1024) n = 1024;
+
+    for (int i = 1; i < n; i++)
+    {
+        float t = (float)i / n, u = 1 - t;
+        float a = u * u * u, b = 3 * u * u * t, c = 3 * u * t * t, d = t * t * t;
+        push_segment(path, a * x0 + b * cx0 + c * cx1 + d * x,
+                           a * y0 + b * cy0 + c * cy1 + d * y);
+    }
+    push_segment(path, x, y);
+}
+
+/**
+ * @brief Fill a path with anti-aliased edges. Open contours are closed.
+ * 
+ * Edges add their signed area to a sparse set of coverage cells, which is then
+ * resolved row by row into spans, see resolve_cells(). The cost follows the
+ * length of the outline rather than the area of its bounding box, so many small
+ * shapes can share one path.
+ * 
+ * @param canvas Canvas to draw on.
+ * @param path Outline to fill.
+ * @param rule How self intersecting and nested contours are filled.
+ * @param color Color to blend, its alpha is scaled by the coverage.
+ */
+void fill_path(Canvas canvas, const Path *path, FillRule rule, uint32_t color)
+{
+    if (ALPHA_CHAN(color) == 0) return;
+
+    CellBuffer buffer = create_cell_buffer(canvas);
+    for (size_t i = 0; i < path->count; i++)
+    {
+        const PathSegment *segment = &path->segments[i];
+        accumulate_edge(&buffer, segment->x0, segment->y0, segment->x1, segment->y1);
+    }
+    accumulate_edge(&buffer, path->x, path->y, path->start_x, path->start_y);
+
+    resolve_cells(canvas, &buffer, rule, color);
+    free(buffer.cells);
+}
+
+// An edge of draw_polygon(), oriented downwards.
+typedef struct
+{
+    int y0, y1;         // rows [y0, y1) the edge crosses
+    int winding;        // 1 if the edge goes down, -1 if it goes up
+    int x, dx, dy;      // top end and extent
+    int crossing;       // first pixel at or right of the edge on the current row
+    Stepper left;       // walks -crossing
+} PolygonEdge;
+
+static int compare_edge_tops(const void *a, const void *b)
+{
+    const PolygonEdge *edge_a = a, *edge_b = b;
+    return (edge_a->y0 > edge_b->y0) - (edge_a->y0 < edge_b->y0);
+}
+
+/**
+ * @brief Draw a filled polygon with a scanline active edge table.
+ * 
+ * Pixel (x, y) is filled when the point (x, y) is inside, counting points on left
+ * and top edges as inside and points on right and bottom edges as outside, so
+ * polygons sharing an edge don't overlap. Every row is blended as spans between
+ * the crossings of the active edges, which are kept sorted from row to row. The
+ * cost is linear in edges and covered rows, plus sorting the edges once.
+ * 
+ * @param canvas Canvas to draw on.
+ * @param points Vertices, the last one connects back to the first.
+ * @param count Number of vertices.
+ * @param rule How self intersecting and nested outlines are filled.
+ * @param color Color to blend.
+ */
+void draw_polygon(Canvas canvas, const Point *points, size_t count, FillRule rule, uint32_t color)
+{
+    if (count < 3 || ALPHA_CHAN(color) == 0) return;
+
+    PolygonEdge *edges = malloc(sizeof(PolygonEdge) * count);
+    PolygonEdge **active = malloc(sizeof(PolygonEdge *) * count);
+    if (edges == NULL || active == NULL)
+    {
+        free(edges);
+        free(active);
+        return;
+    }
+
+    // Horizontal edges never cross a row.
+    size_t edge_count = 0;
+    int bottom = 0, left = points[0].x, right = points[0].x;
+    for (size_t i = 0; i < count; i++)
+    {
+        Point a = points[i];
+        Point b = points[i + 1 == count ? 0 : i + 1];
+        if (a.x < left) left = a.x;
+        if (a.x > right) right = a.x;
+        if (a.y == b.y) continue;
+
+        int winding = 1;
+        if (a.y > b.y)
+        {
+            SWAP(Point, a, b);
+            winding = -1;
+        }
+
+        PolygonEdge edge = {
+            .y0 = a.y, .y1 = b.y, .winding = winding,
+            .x = a.x, .dx = b.x - a.x, .dy = b.y - a.y,
+        };
+        edges[edge_count++] = edge;
+        if (b.y > bottom) bottom = b.y;
+    }
+    qsort(edges, edge_count, sizeof(PolygonEdge), compare_edge_tops);
+
+    Rect clip = clip_rect(canvas);
+    if (bottom > clip.y1) bottom = clip.y1;
+    size_t next = 0, active_count = 0;
+    if (edge_count > 0) add_damage(canvas, left, edges[0].y0, right, bottom);
+
+    for (int y = edge_count > 0 && edges[0].y0 > clip.y0 ? edges[0].y0 : clip.y0; y < bottom; y++)
+    {
+        // Drop the edges that ended, step the others to this row.
+        size_t kept = 0;
+        for (size_t i = 0; i < active_count; i++)
+        {
+            PolygonEdge *edge = active[i];
+            if (edge->y1 <= y) continue;
+
+            stepper_next(&edge->left);
+            edge->crossing = -edge->left.value;
+            active[kept++] = edge;
+        }
+        active_count = kept;
+
+        // Add the edges that start here, or above the canvas.
+        for (; next < edge_count && edges[next].y0 <= y; next++)
+        {
+            PolygonEdge *edge = &edges[next];
+            if (edge->y1 <= y) continue;
+
+            // crossing = ceil(x + dx * i / dy) = -floor(-x - dx * i / dy)
+            edge->left = stepper_init(-edge->x, -edge->dx, edge->dy, y - edge->y0);
+            edge->crossing = -edge->left.value;
+            active[active_count++] = edge;
+        }
+
+        if (active_count == 0)
+        {
+            if (next == edge_count) break;
+            y = edges[next].y0 - 1;
+            continue;
+        }
+
+        // Crossings move little from row to row, insertion sort is close to linear.
+        for (size_t i = 1; i < active_count; i++)
+        {
+            PolygonEdge *edge = active[i];
+            size_t j = i;
+            for (; j > 0 && active[j - 1]->crossing > edge->crossing; j--)
+            {
+                active[j] = active[j - 1];
+            }
+            active[j] = edge;
+        }
+
+        int winding = 0;
+        for (size_t i = 0; i + 1 < active_count; i++)
+        {
+            winding += rule == FILL_EVEN_ODD ? 1 : active[i]->winding;
+            int inside = rule == FILL_EVEN_ODD ? (winding & 1) : winding != 0;
+            if (inside && active[i + 1]->crossing > active[i]->crossing)
+            {
+                blend_span_untracked(canvas, active[i]->crossing, y, active[i + 1]->crossing - active[i]->crossing, color);
+            }
+        }
+    }
+
+    free(edges);
+    free(active);
+}
+
+void draw_grid(Canvas canvas, int x_count, int y_count, int margin, uint32_t color)
+{
+    int x1 = margin;
+    int x2 = canvas.width - margin;
+    int y1 = margin;
+    int y2 = canvas.height - margin;
+
+    double x_step = (double)(x2 - x1) / x_count;
+    double y_step = (double)(y2 - y1) / y_count;
+
+    for(int i = 0; i <= x_count; i++)
+    {
+        draw_line(canvas, x1 + i * x_step, y1, x1 + i * x_step, y2, color);
+    }
+
+    for(int i = 0; i <= y_count; i++)
+    {
+        draw_line(canvas, x1, y1 + i * y_step, x2, y1 + i * y_step, color);
+    }
+}
+
+/**
+ * @brief Fill the canvas, or the part of it inside the clip, with a color.
+ * 
+ * When the rows are contiguous the area is filled as a single run. Fills
+ * larger than STREAMING_FILL_BYTES use non-temporal stores, which bypass the
+ * cache instead of evicting everything else from it.
+ * 
+ * @param canvas Canvas to fill.
+ * @param color Color to fill the canvas with.
+ */
+void fill_canvas(Canvas canvas, uint32_t color)
+{
+    Rect clip = clip_rect(canvas);
+    size_t width = clip.x1 - clip.x0, height = clip.y1 - clip.y0;
+    size_t bytes = width * height * sizeof(uint32_t);
+    color = source_color(canvas, color);
+    FillKernel fill = bytes >= STREAMING_FILL_BYTES ? cpu_kernels()->fill_stream : fill_row;
+    add_damage(canvas, clip.x0, clip.y0, clip.x1, clip.y1);
+
+    if (canvas.stride == width)
+    {
+        fill(&PIXEL(canvas, clip.x0, clip.y0), width * height, color);
+        return;
+    }
+
+    for (size_t y = clip.y0; y < (size_t)clip.y1; y++)
+    {
+        fill(&PIXEL(canvas, clip.x0, y), width, color);
+    }
+}
+
+/**
+ * @brief Load an image file as packed RGBA pixels.
+ * 
+ * @return The pixels, to be released with stbi_image_free, or NULL on failure.
+ */
+static uint32_t *load_pixels(const char *filename, int *width, int *height)
+{
+    int channels;
+    unsigned char *data = stbi_load(filename, width, height, &channels, 4);
+    if (data == NULL) return NULL;
+
+    // Repack the channel bytes in place, every pixel keeps its 4 bytes.
+    uint32_t *pixels = (uint32_t *)data;
+    for (size_t i = 0; i < (size_t)*width * *height; i++)
+    {
+        unsigned char *p = &data[i * 4];
+        pixels[i] = RGBA(p[0], p[1], p[2], p[3]);
+    }
+    return pixels;
+}
+
+/**
+ * @brief Load and decode an image file.
+ * 
+ * @param filename Path of the image.
+ * @return The image, holding one reference, or NULL on failure.
+ */
+Image *load_image(const char *filename)
+{
+    Image *image = malloc(sizeof(Image));
+    if (image == NULL) return NULL;
+
+    image->pixels = load_pixels(filename, &image->width, &image->height);
+    if (image->pixels == NULL)
+    {
+        free(image);
+        return NULL;
+    }
+
+    image->rows = malloc(image->height);
+    if (image->rows == NULL)
+    {
+        stbi_image_free(image->pixels);
+        free(image);
+        return NULL;
+    }
+    int mixed = 0;
+    for (int y = 0; y < image->height; y++)
+    {
+        const uint32_t *row = &image->pixels[(size_t)y * image->width];
+        uint32_t all = 0xFF000000, any = 0;
+        for (int x = 0; x < image->width; x++)
+        {
+            all &= row[x];
+            any |= row[x];
+        }
+        image->rows[y] = (all & 0xFF000000) == 0xFF000000 ? ROW_OPAQUE :
+                         (any & 0xFF000000) == 0          ? ROW_TRANSPARENT : ROW_MIXED;
+        mixed |= image->rows[y] == ROW_MIXED;
+    }
+
+    // Premultiplied canvases blend a premultiplied copy, converted once here.
+    // Only ROW_MIXED rows are read from it, the others are left unset.
+    image->premultiplied = NULL;
+    if (mixed)
+    {
+        image->premultiplied = malloc((size_t)image->width * image->height * sizeof(uint32_t));
+        if (image->premultiplied == NULL)
+        {
+            stbi_image_free(image->pixels);
+            free(image->rows);
+            free(image);
+            return NULL;
+        }
+        for (int y = 0; y < image->height; y++)
+        {
+            if (image->rows[y] != ROW_MIXED) continue;
+            size_t start = (size_t)y * image->width;
+            for (int x = 0; x < image->width; x++)
+            {
+                image->premultiplied[start + x] = premultiply(image->pixels[start + x]);
+            }
+        }
+    }
+
+    atomic_init(&image->references, 1);
+    return image;
+}
+
+static Image *retain_image(Image *image)
+{
+    atomic_fetch_add(&image->references, 1);
+    return image;
+}
+
+/**
+ * @brief Drop a reference to an image, freeing it once nobody holds it.
+ */
+void release_image(Image *image)
+{
+    if (image == NULL) return;
+    if (atomic_fetch_sub(&image->references, 1) == 1)
+    {
+        stbi_image_free(image->pixels);
+        free(image->rows);
+        free(image->premultiplied);
+        free(image);
+    }
+}
+
+/**
+ * @brief Draw a decoded image with its top left corner at (x, y).
+ * 
+ * The image is clipped once and drawn row by row: fully
+ * transparent rows are skipped, fully opaque rows are copied and the others
+ * blended by a SIMD kernel. Premultiplied canvases blend the premultiplied
+ * copy of the pixels made by load_image().
+ * 
+ * @param canvas Canvas to draw on.
+ * @param image Image to draw.
+ * @param x X coordinate of the top left corner.
+ * @param y Y coordinate of the top left corner.
+ */
+void draw_image(Canvas canvas, const Image *image, int x, int y)
+{
+    // Clip the image rectangle to the clip of the canvas.
+    Rect clip = clip_rect(canvas);
+    long long left   = x < clip.x0 ? clip.x0 : x;
+    long long top    = y < clip.y0 ? clip.y0 : y;
+    long long right  = (long long)x + image->width;
+    long long bottom = (long long)y + image->height;
+    if (right > clip.x1) right = clip.x1;
+    if (bottom > clip.y1) bottom = clip.y1;
+    if (left >= right || top >= bottom) return;
+    add_damage(canvas, left, top, right, bottom);
+
+    const Kernels *k = cpu_kernels();
+    int premultiplied = canvas.format == PIXEL_PREMULTIPLIED;
+    int source_over = canvas.blend_mode == BLEND_SRC_OVER;
+    BlendPixelsKernel blend = k->pixels_modes[canvas.format][canvas.blend_mode];
+    size_t len = right - left;
+    for (long long row = top; row < bottom; row++)
+    {
+        int image_row = row - y;
+        size_t offset = (size_t)image_row * image->width + (left - x);
+        const uint32_t *src = &image->pixels[offset];
+        uint32_t *dest = &PIXEL(canvas, left, row);
+
+        switch (image->rows[image_row])
+        {
+        case ROW_TRANSPARENT:
+            break;
+        case ROW_OPAQUE:
+            // Opaque pixels are the same in both formats. Drawn over, they
+            // replace the alpha of a premultiplied canvas too.
+            if (!source_over)       blend(dest, src, len);
+            else if (premultiplied) memcpy(dest, src, len * sizeof(uint32_t));
+            else                    k->copy_opaque(dest, src, len);
+            break;
+        default:
+            blend(dest, premultiplied ? &image->premultiplied[offset] : src, len);
+            break;
+        }
+    }
+}
+
+typedef struct CacheEntry
+{
+    char *filename;
+    Image *image;
+    size_t bytes;
+    struct CacheEntry *newer;   // LRU list, towards the most recently used entry
+    struct CacheEntry *older;   // LRU list, towards the least recently used entry
+    struct CacheEntry *chain;   // next entry in the same hash bucket
+} CacheEntry;
+
+struct ImageCache
+{
+    pthread_mutex_t lock;
+    CacheEntry **buckets;
+    size_t bucket_count;
+    CacheEntry *newest;
+    CacheEntry *oldest;
+    size_t budget;
+    ImageCacheStats stats;
+};
+
+// Budget of the cache behind insert_image.
+#define DEFAULT_IMAGE_CACHE_BUDGET (64 << 20)
+
+/**
+ * @brief FNV-1a hash of a file name.
+ */
+static size_t hash_filename(const char *filename)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *)filename; *c; c++)
+    {
+        hash = (hash ^ *c) * 1099511628211ULL;
+    }
+    return (size_t)hash;
+}
+
+/**
+ * @brief Creates a cache of decoded images keyed by file name.
+ * 
+ * @param budget Number of bytes of decoded pixels the cache may keep. The least
+ * recently used images are evicted when it is exceeded.
+ * @return The cache, or NULL if out of memory.
+ */
+ImageCache *create_image_cache(size_t budget)
+{
+    ImageCache *cache = calloc(1, sizeof(ImageCache));
+    if (cache == NULL) return NULL;
+
+    cache->bucket_count = 64;
+    cache->buckets = calloc(cache->bucket_count, sizeof(CacheEntry *));
+    if (cache->buckets == NULL)
+    {
+        free(cache);
+        return NULL;
+    }
+    cache->budget = budget;
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+static void unlink_lru(ImageCache *cache, CacheEntry *entry)
+{
+    if (entry->newer) entry->newer->older = entry->older; else cache->newest = entry->older;
+    if (entry->older) entry->older->newer = entry->newer; else cache->oldest = entry->newer;
+    entry->newer = entry->older = NULL;
+}
+
+static void push_lru(ImageCache *cache, CacheEntry *entry)
+{
+    entry->older = cache->newest;
+    entry->newer = NULL;
+    if (cache->newest) cache->newest->newer = entry; else cache->oldest = entry;
+    cache->newest = entry;
+}
+
+static void remove_entry(ImageCache *cache, CacheEntry *entry)
+{
+    CacheEntry **link = &cache->buckets[hash_filename(entry->filename) % cache->bucket_count];
+    while (*link != entry) link = &(*link)->chain;
+    *link = entry->chain;
+
+    unlink_lru(cache, entry);
+    cache->stats.bytes -= entry->bytes;
+    cache->stats.count--;
+
+    release_image(entry->image);
+    free(entry->filename);
+    free(entry);
+}
+
+/**
+ * @brief Evicts least recently used images until the cache fits its budget.
+ * The most recently used image is always kept. Caller holds the lock.
+ */
+static void evict_images(ImageCache *cache)
+{
+    while (cache->stats.bytes > cache->budget && cache->oldest != cache->newest)
+    {
+        remove_entry(cache, cache->oldest);
+        cache->stats.evictions++;
+    }
+}
+
+static void grow_buckets(ImageCache *cache)
+{
+    size_t bucket_count = cache->bucket_count * 2;
+    CacheEntry **buckets = calloc(bucket_count, sizeof(CacheEntry *));
+    if (buckets == NULL) return;    // keep the longer chains
+
+    for (size_t b = 0; b < cache->bucket_count; b++)
+    {
+        CacheEntry *entry = cache->buckets[b];
+        while (entry)
+        {
+            CacheEntry *next = entry->chain;
+            size_t slot = hash_filename(entry->filename) % bucket_count;
+            entry->chain = buckets[slot];
+            buckets[slot] = entry;
+            entry = next;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->bucket_count = bucket_count;
+}
+
+/**
+ * @brief Returns the decoded image of a file, decoding it only on a cache miss.
+ * 
+ * @param cache Cache to look the image up in.
+ * @param filename Path of the image.
+ * @return The image with a reference held for the caller, who must release_image()
+ * it, or NULL if the image could not be loaded.
+ */
+Image *image_cache_get(ImageCache *cache, const char *filename)
+{
+    pthread_mutex_lock(&cache->lock);
+
+    size_t slot = hash_filename(filename) % cache->bucket_count;
+    for (CacheEntry *entry = cache->buckets[slot]; entry; entry = entry->chain)
+    {
+        if (strcmp(entry->filename, filename) == 0)
+        {
+            unlink_lru(cache, entry);
+            push_lru(cache, entry);
+            cache->stats.hits++;
+            Image *image = retain_image(entry->image);
+            pthread_mutex_unlock(&cache->lock);
+            return image;
+        }
+    }
+    cache->stats.misses++;
+
+    // Decode without holding the lock, other lookups can go on meanwhile.
+    pthread_mutex_unlock(&cache->lock);
+    Image *image = load_image(filename);
+    if (image == NULL) return NULL;
+
+    CacheEntry *entry = calloc(1, sizeof(CacheEntry));
+    char *key = malloc(strlen(filename) + 1);
+    if (entry == NULL || key == NULL)
+    {
+        // Not cached, the caller still gets the image.
+        free(entry);
+        free(key);
+        return image;
+    }
+    strcpy(key, filename);
+    entry->filename = key;
+    entry->image = retain_image(image);
+    entry->bytes = (size_t)image->width * image->height * sizeof(uint32_t) * (image->premultiplied ? 2 : 1);
+
+    pthread_mutex_lock(&cache->lock);
+
+    // Another thread may have inserted the same file while we were decoding.
+    slot = hash_filename(filename) % cache->bucket_count;
+    for (CacheEntry *other = cache->buckets[slot]; other; other = other->chain)
+    {
+        if (strcmp(other->filename, filename) == 0)
+        {
+            remove_entry(cache, other);
+            break;
+        }
+    }
+
+    entry->chain = cache->buckets[slot];
+    cache->buckets[slot] = entry;
+    push_lru(cache, entry);
+    cache->stats.bytes += entry->bytes;
+    cache->stats.count++;
+
+    evict_images(cache);
+    if (cache->stats.count > cache->bucket_count) grow_buckets(cache);
+
+    pthread_mutex_unlock(&cache->lock);
+    return image;
+}
+
+/**
+ * @brief Changes the memory budget of a cache, evicting images if needed.
+ */
+void set_image_cache_budget(ImageCache *cache, size_t budget)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->budget = budget;
+    evict_images(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * @brief Returns the hit/miss/eviction counters and the current size of a cache.
+ */
+ImageCacheStats image_cache_stats(ImageCache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    ImageCacheStats stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+    return stats;
+}
+
+/**
+ * @brief Frees a cache. Images still referenced elsewhere stay valid.
+ */
+void free_image_cache(ImageCache *cache)
+{
+    if (cache == NULL) return;
+    while (cache->newest) remove_entry(cache, cache->newest);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+}
+
+static ImageCache *default_cache;
+static pthread_once_t default_cache_once = PTHREAD_ONCE_INIT;
+
+static void create_default_cache(void)
+{
+    default_cache = create_image_cache(DEFAULT_IMAGE_CACHE_BUDGET);
+}
+
+/**
+ * @brief Returns the cache insert_image and record_image decode through.
+ * It keeps up to 64 MiB of decoded pixels unless its budget is changed.
+ */
+ImageCache *default_image_cache(void)
+{
+    pthread_once(&default_cache_once, create_default_cache);
+    return default_cache;
+}
+
+/**
+ * @brief Loads an image through the default cache, or directly if it could not be created.
+ */
+static Image *get_image(const char *filename)
+{
+    ImageCache *cache = default_image_cache();
+    return cache ? image_cache_get(cache, filename) : load_image(filename);
+}
+
+/**
+ * @brief Draw an image file with its top left corner at (x, y).
+ * 
+ * The file is decoded once and kept in the default image cache, inserting
+ * the same file again only blends the cached pixels.
+ * 
+ * @param canvas Canvas to draw on.
+ * @param image Path of the image.
+ * @param x X coordinate of the top left corner.
+ * @param y Y coordinate of the top left corner.
+ */
+void insert_image(Canvas canvas, char *image, int x, int y)
+{
+    Image *decoded = get_image(image);
+
+    if(decoded == NULL)
+    {
+        printf("Error: Could not load image '%s'.\n", image);
+        return;
+    }
+
+    draw_image(canvas, decoded, x, y);
+    release_image(decoded);
+}
+
+/**
+ * @brief Save the canvas as a PNG file, see save_canvas_png().
+ * 
+ * @param canvas Canvas to save.
+ * @param filename Path of the file to write.
+ */
+void save_canvas(Canvas canvas, const char *filename)
+{
+    if (!save_canvas_png(canvas, filename, default_png_options()))
+    {
+        fprintf(stderr, "ERROR: could not write %s\n", filename);
+    }
+}
+
+/**
+ * @brief Number of online CPUs, at least 1.
+ */
+static int online_cpus(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+typedef struct
+{
+    void (*func)(void *context, size_t item);
+    void *context;
+    size_t count;
+    atomic_size_t next;
+} ParallelJob;
+
+static void *parallel_worker(void *arg)
+{
+    ParallelJob *job = arg;
+    size_t item;
+    while ((item = atomic_fetch_add(&job->next, 1)) < job->count)
+    {
+        job->func(job->context, item);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Calls func(context, item) for every item in [0, count) on up to thread_count
+ * threads, the calling thread included. Items are handed out one at a time.
+ * 
+ * @param thread_count Number of threads, or 0 to use one per online CPU.
+ */
+static void parallel_for(size_t count, int thread_count, void (*func)(void *, size_t), void *context)
+{
+    if (thread_count <= 0) thread_count = online_cpus();
+    if ((size_t)thread_count > count) thread_count = count;
+
+    ParallelJob job = { .func = func, .context = context, .count = count };
+    atomic_init(&job.next, 0);
+
+    int started = 0;
+    pthread_t *threads = thread_count > 1 ? malloc(sizeof(pthread_t) * (thread_count - 1)) : NULL;
+    if (threads != NULL)
+    {
+        while (started < thread_count - 1 && pthread_create(&threads[started], NULL, parallel_worker, &job) == 0)
+        {
+            started++;
+        }
+    }
+
+    // Whatever threads could not be started, the calling thread picks up their share.
+    parallel_worker(&job);
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+// Rows of noise per parallel_for item, and pixels generated per kernel call.
+#define NOISE_ROWS  16
+#define NOISE_CHUNK 256
+
+// Entries of the gaussian quantile table, indexed by 12 random bits.
+#define NOISE_TABLE 4096
+
+/**
+ * @brief 32-bit integer hash with full avalanche ("lowbias32" by Chris Wellons).
+ */
+static inline uint32_t hash32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7FEB352D;
+    x ^= x >> 15;
+    x *= 0x846CA68B;
+    x ^= x >> 16;
+    return x;
+}
+
+/**
+ * @brief splitmix64 finalizer, used to derive a key per row from the seed.
+ */
+static inline uint64_t mix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EB;
+    return x ^ (x >> 31);
+}
+
+/**
+ * @brief Key of row y and channel c, the random bits of pixel x are
+ * hash32(key ^ hash32(x)).
+ * 
+ * A counter-based generator: the bits only depend on the seed and the pixel,
+ * so rows can be processed in any order, on any number of threads. The column
+ * is hashed before it meets the key, rows whose keys are close are no shifted
+ * copies of each other.
+ */
+static inline uint32_t row_key(uint64_t seed, size_t y, int c)
+{
+    return (uint32_t)mix64(seed + (y * 3 + c + 1) * 0x9E3779B97F4A7C15);
+}
+
+// Standard normal quantiles at the midpoints of NOISE_TABLE equal slices of [0, 1].
+static float normal_quantiles[NOISE_TABLE];
+static pthread_once_t normal_quantiles_once = PTHREAD_ONCE_INIT;
+
+static void init_normal_quantiles(void)
+{
+    for (int i = 0; i < NOISE_TABLE; i++)
+    {
+        // Solve 0.5 * erfc(-x / sqrt(2)) = p by bisection.
+        double p = (i + 0.5) / NOISE_TABLE;
+        double lo = -8.0, hi = 8.0;
+        for (int step = 0; step < 48; step++)
+        {
+            double mid = (lo + hi) / 2;
+            if (0.5 * erfc(-mid / sqrt(2.0)) < p) lo = mid; else hi = mid;
+        }
+        normal_quantiles[i] = (lo + hi) / 2;
+    }
+}
+
+typedef struct
+{
+    Canvas canvas;
+    Rect clip;      // pixels to modify
+    Noise noise;
+    int16_t table[NOISE_TABLE];     // gaussian offsets, scaled by the amplitude
+} NoiseJob;
+
+/**
+ * @brief Signed channel offset for 32 random bits.
+ */
+static inline int noise_offset(const int16_t *table, uint32_t amplitude, uint32_t bits, int gaussian)
+{
+    if (gaussian)
+    {
+        return table[bits >> 20];
+    }
+
+    // Low 16 bits pick the magnitude in [0, amplitude), the top bit the sign.
+    uint32_t magnitude = ((bits & 0xFFFF) * amplitude) >> 16;
+    int offset = magnitude > 255 ? 255 : (int)magnitude;
+    int negative = -(int)(bits >> 31);
+    return (offset ^ negative) - negative;
+}
+
+/**
+ * @brief Fills add and sub with the offsets of len pixels of a row, columns
+ * holding their hashed columns.
+ * 
+ * Always inlined with constant channels and gaussian, see noise_chunk_*, so every
+ * combination gets its own branch-free loop the compiler can vectorize.
+ */
+static inline __attribute__((always_inline))
+void noise_chunk(const NoiseJob *job, const uint32_t *keys, const uint32_t *columns, uint32_t len,
+                 uint32_t *restrict add, uint32_t *restrict sub, int channels, int gaussian)
+{
+    const int16_t *table = job->table;
+    // Larger amplitudes saturate every channel anyway, the cap keeps the product in 32 bits.
+    uint32_t amplitude = job->noise.amplitude < 0x10000 ? job->noise.amplitude : 0x10000;
+
+    if (channels == 1)
+    {
+        for (uint32_t i = 0; i < len; i++)
+        {
+            int offset = noise_offset(table, amplitude, hash32(keys[0] ^ columns[i]), gaussian);
+            uint32_t negative = (uint32_t)(offset >> 31);
+            uint32_t bytes = (((uint32_t)offset ^ negative) - negative) * 0x00010101;
+            add[i] = bytes & ~negative;
+            sub[i] = bytes & negative;
+        }
+        return;
+    }
+
+    for (uint32_t i = 0; i < len; i++)
+    {
+        uint32_t add_bytes = 0, sub_bytes = 0;
+        for (int c = 0; c < 3; c++)
+        {
+            int offset = noise_offset(table, amplitude, hash32(keys[c] ^ columns[i]), gaussian);
+            uint32_t negative = (uint32_t)(offset >> 31);
+            uint32_t magnitude = ((uint32_t)offset ^ negative) - negative;
+            add_bytes |= (magnitude & ~negative) << (8 * c);
+            sub_bytes |= (magnitude & negative) << (8 * c);
+        }
+        add[i] = add_bytes;
+        sub[i] = sub_bytes;
+    }
+}
+
+typedef void (*NoiseChunkFunc)(const NoiseJob *job, const uint32_t *keys, const uint32_t *columns, uint32_t len,
+                               uint32_t *restrict add, uint32_t *restrict sub);
+
+static void noise_chunk_mono_uniform(const NoiseJob *job, const uint32_t *keys, const uint32_t *columns, uint32_t len,
+                                     uint32_t *restrict add, uint32_t *restrict sub)
+{
+    noise_chunk(job, keys, columns, len, add, sub, 1, 0);
+}
+
+static void noise_chunk_mono_gaussian(const NoiseJob *job, const uint32_t *keys, const uint32_t *columns, uint32_t len,
+                                      uint32_t *restrict add, uint32_t *restrict sub)
+{
+    noise_chunk(job, keys, columns, len, add, sub, 1, 1);
+}
+
+static void noise_chunk_color_uniform(const NoiseJob *job, const uint32_t *keys, const uint32_t *columns, uint32_t len,
+                                      uint32_t *restrict add, uint32_t *restrict sub)
+{
+    noise_chunk(job, keys, columns, len, add, sub, 3, 0);
+}
+
+static void noise_chunk_color_gaussian(const NoiseJob *job, const uint32_t *keys, const uint32_t *columns, uint32_t len,
+                                       uint32_t *restrict add, uint32_t *restrict sub)
+{
+    noise_chunk(job, keys, columns, len, add, sub, 3, 1);
+}
+
+static void noise_rows(void *context, size_t item)
+{
+    const NoiseJob *job = context;
+    Canvas canvas = job->canvas;
+    GrainKernel apply = cpu_kernels()->apply_grain;
+    int channels = job->noise.monochrome ? 1 : 3;
+    int gaussian = job->noise.distribution == NOISE_GAUSSIAN;
+    NoiseChunkFunc generate = channels == 1 ? (gaussian ? noise_chunk_mono_gaussian : noise_chunk_mono_uniform)
+                                            : (gaussian ? noise_chunk_color_gaussian : noise_chunk_color_uniform);
+
+    uint32_t add[NOISE_CHUNK], sub[NOISE_CHUNK], straight[NOISE_CHUNK], columns[NOISE_CHUNK];
+    int premultiplied = canvas.format == PIXEL_PREMULTIPLIED;
+    Rect clip = job->clip;
+    size_t y0 = clip.y0 + item * NOISE_ROWS;
+    size_t y1 = y0 + NOISE_ROWS < (size_t)clip.y1 ? y0 + NOISE_ROWS : (size_t)clip.y1;
+
+    // Pixels are keyed by their position in the framebuffer, so neither the
+    // clip nor the view drawn through changes their offsets.
+    uint32_t keys[NOISE_ROWS][3];
+    for (size_t y = y0; y < y1; y++)
+    {
+        for (int c = 0; c < channels; c++)
+        {
+            keys[y - y0][c] = row_key(job->noise.seed, canvas.origin_y + y, c);
+        }
+    }
+
+    for (size_t x0 = clip.x0; x0 < (size_t)clip.x1; x0 += NOISE_CHUNK)
+    {
+        size_t len = clip.x1 - x0 < NOISE_CHUNK ? clip.x1 - x0 : NOISE_CHUNK;
+        for (size_t i = 0; i < len; i++)
+        {
+            columns[i] = hash32((uint32_t)(canvas.origin_x + x0 + i));
+        }
+
+        for (size_t y = y0; y < y1; y++)
+        {
+            uint32_t *row = &PIXEL(canvas, x0, y);
+            generate(job, keys[y - y0], columns, len, add, sub);
+            if (!premultiplied)
+            {
+                apply(row, add, sub, len);
+                continue;
+            }
+
+            // Offsets apply to straight colors, premultiplied ones would leave their range.
+            for (size_t i = 0; i < len; i++)
+            {
+                straight[i] = unpremultiply(row[i]);
+            }
+            apply(straight, add, sub, len);
+            for (size_t i = 0; i < len; i++)
+            {
+                row[i] = premultiply(straight[i]);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Noise with the given seed and amplitude, uniform and monochrome.
+ */
+Noise create_noise(uint64_t seed, int amplitude)
+{
+    Noise noise = {
+        .seed         = seed,
+        .amplitude    = amplitude,
+        .monochrome   = 1,
+        .distribution = NOISE_UNIFORM,
+    };
+    return noise;
+}
+
+/**
+ * @brief Adds random offsets to the color channels of every pixel in the clip.
+ * Alpha is kept.
+ * 
+ * The offset of a pixel only depends on the noise settings and the position of
+ * the pixel in the framebuffer, so the same canvas and noise always give the
+ * same bytes. Views made with canvas_subview() get the offsets of the pixels
+ * they show: tiles of a canvas grained one by one, by any number of workers,
+ * are grained like the whole canvas. Rows are processed in parallel.
+ * 
+ * @param canvas Canvas to modify.
+ * @param noise Seed, amplitude, monochrome or per channel, distribution.
+ */
+void add_noise(Canvas canvas, const Noise *noise)
+{
+    Rect clip = clip_rect(canvas);
+    size_t width = clip.x1 - clip.x0, height = clip.y1 - clip.y0;
+    if (noise->amplitude <= 0 || width == 0 || height == 0) return;
+
+    NoiseJob *job = malloc(sizeof(NoiseJob));
+    if (job == NULL) return;
+    job->canvas = canvas;
+    job->clip = clip;
+    job->noise = *noise;
+
+    if (noise->distribution == NOISE_GAUSSIAN)
+    {
+        pthread_once(&normal_quantiles_once, init_normal_quantiles);
+        for (int i = 0; i < NOISE_TABLE; i++)
+        {
+            double offset = round(normal_quantiles[i] * noise->amplitude);
+            job->table[i] = offset < -255 ? -255 : offset > 255 ? 255 : (int16_t)offset;
+        }
+    }
+
+    // Threads don't pay off for small canvases.
+    int thread_count = width * height < (1 << 16) ? 1 : 0;
+    parallel_for((height + NOISE_ROWS - 1) / NOISE_ROWS, thread_count, noise_rows, job);
+    free(job);
+    add_damage(canvas, clip.x0, clip.y0, clip.x1, clip.y1);
+}
+
+/**
+ * @brief Adds the same random offset in (-amount, amount) to the color channels
+ * of every pixel, see add_noise(). Alpha is kept.
+ * 
+ * @param canvas Canvas to modify.
+ * @param amount Grain strength, values <= 1 leave the canvas unchanged.
+ */
+void add_grain(Canvas canvas, int amount)
+{
+    Noise noise = create_noise(0, amount);
+    add_noise(canvas, &noise);
+}
+
+/**
+ * @brief Creates an empty command list.
+ */
+CommandList create_command_list(void)
+{
+    CommandList list = {
+        .commands = NULL,
+        .count    = 0,
+        .capacity = 0,
+    };
+    return list;
+}
+
+/**
+ * @brief Frees the commands of a list, including the images they hold, and empties it.
+ */
+void free_command_list(CommandList *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+    {
+        if (list->commands[i].type == COMMAND_IMAGE)
+        {
+            release_image(list->commands[i].image);
+        }
+    }
+    free(list->commands);
+    *list = create_command_list();
+}
+
+/**
+ * @brief Appends a command to the list.
+ * 
+ * @return The appended command, or NULL if out of memory.
+ */
+static DrawCommand *push_command(CommandList *list, CommandType type, uint32_t color)
+{
+    if (list->count == list->capacity)
+    {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        DrawCommand *commands = realloc(list->commands, sizeof(DrawCommand) * capacity);
+        if (commands == NULL)
+        {
+            fprintf(stderr, "ERROR: could not record draw command\n");
+            return NULL;
+        }
+        list->commands = commands;
+        list->capacity = capacity;
+    }
+
+    DrawCommand *command = &list->commands[list->count++];
+    memset(command, 0, sizeof(DrawCommand));
+    command->type  = type;
+    command->color = color;
+    return command;
+}
+
+void record_line(CommandList *list, int x0, int y0, int x1, int y1, uint32_t color)
+{
+    DrawCommand *command = push_command(list, COMMAND_LINE, color);
+    if (command == NULL) return;
+    command->x0 = x0; command->y0 = y0;
+    command->x1 = x1; command->y1 = y1;
+}
+
+void record_triangle(CommandList *list, int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color)
+{
+    DrawCommand *command = push_command(list, COMMAND_TRIANGLE, color);
+    if (command == NULL) return;
+    command->x0 = x0; command->y0 = y0;
+    command->x1 = x1; command->y1 = y1;
+    command->x2 = x2; command->y2 = y2;
+}
+
+void record_filled_triangle(CommandList *list, int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color)
+{
+    DrawCommand *command = push_command(list, COMMAND_FILLED_TRIANGLE, color);
+    if (command == NULL) return;
+    command->x0 = x0; command->y0 = y0;
+    command->x1 = x1; command->y1 = y1;
+    command->x2 = x2; command->y2 = y2;
+}
+
+void record_rect(CommandList *list, int x, int y, int width, int height, uint32_t color)
+{
+    DrawCommand *command = push_command(list, COMMAND_RECT, color);
+    if (command == NULL) return;
+    command->x0 = x;     command->y0 = y;
+    command->x1 = width; command->y1 = height;
+}
+
+void record_circle(CommandList *list, int x, int y, int radius, uint32_t color)
+{
+    DrawCommand *command = push_command(list, COMMAND_CIRCLE, color);
+    if (command == NULL) return;
+    command->x0 = x; command->y0 = y;
+    command->x1 = radius;
+}
+
+void record_filled_circle(CommandList *list, int x, int y, int radius, uint32_t color)
+{
+    DrawCommand *command = push_command(list, COMMAND_FILLED_CIRCLE, color);
+    if (command == NULL) return;
+    command->x0 = x; command->y0 = y;
+    command->x1 = radius;
+}
+
+/**
+ * @brief Records an image insertion. The image is decoded through the default
+ * image cache, here, and kept alive by the list.
+ * 
+ * @return 1 on success, 0 if the image could not be loaded.
+ */
+int record_image(CommandList *list, char *image, int x, int y)
+{
+    Image *decoded = get_image(image);
+    if (decoded == NULL)
+    {
+        printf("Error: Could not load image '%s'.\n", image);
+        return 0;
+    }
+
+    DrawCommand *command = push_command(list, COMMAND_IMAGE, 0);
+    if (command == NULL)
+    {
+        release_image(decoded);
+        return 0;
+    }
+    command->x0 = x;              command->y0 = y;
+    command->x1 = decoded->width; command->y1 = decoded->height;
+    command->image = decoded;
+    return 1;
+}
+
+/**
+ * @brief Bounding box of the pixels a command may touch.
+ */
+static Rect command_bounds(const DrawCommand *c)
+{
+    Rect box;
+    switch (c->type)
+    {
+    case COMMAND_LINE:
+        box.x0 = c->x0 < c->x1 ? c->x0 : c->x1;
+        box.x1 = (c->x0 > c->x1 ? c->x0 : c->x1) + 1;
+        box.y0 = c->y0 < c->y1 ? c->y0 : c->y1;
+        box.y1 = (c->y0 > c->y1 ? c->y0 : c->y1) + 1;
+        break;
+    case COMMAND_TRIANGLE:
+    case COMMAND_FILLED_TRIANGLE:
+        box.x0 = c->x0; box.x1 = c->x0;
+        box.y0 = c->y0; box.y1 = c->y0;
+        if (c->x1 < box.x0) box.x0 = c->x1;
+        if (c->x1 > box.x1) box.x1 = c->x1;
+        if (c->x2 < box.x0) box.x0 = c->x2;
+        if (c->x2 > box.x1) box.x1 = c->x2;
+        if (c->y1 < box.y0) box.y0 = c->y1;
+        if (c->y1 > box.y1) box.y1 = c->y1;
+        if (c->y2 < box.y0) box.y0 = c->y2;
+        if (c->y2 > box.y1) box.y1 = c->y2;
+        box.x1++;
+        box.y1++;
+        break;
+    case COMMAND_RECT:
+        box.x0 = c->x1 < 0 ? c->x0 + c->x1 : c->x0;
+        box.y0 = c->y1 < 0 ? c->y0 + c->y1 : c->y0;
+        box.x1 = box.x0 + abs(c->x1) + 1;
+        box.y1 = box.y0 + abs(c->y1) + 1;
+        break;
+    case COMMAND_CIRCLE:
+    case COMMAND_FILLED_CIRCLE:
+        box.x0 = c->x0 - abs(c->x1);
+        box.y0 = c->y0 - abs(c->x1);
+        box.x1 = c->x0 + abs(c->x1) + 1;
+        box.y1 = c->y0 + abs(c->x1) + 1;
+        break;
+    case COMMAND_IMAGE:
+    default:
+        box.x0 = c->x0;
+        box.y0 = c->y0;
+        box.x1 = c->x0 + c->x1;
+        box.y1 = c->y0 + c->y1;
+        break;
+    }
+    return box;
+}
+
+/**
+ * @brief Runs a command on the canvas with its coordinates moved by (dx, dy).
+ */
+static void run_command(Canvas canvas, const DrawCommand *c, int dx, int dy)
+{
+    switch (c->type)
+    {
+    case COMMAND_LINE:
+        draw_line(canvas, c->x0 + dx, c->y0 + dy, c->x1 + dx, c->y1 + dy, c->color);
+        break;
+    case COMMAND_TRIANGLE:
+        draw_triangle(canvas, c->x0 + dx, c->y0 + dy, c->x1 + dx, c->y1 + dy, c->x2 + dx, c->y2 + dy, c->color);
+        break;
+    case COMMAND_FILLED_TRIANGLE:
+        draw_filled_triangle(canvas, c->x0 + dx, c->y0 + dy, c->x1 + dx, c->y1 + dy, c->x2 + dx, c->y2 + dy, c->color);
+        break;
+    case COMMAND_RECT:
+        draw_rect(canvas, c->x0 + dx, c->y0 + dy, c->x1, c->y1, c->color);
+        break;
+    case COMMAND_CIRCLE:
+        draw_circle(canvas, c->x0 + dx, c->y0 + dy, c->x1, c->color);
+        break;
+    case COMMAND_FILLED_CIRCLE:
+        draw_filled_circle(canvas, c->x0 + dx, c->y0 + dy, c->x1, c->color);
+        break;
+    case COMMAND_IMAGE:
+        draw_image(canvas, c->image, c->x0 + dx, c->y0 + dy);
+        break;
+    }
+}
+
+typedef struct
+{
+    Canvas canvas;
+    const CommandList *list;
+    const Rect *bounds;
+    const size_t *bins;
+    const size_t *ends;
+} CommandJob;
+
+static void execute_tile(void *context, size_t t)
+{
+    CommandJob *job = context;
+
+    int tx, ty;
+    Canvas tile = canvas_tile(job->canvas, t, &tx, &ty);
+    tile.damage = NULL;
+    add_tile_damage(job->canvas, tile, tx, ty, job->bounds, job->bins, t == 0 ? 0 : job->ends[t - 1], job->ends[t]);
+
+    for (size_t b = (t == 0 ? 0 : job->ends[t - 1]); b < job->ends[t]; b++)
+    {
+        run_command(tile, &job->list->commands[job->bins[b]], -tx, -ty);
+    }
+}
+
+/**
+ * @brief Draw every command of the list onto the canvas, in parallel.
+ * 
+ * The canvas is split into TILE_SIZE x TILE_SIZE tiles and every tile is drawn
+ * by a single thread, running the commands that touch it in recording order.
+ * Tiles never share pixels, so the result is identical to running the
+ * commands one after the other on the whole canvas.
+ * 
+ * @param canvas Canvas to draw on.
+ * @param list Commands to draw.
+ * @param thread_count Number of threads to use, or 0 to use one per online CPU.
+ */
+void execute_command_list(Canvas canvas, const CommandList *list, int thread_count)
+{
+    size_t tile_count = ((canvas.width  + TILE_SIZE - 1) / TILE_SIZE) *
+                        ((canvas.height + TILE_SIZE - 1) / TILE_SIZE);
+    if (list->count == 0 || tile_count == 0) return;
+
+    size_t *ends = NULL;
+    size_t *bins = NULL;
+    Rect *bounds = malloc(sizeof(Rect) * list->count);
+    if (bounds != NULL)
+    {
+        for (size_t i = 0; i < list->count; i++)
+        {
+            bounds[i] = command_bounds(&list->commands[i]);
+        }
+        bins = bin_rects(canvas, bounds, list->count, &ends);
+    }
+
+    // Out of memory, run the commands on the calling thread.
+    if (bins == NULL)
+    {
+        free(bounds);
+        for (size_t i = 0; i < list->count; i++)
+        {
+            run_command(canvas, &list->commands[i], 0, 0);
+        }
+        return;
+    }
+
+    CommandJob job = {
+        .canvas = canvas,
+        .list   = list,
+        .bounds = bounds,
+        .bins   = bins,
+        .ends   = ends,
+    };
+    parallel_for(tile_count, thread_count, execute_tile, &job);
+
+    free(bins);
+    free(ends);
+    free(bounds);
+}
+
+typedef struct
+{
+    Canvas canvas;          // premultiplied pixels of the layer
+    BlendMode blend_mode;   // how the layer composites onto the layers below
+    int visible;
+    unsigned char *dirty;   // tiles marked dirty since the last composite_layers()
+    size_t damage_set;      // the stack's own set of the canvas damage, see attach_damage()
+} Layer;
+
+struct LayerStack
+{
+    size_t width;
+    size_t height;
+    size_t tiles_x;
+    size_t tile_count;
+    Layer *layers;          // bottom layer first
+    size_t count;
+    size_t capacity;
+    unsigned char *dirty;   // tiles changed by the stack itself, like visibility
+};
+
+/**
+ * @brief Creates an empty stack of layers of the given size.
+ * 
+ * The first composite_layers() draws every tile, later ones only the tiles
+ * some layer marked dirty.
+ * 
+ * @return The stack, or NULL if out of memory.
+ */
+LayerStack *create_layer_stack(size_t width, size_t height)
+{
+    LayerStack *stack = calloc(1, sizeof(LayerStack));
+    if (stack == NULL) return NULL;
+
+    stack->width = width;
+    stack->height = height;
+    stack->tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    stack->tile_count = stack->tiles_x * ((height + TILE_SIZE - 1) / TILE_SIZE);
+    stack->dirty = malloc(stack->tile_count + 1);
+    if (stack->dirty == NULL)
+    {
+        free(stack);
+        return NULL;
+    }
+    memset(stack->dirty, 1, stack->tile_count);
+    return stack;
+}
+
+void free_layer_stack(LayerStack *stack)
+{
+    if (stack == NULL) return;
+    for (size_t i = 0; i < stack->count; i++)
+    {
+        Layer *layer = &stack->layers[i];
+        detach_damage(layer->canvas.damage, layer->damage_set);
+        untrack_damage(&layer->canvas);
+        free(layer->canvas.pixels);
+        free(layer->dirty);
+    }
+    free(stack->layers);
+    free(stack->dirty);
+    free(stack);
+}
+
+/**
+ * @brief Adds a transparent layer on top of the stack.
+ * 
+ * @param mode How the layer composites onto the layers below.
+ * @return Index of the layer, or -1 if out of memory.
+ */
+int add_layer(LayerStack *stack, BlendMode mode)
+{
+    if (stack->count == stack->capacity)
+    {
+        size_t capacity = stack->capacity ? stack->capacity * 2 : 4;
+        Layer *layers = realloc(stack->layers, sizeof(Layer) * capacity);
+        if (layers == NULL) return -1;
+        stack->layers = layers;
+        stack->capacity = capacity;
+    }
+
+    uint32_t *pixels = calloc(stack->width * stack->height + 1, sizeof(uint32_t));
+    unsigned char *dirty = calloc(stack->tile_count + 1, 1);
+    if (pixels == NULL || dirty == NULL)
+    {
+        free(pixels);
+        free(dirty);
+        return -1;
+    }
+
+    Layer *layer = &stack->layers[stack->count];
+    layer->canvas = create_canvas(pixels, stack->width, stack->height, stack->width);
+    layer->canvas.format = PIXEL_PREMULTIPLIED;
+    if (!track_damage(&layer->canvas) || !attach_damage(layer->canvas.damage, &layer->damage_set))
+    {
+        untrack_damage(&layer->canvas);
+        free(pixels);
+        free(dirty);
+        return -1;
+    }
+    layer->blend_mode = mode;
+    layer->visible = 1;
+    layer->dirty = dirty;
+    return (int)stack->count++;
+}
+
+/**
+ * @brief Returns the premultiplied canvas of a layer to draw on.
+ * 
+ * Its damage is tracked (see track_damage()), the tiles the draw_* functions
+ * change are recomposited by the next composite_layers(). Pixels written
+ * directly must be marked with mark_layer_dirty().
+ */
+Canvas layer_canvas(LayerStack *stack, int layer)
+{
+    return stack->layers[layer].canvas;
+}
+
+static void mark_tiles(const LayerStack *stack, unsigned char *dirty, long long x0, long long y0, long long x1, long long y1)
+{
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > (long long)stack->width) x1 = stack->width;
+    if (y1 > (long long)stack->height) y1 = stack->height;
+    if (x0 >= x1 || y0 >= y1) return;
+
+    for (long long ty = y0 / TILE_SIZE; ty <= (y1 - 1) / TILE_SIZE; ty++)
+    {
+        memset(&dirty[ty * stack->tiles_x + x0 / TILE_SIZE], 1, (x1 - 1) / TILE_SIZE - x0 / TILE_SIZE + 1);
+    }
+}
+
+/**
+ * @brief Marks a rectangle of a layer as changed, its tiles are recomposited by
+ * the next composite_layers(). Only needed for pixels written directly, the
+ * draw_* functions record their damage themselves.
+ */
+void mark_layer_dirty(LayerStack *stack, int layer, int x, int y, int width, int height)
+{
+    mark_tiles(stack, stack->layers[layer].dirty, x, y, (long long)x + width, (long long)y + height);
+}
+
+/**
+ * @brief Shows or hides a layer, every tile is recomposited.
+ */
+void set_layer_visible(LayerStack *stack, int layer, int visible)
+{
+    if (stack->layers[layer].visible == visible) return;
+    stack->layers[layer].visible = visible;
+    memset(stack->dirty, 1, stack->tile_count);
+}
+
+/**
+ * @brief Changes how a layer composites, every tile is recomposited.
+ */
+void set_layer_blend_mode(LayerStack *stack, int layer, BlendMode mode)
+{
+    if (stack->layers[layer].blend_mode == mode) return;
+    stack->layers[layer].blend_mode = mode;
+    memset(stack->dirty, 1, stack->tile_count);
+}
+
+typedef struct
+{
+    const LayerStack *stack;
+    Canvas output;
+    const size_t *tiles;    // indices of the tiles to composite
+} CompositeJob;
+
+static void composite_tile(void *context, size_t item)
+{
+    const CompositeJob *job = context;
+    const LayerStack *stack = job->stack;
+    const Kernels *k = cpu_kernels();
+
+    size_t t = job->tiles[item];
+    size_t x = (t % stack->tiles_x) * TILE_SIZE, y = (t / stack->tiles_x) * TILE_SIZE;
+    size_t w = stack->width - x < TILE_SIZE ? stack->width - x : TILE_SIZE;
+    size_t h = stack->height - y < TILE_SIZE ? stack->height - y : TILE_SIZE;
+
+    // Layers are blended bottom up into a premultiplied tile, then stored.
+    uint32_t tile[TILE_SIZE * TILE_SIZE];
+    int empty = 1;
+    for (size_t i = 0; i < stack->count; i++)
+    {
+        const Layer *layer = &stack->layers[i];
+        if (!layer->visible) continue;
+
+        // Every mode but clear composites a layer onto transparent pixels as the
+        // layer itself.
+        BlendPixelsKernel blend = k->pixels_modes[PIXEL_PREMULTIPLIED][layer->blend_mode];
+        int copy = empty && layer->blend_mode != BLEND_CLEAR;
+        if (empty && !copy) continue;
+        for (size_t row = 0; row < h; row++)
+        {
+            const uint32_t *src = &PIXEL(layer->canvas, x, y + row);
+            if (copy) memcpy(&tile[row * w], src, w * sizeof(uint32_t));
+            else      blend(&tile[row * w], src, w);
+        }
+        empty = 0;
+    }
+    if (empty) memset(tile, 0, w * h * sizeof(uint32_t));
+
+    Canvas output = job->output;
+    for (size_t row = 0; row < h; row++)
+    {
+        uint32_t *dest = &PIXEL(output, x, y + row);
+        if (output.format == PIXEL_PREMULTIPLIED)
+        {
+            memcpy(dest, &tile[row * w], w * sizeof(uint32_t));
+            continue;
+        }
+        for (size_t i = 0; i < w; i++)
+        {
+            dest[i] = unpremultiply(tile[row * w + i]);
+        }
+    }
+}
+
+/**
+ * @brief Composites the layers into the output canvas, only where they changed.
+ * 
+ * The layers are blended bottom up with their blend modes, tile by tile, and
+ * the result replaces the pixels of the output. Only tiles drawn on or marked
+ * dirty since the last call are composited, so the cost follows the changed
+ * area, not the size of the stack. Tiles are independent and composited in parallel.
+ * 
+ * @param stack Layers to composite.
+ * @param output Canvas of the size of the stack, straight or premultiplied. It
+ * must keep the result of the previous call, its clip and blend mode are ignored.
+ * @param thread_count Number of threads to use, or 0 to use one per online CPU.
+ * @return Number of tiles composited, or -1 if out of memory.
+ */
+long composite_layers(LayerStack *stack, Canvas output, int thread_count)
+{
+    if (output.width != stack->width || output.height != stack->height) return -1;
+
+    size_t *tiles = malloc(sizeof(size_t) * (stack->tile_count + 1));
+    if (tiles == NULL) return -1;
+
+    // The damage of every layer since the last call adds to its dirty tiles.
+    for (size_t i = 0; i < stack->count; i++)
+    {
+        Layer *layer = &stack->layers[i];
+        Rect rects[DAMAGE_RECTS];
+        size_t damaged = copy_damage(layer->canvas, layer->damage_set, rects, DAMAGE_RECTS, 1);
+        for (size_t r = 0; r < damaged; r++)
+        {
+            mark_tiles(stack, layer->dirty, rects[r].x0, rects[r].y0, rects[r].x1, rects[r].y1);
+        }
+    }
+
+    size_t count = 0;
+    for (size_t t = 0; t < stack->tile_count; t++)
+    {
+        int dirty = stack->dirty[t];
+        for (size_t i = 0; i < stack->count; i++)
+        {
+            dirty |= stack->layers[i].dirty[t];
+            stack->layers[i].dirty[t] = 0;
+        }
+        stack->dirty[t] = 0;
+        if (dirty) tiles[count++] = t;
+    }
+
+    CompositeJob job = {
+        .stack  = stack,
+        .output = output,
+        .tiles  = tiles,
+    };
+    // Threads don't pay off for a few tiles.
+    parallel_for(count, count < 16 ? 1 : thread_count, composite_tile, &job);
+
+    // The clip is ignored, so is it for the damage.
+    output.clip_stack = NULL;
+    for (size_t i = 0; i < count; i++)
+    {
+        long long x = (long long)(tiles[i] % stack->tiles_x) * TILE_SIZE;
+        long long y = (long long)(tiles[i] / stack->tiles_x) * TILE_SIZE;
+        add_damage(output, x, y, x + TILE_SIZE, y + TILE_SIZE);
+    }
+    free(tiles);
+    return (long)count;
+}
+
+/**
+ * @brief Returns row y of the canvas as straight RGBA bytes.
+ * 
+ * @param scratch Buffer of canvas.width * 4 bytes the row is converted into when
+ * the pixels cannot be used as they are.
+ */
+static const unsigned char *canvas_row_bytes(Canvas canvas, size_t y, unsigned char *scratch)
+{
+    const uint32_t *row = &PIXEL(canvas, 0, y);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (canvas.format == PIXEL_STRAIGHT) return (const unsigned char *)row;
+#endif
+    for (size_t x = 0; x < canvas.width; x++)
+    {
+        uint32_t pixel = straight_color(canvas, row[x]);
+        scratch[x * 4 + 0] = RED_CHAN(pixel);
+        scratch[x * 4 + 1] = GREEN_CHAN(pixel);
+        scratch[x * 4 + 2] = BLUE_CHAN(pixel);
+        scratch[x * 4 + 3] = ALPHA_CHAN(pixel);
+    }
+    return scratch;
+}
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void make_crc_table(void)
+{
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+        {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[n] = c;
+    }
+}
+
+/**
+ * @brief Continues a CRC-32 (as used by PNG chunks), start with 0.
+ */
+static uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t len)
+{
+    pthread_once(&crc_table_once, make_crc_table);
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#define ADLER_MOD 65521
+
+/**
+ * @brief Continues an Adler-32 (as used by zlib streams), start with 1.
+ */
+static uint32_t adler32_update(uint32_t adler, const unsigned char *data, size_t len)
+{
+    uint32_t a = adler & 0xFFFF;
+    uint32_t b = adler >> 16;
+    while (len > 0)
+    {
+        // 5552 is the largest run that cannot overflow b before the modulo.
+        size_t run = len < 5552 ? len : 5552;
+        for (size_t i = 0; i < run; i++)
+        {
+            a += data[i];
+            b += a;
+        }
+        a %= ADLER_MOD;
+        b %= ADLER_MOD;
+        data += run;
+        len -= run;
+    }
+    return (b << 16) | a;
+}
+
+/**
+ * @brief Adler-32 of the concatenation of two buffers, given the checksum of each
+ * and the length of the second one.
+ */
+static uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2)
+{
+    uint32_t rem = len2 % ADLER_MOD;
+    uint32_t a1 = adler1 & 0xFFFF, b1 = adler1 >> 16;
+    uint32_t a2 = adler2 & 0xFFFF, b2 = adler2 >> 16;
+
+    uint32_t a = (a1 + a2 + ADLER_MOD - 1) % ADLER_MOD;
+    uint32_t b = (uint32_t)(((uint64_t)rem * a1 + b1 + b2 + ADLER_MOD - rem) % ADLER_MOD);
+    return (b << 16) | a;
+}
+
+// Growable byte buffer written bit by bit, least significant bit first, as deflate wants.
+typedef struct
+{
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    uint32_t bits;
+    int bit_count;
+    int failed;
+} BitWriter;
+
+static void put_bytes(BitWriter *w, const void *bytes, size_t len)
+{
+    if (w->failed) return;
+    if (w->size + len > w->capacity)
+    {
+        size_t capacity = w->capacity ? w->capacity : 4096;
+        while (capacity < w->size + len) capacity *= 2;
+        unsigned char *data = realloc(w->data, capacity);
+        if (data == NULL)
+        {
+            w->failed = 1;
+            return;
+        }
+        w->data = data;
+        w->capacity = capacity;
+    }
+    memcpy(w->data + w->size, bytes, len);
+    w->size += len;
+}
+
+static void put_u32_be(BitWriter *w, uint32_t value)
+{
+    unsigned char bytes[4] = { value >> 24, value >> 16, value >> 8, value };
+    put_bytes(w, bytes, 4);
+}
+
+static inline void put_bits(BitWriter *w, uint32_t value, int count)
+{
+    w->bits |= value << w->bit_count;
+    w->bit_count += count;
+    while (w->bit_count >= 8)
+    {
+        unsigned char byte = w->bits & 0xFF;
+        if (w->size < w->capacity) w->data[w->size++] = byte;
+        else put_bytes(w, &byte, 1);
+        w->bits >>= 8;
+        w->bit_count -= 8;
+    }
+}
+
+/**
+ * @brief Writes a Huffman code, which deflate stores most significant bit first.
+ */
+static void put_code(BitWriter *w, uint32_t code, int length)
+{
+    uint32_t reversed = 0;
+    for (int i = 0; i < length; i++)
+    {
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    put_bits(w, reversed, length);
+}
+
+static void align_to_byte(BitWriter *w)
+{
+    if (w->bit_count > 0) put_bits(w, 0, 8 - w->bit_count);
+}
+
+// Fixed literal/length Huffman code, bit reversed so it can go through put_bits.
+static uint16_t fixed_codes[288];
+static unsigned char fixed_lengths[288];
+static pthread_once_t fixed_codes_once = PTHREAD_ONCE_INIT;
+
+static void make_fixed_codes(void)
+{
+    for (int symbol = 0; symbol < 288; symbol++)
+    {
+        uint32_t code;
+        int length;
+        if (symbol < 144)      { code = 0x30 + symbol;        length = 8; }
+        else if (symbol < 256) { code = 0x190 + symbol - 144; length = 9; }
+        else if (symbol < 280) { code = symbol - 256;         length = 7; }
+        else                   { code = 0xC0 + symbol - 280;  length = 8; }
+
+        uint32_t reversed = 0;
+        for (int i = 0; i < length; i++)
+        {
+            reversed = (reversed << 1) | ((code >> i) & 1);
+        }
+        fixed_codes[symbol] = reversed;
+        fixed_lengths[symbol] = length;
+    }
+}
+
+/**
+ * @brief Writes symbol 0..287 with the fixed literal/length Huffman code.
+ */
+static inline void put_fixed_literal(BitWriter *w, int symbol)
+{
+    put_bits(w, fixed_codes[symbol], fixed_lengths[symbol]);
+}
+
+static const unsigned short length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const unsigned char length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const unsigned short distance_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const unsigned char distance_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static void put_match(BitWriter *w, int length, int distance)
+{
+    int l = 28;
+    while (length_base[l] > length) l--;
+    put_fixed_literal(w, 257 + l);
+    put_bits(w, length - length_base[l], length_extra[l]);
+
+    int d = 29;
+    while (distance_base[d] > distance) d--;
+    put_code(w, d, 5);
+    put_bits(w, distance - distance_base[d], distance_extra[d]);
+}
+
+#define DEFLATE_WINDOW      32768
+#define DEFLATE_MAX_MATCH   258
+#define DEFLATE_HASH_BITS   15
+
+/**
+ * @brief Compresses data into non-final deflate blocks followed by an empty
+ * stored block, so the output ends on a byte boundary and further blocks,
+ * compressed independently, can be appended to it.
+ * 
+ * Level 0 stores the data, levels 1 to 9 use LZ77 with the fixed Huffman code,
+ * the level trading speed for ratio through the hash chain search limits.
+ */
+static void deflate_segment(BitWriter *w, const unsigned char *data, size_t len, int level)
+{
+    if (level <= 0)
+    {
+        for (size_t i = 0; i < len; i += 65535)
+        {
+            size_t run = len - i < 65535 ? len - i : 65535;
+            put_bits(w, 0, 3);  // BFINAL = 0, BTYPE = stored
+            align_to_byte(w);
+            unsigned char header[4] = { run & 0xFF, run >> 8, ~run & 0xFF, (~run >> 8) & 0xFF };
+            put_bytes(w, header, 4);
+            put_bytes(w, data + i, run);
+        }
+    }
+    else
+    {
+        // Candidates to try and match length good enough to stop searching, per level.
+        static const struct { short max_chain; short nice_length; } limits[10] = {
+            { 0, 0 }, { 4, 8 }, { 6, 16 }, { 8, 32 }, { 16, 32 },
+            { 32, 64 }, { 64, 128 }, { 128, 258 }, { 512, 258 }, { 1024, 258 },
+        };
+        int max_chain = limits[level > 9 ? 9 : level].max_chain;
+        int nice_length = limits[level > 9 ? 9 : level].nice_length;
+        int32_t *head = malloc(sizeof(int32_t) << DEFLATE_HASH_BITS);
+        int32_t *prev = malloc(sizeof(int32_t) * DEFLATE_WINDOW);
+        if (head == NULL || prev == NULL)
+        {
+            free(head);
+            free(prev);
+            deflate_segment(w, data, len, 0);
+            return;
+        }
+        memset(head, 0xFF, sizeof(int32_t) << DEFLATE_HASH_BITS);
+        pthread_once(&fixed_codes_once, make_fixed_codes);
+
+        put_bits(w, 0, 1);  // BFINAL = 0
+        put_bits(w, 1, 2);  // BTYPE = fixed Huffman
+
+        size_t i = 0;
+        while (i < len)
+        {
+            int best_length = 0;
+            int best_distance = 0;
+
+            if (i + 3 <= len)
+            {
+                uint32_t hash = ((data[i] << 16) | (data[i + 1] << 8) | data[i + 2]) * 2654435761u >> (32 - DEFLATE_HASH_BITS);
+                size_t limit = len - i < DEFLATE_MAX_MATCH ? len - i : DEFLATE_MAX_MATCH;
+
+                int32_t candidate = head[hash];
+                for (int chain = max_chain; candidate >= 0 && chain > 0; chain--)
+                {
+                    if (i - candidate > DEFLATE_WINDOW) break;
+
+                    const unsigned char *a = data + candidate;
+                    const unsigned char *b = data + i;
+                    if (a[best_length] == b[best_length])
+                    {
+                        size_t n = 0;
+                        while (n < limit && a[n] == b[n]) n++;
+                        if ((int)n > best_length)
+                        {
+                            best_length = n;
+                            best_distance = i - candidate;
+                            if (n == limit || (int)n >= nice_length) break;
+                        }
+                    }
+
+                    int32_t next = prev[candidate & (DEFLATE_WINDOW - 1)];
+                    if (next >= candidate) break;   // the slot was reused by a newer position
+                    candidate = next;
+                }
+
+                prev[i & (DEFLATE_WINDOW - 1)] = head[hash];
+                head[hash] = i;
+            }
+
+            if (best_length >= 3)
+            {
+                put_match(w, best_length, best_distance);
+
+                // Index the positions the match skips over so later matches can find them.
+                for (size_t j = i + 1; j < i + best_length && j + 3 <= len; j++)
+                {
+                    uint32_t hash = ((data[j] << 16) | (data[j + 1] << 8) | data[j + 2]) * 2654435761u >> (32 - DEFLATE_HASH_BITS);
+                    prev[j & (DEFLATE_WINDOW - 1)] = head[hash];
+                    head[hash] = j;
+                }
+                i += best_length;
+            }
+            else
+            {
+                put_fixed_literal(w, data[i]);
+                i++;
+            }
+        }
+        put_fixed_literal(w, 256);  // end of block
+
+        free(head);
+        free(prev);
+    }
+
+    // Empty stored block: aligns the stream to a byte boundary.
+    put_bits(w, 0, 3);
+    align_to_byte(w);
+    static const unsigned char empty_stored[4] = { 0x00, 0x00, 0xFF, 0xFF };
+    put_bytes(w, empty_stored, 4);
+}
+
+static int paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+/**
+ * @brief Writes a PNG filtered row: the filter type byte followed by the filtered bytes.
+ * 
+ * Level 0 always uses no filter, other levels pick the filter whose output has
+ * the smallest sum of absolute values, the usual heuristic.
+ */
+static void filter_row(unsigned char *out, const unsigned char *row, const unsigned char *above, size_t len, int level)
+{
+    static const unsigned char zero = 0;
+    int best_filter = 0;
+
+    if (level > 0)
+    {
+        long cost[5] = { 0 };
+        for (size_t i = 0; i < len; i++)
+        {
+            int left = i >= 4 ? row[i - 4] : 0;
+            int up = above ? above[i] : 0;
+            int up_left = (above && i >= 4) ? above[i - 4] : 0;
+            cost[0] += abs((signed char)row[i]);
+            cost[1] += abs((signed char)(row[i] - left));
+            cost[2] += abs((signed char)(row[i] - up));
+            cost[3] += abs((signed char)(row[i] - (left + up) / 2));
+            cost[4] += abs((signed char)(row[i] - paeth(left, up, up_left)));
+        }
+        for (int filter = 1; filter < 5; filter++)
+        {
+            if (cost[filter] < cost[best_filter]) best_filter = filter;
+        }
+    }
+
+    out[0] = best_filter;
+    out++;
+    if (above == NULL) above = &zero;
+    size_t above_step = above == &zero ? 0 : 1;
+
+    switch (best_filter)
+    {
+    case 0:
+        memcpy(out, row, len);
+        break;
+    case 1:
+        for (size_t i = 0; i < len; i++) out[i] = row[i] - (i >= 4 ? row[i - 4] : 0);
+        break;
+    case 2:
+        for (size_t i = 0; i < len; i++) out[i] = row[i] - above[i * above_step];
+        break;
+    case 3:
+        for (size_t i = 0; i < len; i++) out[i] = row[i] - ((i >= 4 ? row[i - 4] : 0) + above[i * above_step]) / 2;
+        break;
+    case 4:
+        for (size_t i = 0; i < len; i++)
+        {
+            int up_left = i >= 4 ? above[(i - 4) * above_step] : 0;
+            out[i] = row[i] - paeth(i >= 4 ? row[i - 4] : 0, above[i * above_step], up_left);
+        }
+        break;
+    }
+}
+
+// A band of rows compressed into one IDAT chunk.
+typedef struct
+{
+    BitWriter chunk;    // complete chunk: length, type, data, CRC
+    uint32_t adler;     // Adler-32 of the filtered rows of the band
+    size_t raw_size;    // number of filtered bytes
+    int done;
+} PngBand;
+
+/**
+ * @brief Filters and compresses rows [y0, y1) of the canvas into a complete IDAT
+ * chunk. The first band also carries the zlib header.
+ */
+static void encode_png_band(Canvas canvas, size_t y0, size_t y1, int level, PngBand *band)
+{
+    size_t row_bytes = canvas.width * 4;
+    size_t raw_size = (y1 - y0) * (row_bytes + 1);
+    unsigned char *raw = malloc(raw_size);
+    unsigned char *scratch = malloc(row_bytes * 2);
+    memset(band, 0, sizeof(PngBand));
+    if (raw == NULL || scratch == NULL)
+    {
+        free(raw);
+        free(scratch);
+        band->chunk.failed = 1;
+        return;
+    }
+
+    const unsigned char *above = y0 > 0 ? canvas_row_bytes(canvas, y0 - 1, scratch + row_bytes) : NULL;
+    for (size_t y = y0; y < y1; y++)
+    {
+        // Alternate the scratch halves so the previous row stays valid.
+        unsigned char *row_scratch = ((y - y0) & 1) ? scratch + row_bytes : scratch;
+        const unsigned char *row = canvas_row_bytes(canvas, y, row_scratch);
+        filter_row(raw + (y - y0) * (row_bytes + 1), row, above, row_bytes, level);
+        above = row;
+    }
+    free(scratch);
+
+    band->adler = adler32_update(1, raw, raw_size);
+    band->raw_size = raw_size;
+
+    BitWriter *w = &band->chunk;
+    put_u32_be(w, 0);   // length, patched below
+    put_bytes(w, "IDAT", 4);
+    if (y0 == 0)
+    {
+        // zlib header: deflate with a 32K window, level hint in the flags.
+        unsigned char header[2] = { 0x78, level <= 1 ? 0x01 : level < 6 ? 0x5E : level == 6 ? 0x9C : 0xDA };
+        put_bytes(w, header, 2);
+    }
+    deflate_segment(w, raw, raw_size, level);
+    free(raw);
+    if (w->failed) return;
+
+    size_t length = w->size - 8;
+    w->data[0] = length >> 24;
+    w->data[1] = length >> 16;
+    w->data[2] = length >> 8;
+    w->data[3] = length;
+    put_u32_be(w, crc32_update(0, w->data + 4, w->size - 4));
+}
+
+/**
+ * @brief Returns the default PNG options: level 6, one thread per CPU and
+ * automatically sized bands.
+ */
+PngOptions default_png_options(void)
+{
+    PngOptions options = {
+        .level        = 6,
+        .thread_count = 0,
+        .band_rows    = 0,
+    };
+    return options;
+}
+
+typedef struct
+{
+    Canvas canvas;
+    PngOptions options;
+    PngBand *bands;
+    size_t band_count;
+    size_t next;        // next band to encode
+    size_t written;     // bands handed to the writer so far
+    size_t window;      // bands allowed in flight ahead of the writer
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} PngJob;
+
+static void encode_job_band(PngJob *job, size_t b)
+{
+    size_t y0 = b * job->options.band_rows;
+    size_t y1 = y0 + job->options.band_rows < job->canvas.height ? y0 + job->options.band_rows : job->canvas.height;
+    encode_png_band(job->canvas, y0, y1, job->options.level, &job->bands[b]);
+}
+
+static void *png_worker(void *arg)
+{
+    PngJob *job = arg;
+    pthread_mutex_lock(&job->lock);
+    for (;;)
+    {
+        while (job->next < job->band_count && job->next >= job->written + job->window)
+        {
+            pthread_cond_wait(&job->changed, &job->lock);
+        }
+        if (job->next >= job->band_count) break;
+        size_t b = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        encode_job_band(job, b);
+
+        pthread_mutex_lock(&job->lock);
+        job->bands[b].done = 1;
+        pthread_cond_broadcast(&job->changed);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+static int write_chunk(WriteFunc write, void *context, const char *type, const unsigned char *data, size_t len)
+{
+    unsigned char header[8] = { len >> 24, len >> 16, len >> 8, len, type[0], type[1], type[2], type[3] };
+    uint32_t crc = crc32_update(crc32_update(0, header + 4, 4), data, len);
+    unsigned char trailer[4] = { crc >> 24, crc >> 16, crc >> 8, crc };
+    return write(context, header, 8) && (len == 0 || write(context, data, len)) && write(context, trailer, 4);
+}
+
+/**
+ * @brief Clamps the level and resolves the automatic thread count and band size.
+ */
+static PngOptions resolve_png_options(PngOptions options, size_t width)
+{
+    if (options.level < 0) options.level = 0;
+    if (options.level > 9) options.level = 9;
+    if (options.thread_count <= 0) options.thread_count = online_cpus();
+    if (options.band_rows <= 0)
+    {
+        // Aim for bands of about 256 KiB of pixels.
+        size_t rows = (256 << 10) / (width * 4);
+        options.band_rows = rows > 0 ? rows : 1;
+    }
+    return options;
+}
+
+static int write_png_header(Canvas canvas, WriteFunc write, void *context)
+{
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    unsigned char ihdr[13] = {
+        canvas.width >> 24, canvas.width >> 16, canvas.width >> 8, canvas.width,
+        canvas.height >> 24, canvas.height >> 16, canvas.height >> 8, canvas.height,
+        8,  // bit depth
+        6,  // color type: RGBA
+        0,  // compression: deflate
+        0,  // filter method: adaptive
+        0,  // no interlace
+    };
+    return write(context, signature, 8) && write_chunk(write, context, "IHDR", ihdr, 13);
+}
+
+static int write_png_tail(WriteFunc write, void *context, uint32_t adler)
+{
+    // Close the zlib stream: an empty final block and the checksum.
+    unsigned char tail[6] = { 0x03, 0x00, adler >> 24, adler >> 16, adler >> 8, adler };
+    return write_chunk(write, context, "IDAT", tail, 6) && write_chunk(write, context, "IEND", NULL, 0);
+}
+
+/**
+ * @brief Encode the canvas as a PNG and hand it to a write callback as it is produced.
+ * 
+ * The image is split into bands of rows. Every band is filtered and deflated
+ * independently, on up to options.thread_count threads, and ends on a byte
+ * boundary so the bands simply follow each other in the zlib stream, one IDAT
+ * chunk each. Bands are written in order as soon as they are ready, only a few
+ * bands per thread are kept in memory.
+ * 
+ * @param canvas Canvas to encode.
+ * @param write Called with consecutive pieces of the file, returns 0 on error.
+ * @param context Passed to write.
+ * @param options Compression level (0 to 9), threads and band size.
+ * @return 1 on success, 0 on failure.
+ */
+int write_canvas_png(Canvas canvas, WriteFunc write, void *context, PngOptions options)
+{
+    if (canvas.width == 0 || canvas.height == 0 || canvas.width > 0x7FFFFFFF || canvas.height > 0x7FFFFFFF) return 0;
+
+    options = resolve_png_options(options, canvas.width);
+    if (!write_png_header(canvas, write, context)) return 0;
+
+    PngJob job = {
+        .canvas     = canvas,
+        .options    = options,
+        .band_count = (canvas.height + options.band_rows - 1) / options.band_rows,
+        .window     = options.thread_count * 2,
+    };
+    job.bands = calloc(job.band_count, sizeof(PngBand));
+    if (job.bands == NULL) return 0;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.changed, NULL);
+
+    int thread_count = (size_t)options.thread_count > job.band_count ? (int)job.band_count : options.thread_count;
+    pthread_t *threads = thread_count > 1 ? malloc(sizeof(pthread_t) * thread_count) : NULL;
+    int started = 0;
+    if (threads != NULL)
+    {
+        while (started < thread_count && pthread_create(&threads[started], NULL, png_worker, &job) == 0)
+        {
+            started++;
+        }
+    }
+
+    int ok = 1;
+    uint32_t adler = 1;
+    for (size_t b = 0; b < job.band_count; b++)
+    {
+        PngBand *band = &job.bands[b];
+        if (started == 0)
+        {
+            encode_job_band(&job, b);
+        }
+        else
+        {
+            pthread_mutex_lock(&job.lock);
+            while (!band->done) pthread_cond_wait(&job.changed, &job.lock);
+            pthread_mutex_unlock(&job.lock);
+        }
+
+        ok = ok && !band->chunk.failed && write(context, band->chunk.data, band->chunk.size);
+        adler = adler32_combine(adler, band->adler, band->raw_size);
+        free(band->chunk.data);
+        band->chunk.data = NULL;
+
+        pthread_mutex_lock(&job.lock);
+        job.written = b + 1;
+        pthread_cond_broadcast(&job.changed);
+        pthread_mutex_unlock(&job.lock);
+    }
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_cond_destroy(&job.changed);
+    pthread_mutex_destroy(&job.lock);
+    free(job.bands);
+    return ok && write_png_tail(write, context, adler);
+}
+
+static int write_to_file(void *context, const void *data, size_t size)
+{
+    return fwrite(data, 1, size, (FILE *)context) == size;
+}
+
+/**
+ * @brief Encode the canvas as a PNG into an open file, see write_canvas_png().
+ */
+int write_canvas_png_file(Canvas canvas, FILE *file, PngOptions options)
+{
+    return write_canvas_png(canvas, write_to_file, file, options);
+}
+
+/**
+ * @brief Save the canvas as a PNG file, see write_canvas_png().
+ * 
+ * @return 1 on success, 0 on failure.
+ */
+int save_canvas_png(Canvas canvas, const char *filename, PngOptions options)
+{
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) return 0;
+
+    int ok = write_canvas_png_file(canvas, file, options);
+    return fclose(file) == 0 && ok;
+}
+
+struct IncrementalPng
+{
+    PngOptions options;
+    const uint32_t *pixels;     // canvas of the last write, bands are reused for it only
+    size_t width;
+    size_t height;
+    size_t band_rows;           // resolved for the canvas of the last write
+    size_t band_count;          // 0 until a write succeeds
+    PngBand *bands;             // encoded IDAT chunk of every band
+    unsigned char *dirty;       // bands to encode again
+    Damage *damage;             // of the canvas of the last write, NULL when untracked
+    size_t damage_set;          // the writer's own set of the damage, see attach_damage()
+};
+
+/**
+ * @brief Creates an incremental PNG writer, see write_canvas_png_incremental().
+ * 
+ * @return The writer, to free with free_incremental_png(), or NULL if out of memory.
+ */
+IncrementalPng *create_incremental_png(PngOptions options)
+{
+    IncrementalPng *png = calloc(1, sizeof(IncrementalPng));
+    if (png == NULL) return NULL;
+    png->options = options;
+    return png;
+}
+
+static void drop_png_bands(IncrementalPng *png)
+{
+    for (size_t b = 0; b < png->band_count; b++)
+    {
+        free(png->bands[b].chunk.data);
+    }
+    free(png->bands);
+    free(png->dirty);
+    png->bands = NULL;
+    png->dirty = NULL;
+    png->band_count = 0;
+    if (png->damage != NULL) detach_damage(png->damage, png->damage_set);
+    png->damage = NULL;
+}
+
+void free_incremental_png(IncrementalPng *png)
+{
+    if (png == NULL) return;
+    drop_png_bands(png);
+    free(png);
+}
+
+typedef struct
+{
+    Canvas canvas;
+    IncrementalPng *png;
+    const size_t *bands;
+} IncrementalPngJob;
+
+static void encode_dirty_band(void *context, size_t item)
+{
+    IncrementalPngJob *job = context;
+    IncrementalPng *png = job->png;
+    size_t b = job->bands[item];
+    size_t y0 = b * png->band_rows;
+    size_t y1 = y0 + png->band_rows < png->height ? y0 + png->band_rows : png->height;
+
+    free(png->bands[b].chunk.data);
+    encode_png_band(job->canvas, y0, y1, png->options.level, &png->bands[b]);
+}
+
+/**
+ * @brief Marks the bands holding the damage of the canvas dirty. A band is also
+ * dirty when the row above it changed, its first row is filtered against it.
+ */
+static void mark_damaged_bands(IncrementalPng *png, Canvas canvas)
+{
+    Rect rects[DAMAGE_RECTS];
+    size_t count = copy_damage(canvas, png->damage_set, rects, DAMAGE_RECTS, 1);
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t first = rects[i].y0 / png->band_rows;
+        size_t last = rects[i].y1 / png->band_rows;
+        if (last >= png->band_count) last = png->band_count - 1;
+        memset(&png->dirty[first], 1, last - first + 1);
+    }
+}
+
+/**
+ * @brief Encode the canvas as a PNG, only re-encoding the bands that changed
+ * since the previous call.
+ * 
+ * The file is the same as write_canvas_png() writes with the same options. The
+ * encoded bands are kept in the writer, the ones drawn on since the previous
+ * call are found from the damage of the canvas (see track_damage()), encoded
+ * again in parallel, and written with the others. The writer keeps its own
+ * record of the damage it has encoded, get_damage() and checkpoint_damage()
+ * are left alone. Everything is encoded on the first call, when the canvas or
+ * its size changes, and when its damage isn't tracked.
+ * 
+ * @param png Writer, used for a single canvas at a time.
+ * @param canvas Canvas to encode, only drawn on with draw_* functions between calls.
+ * @param write Called with consecutive pieces of the file, returns 0 on error.
+ * @param context Passed to write.
+ * @return 1 on success, 0 on failure.
+ */
+int write_canvas_png_incremental(IncrementalPng *png, Canvas canvas, WriteFunc write, void *context)
+{
+    if (canvas.width == 0 || canvas.height == 0 || canvas.width > 0x7FFFFFFF || canvas.height > 0x7FFFFFFF) return 0;
+
+    PngOptions options = resolve_png_options(png->options, canvas.width);
+    int reuse = png->band_count > 0 && png->damage != NULL && canvas.damage == png->damage && canvas.pixels == png->pixels &&
+                canvas.width == png->width && canvas.height == png->height &&
+                (size_t)options.band_rows == png->band_rows;
+    if (!reuse)
+    {
+        drop_png_bands(png);
+        size_t band_count = (canvas.height + options.band_rows - 1) / options.band_rows;
+        png->bands = calloc(band_count, sizeof(PngBand));
+        png->dirty = malloc(band_count);
+        if (png->bands == NULL || png->dirty == NULL)
+        {
+            drop_png_bands(png);
+            return 0;
+        }
+        memset(png->dirty, 1, band_count);
+        png->band_count = band_count;
+        png->pixels = canvas.pixels;
+        png->width = canvas.width;
+        png->height = canvas.height;
+        png->band_rows = options.band_rows;
+
+        // Recorded from now on, so the next call finds what changed after this one.
+        if (canvas.damage != NULL && attach_damage(canvas.damage, &png->damage_set)) png->damage = canvas.damage;
+    }
+    else
+    {
+        mark_damaged_bands(png, canvas);
+    }
+
+    size_t *bands = malloc(sizeof(size_t) * png->band_count);
+    if (bands == NULL) return 0;
+    size_t count = 0;
+    for (size_t b = 0; b < png->band_count; b++)
+    {
+        if (png->dirty[b]) bands[count++] = b;
+    }
+
+    IncrementalPngJob job = {
+        .canvas = canvas,
+        .png    = png,
+        .bands  = bands,
+    };
+    parallel_for(count, count < 2 ? 1 : options.thread_count, encode_dirty_band, &job);
+    free(bands);
+
+    // A band that failed is encoded again next time.
+    int ok = 1;
+    for (size_t b = 0; b < png->band_count; b++)
+    {
+        png->dirty[b] = png->bands[b].chunk.failed;
+        ok = ok && !png->dirty[b];
+    }
+    if (!ok) return 0;
+
+    if (!write_png_header(canvas, write, context)) return 0;
+    uint32_t adler = 1;
+    for (size_t b = 0; b < png->band_count; b++)
+    {
+        PngBand *band = &png->bands[b];
+        if (!write(context, band->chunk.data, band->chunk.size)) return 0;
+        adler = adler32_combine(adler, band->adler, band->raw_size);
+    }
+    return write_png_tail(write, context, adler);
+}
+
+/**
+ * @brief Save the canvas as a PNG file, see write_canvas_png_incremental().
+ * 
+ * @return 1 on success, 0 on failure.
+ */
+int save_canvas_png_incremental(IncrementalPng *png, Canvas canvas, const char *filename)
+{
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) return 0;
+
+    int ok = write_canvas_png_incremental(png, canvas, write_to_file, file);
+    return fclose(file) == 0 && ok;
+}
+
+// Output buffer in front of a WriteFunc, for encoders that produce a few bytes at a time.
+typedef struct
+{
+    unsigned char data[1 << 16];
+    size_t size;
+    WriteFunc write;
+    void *context;
+    int ok;
+} OutputBuffer;
+
+static void flush_output(OutputBuffer *out)
+{
+    if (out->size > 0 && out->ok) out->ok = out->write(out->context, out->data, out->size);
+    out->size = 0;
+}
+
+static inline void put_output(OutputBuffer *out, unsigned char byte)
+{
+    if (out->size == sizeof(out->data)) flush_output(out);
+    out->data[out->size++] = byte;
+}
+
+/**
+ * @brief Writes the RGBA bytes of every row, straight from the canvas when possible.
+ */
+static int write_rows(Canvas canvas, WriteFunc write, void *context)
+{
+    size_t row_bytes = canvas.width * 4;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Contiguous rows go out in one piece.
+    if (canvas.stride == canvas.width && canvas.format == PIXEL_STRAIGHT)
+    {
+        return write(context, canvas.pixels, row_bytes * canvas.height);
+    }
+#endif
+
+    unsigned char *scratch = malloc(row_bytes);
+    if (scratch == NULL) return 0;
+
+    int ok = 1;
+    for (size_t y = 0; ok && y < canvas.height; y++)
     {
-        xi = -1;
-        dx = -dx;
+        ok = write(context, canvas_row_bytes(canvas, y, scratch), row_bytes);
     }
+    free(scratch);
+    return ok;
+}
+
+/**
+ * @brief Writes a binary PPM (P6). PPM has no alpha channel, alpha is dropped.
+ */
+static int write_ppm(Canvas canvas, WriteFunc write, void *context)
+{
+    char header[64];
+    int length = snprintf(header, sizeof(header), "P6\n%zu %zu\n255\n", canvas.width, canvas.height);
+    if (!write(context, header, length)) return 0;
 
-    int dy = y1 - y0;
-    int yi = 1;
-    if (dy < 0 )
+    unsigned char *rgb = malloc(canvas.width * 3);
+    if (rgb == NULL) return 0;
+
+    int ok = 1;
+    for (size_t y = 0; ok && y < canvas.height; y++)
     {
-        yi = -1;
-        dy = -dy;
+        const uint32_t *row = &PIXEL(canvas, 0, y);
+        for (size_t x = 0; x < canvas.width; x++)
+        {
+            uint32_t pixel = straight_color(canvas, row[x]);
+            rgb[x * 3 + 0] = RED_CHAN(pixel);
+            rgb[x * 3 + 1] = GREEN_CHAN(pixel);
+            rgb[x * 3 + 2] = BLUE_CHAN(pixel);
+        }
+        ok = write(context, rgb, canvas.width * 3);
     }
+    free(rgb);
+    return ok;
+}
+
+/**
+ * @brief Writes a PAM (P7) with the RGB_ALPHA tuple type.
+ */
+static int write_pam(Canvas canvas, WriteFunc write, void *context)
+{
+    char header[128];
+    int length = snprintf(header, sizeof(header), "P7\nWIDTH %zu\nHEIGHT %zu\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+                          canvas.width, canvas.height);
+    return write(context, header, length) && write_rows(canvas, write, context);
+}
+
+/**
+ * @brief Writes a QOI image ("Quite OK Image" format, qoiformat.org).
+ */
+static int write_qoi(Canvas canvas, WriteFunc write, void *context)
+{
+    if (canvas.width > 0xFFFFFFFF || canvas.height > 0xFFFFFFFF) return 0;
+
+    OutputBuffer *out = malloc(sizeof(OutputBuffer));
+    if (out == NULL) return 0;
+    out->size = 0;
+    out->write = write;
+    out->context = context;
+    out->ok = 1;
 
-    int x = x0;
-    int y = y0;
+    unsigned char header[14] = {
+        'q', 'o', 'i', 'f',
+        canvas.width >> 24, canvas.width >> 16, canvas.width >> 8, canvas.width,
+        canvas.height >> 24, canvas.height >> 16, canvas.height >> 8, canvas.height,
+        4,  // channels: RGBA
+        0,  // colorspace: sRGB with linear alpha
+    };
+    for (int i = 0; i < 14; i++) put_output(out, header[i]);
+
+    uint32_t index[64] = { 0 };
+    uint32_t previous = RGBA(0, 0, 0, 255);
+    int run = 0;
 
-    
-    if (abs(dx) > abs(dy))
+    for (size_t y = 0; y < canvas.height; y++)
     {
-        int P = 2 * dy - dx;
-        while (x != x1)
+        const uint32_t *row = &PIXEL(canvas, 0, y);
+        for (size_t x = 0; x < canvas.width; x++)
         {
-            draw_pixel(canvas, x, y, color);
-            x += xi;
-            if(P < 0)
+            uint32_t pixel = straight_color(canvas, row[x]);
+            int last = y == canvas.height - 1 && x == canvas.width - 1;
+
+            if (pixel == previous)
+            {
+                run++;
+                if (run == 62 || last)
+                {
+                    put_output(out, 0xC0 | (run - 1));  // QOI_OP_RUN
+                    run = 0;
+                }
+                continue;
+            }
+
+            if (run > 0)
+            {
+                put_output(out, 0xC0 | (run - 1));      // QOI_OP_RUN
+                run = 0;
+            }
+
+            int r = RED_CHAN(pixel), g = GREEN_CHAN(pixel), b = BLUE_CHAN(pixel), a = ALPHA_CHAN(pixel);
+            int slot = (r * 3 + g * 5 + b * 7 + a * 11) % 64;
+
+            if (index[slot] == pixel)
             {
-                P = P + (2 * dy);
+                put_output(out, slot);                  // QOI_OP_INDEX
             }
             else
             {
-                P = P + (2 * dy) - (2 * dx);
-                y = y + yi;
+                index[slot] = pixel;
+
+                if (a == (int)ALPHA_CHAN(previous))
+                {
+                    signed char dr = r - (int)RED_CHAN(previous);
+                    signed char dg = g - (int)GREEN_CHAN(previous);
+                    signed char db = b - (int)BLUE_CHAN(previous);
+                    signed char dr_dg = dr - dg;
+                    signed char db_dg = db - dg;
+
+                    if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2)
+                    {
+                        put_output(out, 0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));  // QOI_OP_DIFF
+                    }
+                    else if (dr_dg > -9 && dr_dg < 8 && dg > -33 && dg < 32 && db_dg > -9 && db_dg < 8)
+                    {
+                        put_output(out, 0x80 | (dg + 32));                                 // QOI_OP_LUMA
+                        put_output(out, (dr_dg + 8) << 4 | (db_dg + 8));
+                    }
+                    else
+                    {
+                        put_output(out, 0xFE);                                             // QOI_OP_RGB
+                        put_output(out, r);
+                        put_output(out, g);
+                        put_output(out, b);
+                    }
+                }
+                else
+                {
+                    put_output(out, 0xFF);                                                 // QOI_OP_RGBA
+                    put_output(out, r);
+                    put_output(out, g);
+                    put_output(out, b);
+                    put_output(out, a);
+                }
             }
+            previous = pixel;
         }
     }
-    else
+
+    static const unsigned char end_marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    for (int i = 0; i < 8; i++) put_output(out, end_marker[i]);
+    flush_output(out);
+
+    int ok = out->ok;
+    free(out);
+    return ok;
+}
+
+/**
+ * @brief Encode the canvas in the given format and hand it to a write callback.
+ * 
+ * FORMAT_RAW and FORMAT_PAM write the rows straight from the canvas, FORMAT_PNG
+ * uses default_png_options().
+ * 
+ * @param canvas Canvas to encode.
+ * @param format Output format.
+ * @param write Called with consecutive pieces of the file, returns 0 on error.
+ * @param context Passed to write.
+ * @return 1 on success, 0 on failure.
+ */
+int write_canvas(Canvas canvas, ImageFormat format, WriteFunc write, void *context)
+{
+    switch (format)
+    {
+    case FORMAT_PNG: return write_canvas_png(canvas, write, context, default_png_options());
+    case FORMAT_RAW: return write_rows(canvas, write, context);
+    case FORMAT_PPM: return write_ppm(canvas, write, context);
+    case FORMAT_PAM: return write_pam(canvas, write, context);
+    case FORMAT_QOI: return write_qoi(canvas, write, context);
+    }
+    return 0;
+}
+
+/**
+ * @brief Save the canvas to a file in the given format, see write_canvas().
+ * 
+ * @return 1 on success, 0 on failure.
+ */
+int save_canvas_as(Canvas canvas, const char *filename, ImageFormat format)
+{
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) return 0;
+
+    int ok = write_canvas(canvas, format, write_to_file, file);
+    return fclose(file) == 0 && ok;
+}
+
+// Delta file: a header, then one frame after the other. Every frame is a
+// DeltaFrameHeader followed by its changed tiles, each a DeltaTileHeader and
+// the run-length encoded XOR of the tile with the previous frame, row after
+// row. Keyframes are XORed with transparent black, so hold every non-empty tile.
+// Values are stored like canvas pixels, in the byte order of the host.
+#define DELTA_FILE_MAGIC    "GDELTA"
+#define DELTA_FILE_VERSION  1
+
+// Keyframe interval used when 0 is given, bounds the frames read_delta_frame() applies.
+#define DEFAULT_KEYFRAME_INTERVAL 64
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t tile_size;
+    uint64_t width;
+    uint64_t height;
+} DeltaFileHeader;
+
+typedef struct
+{
+    uint32_t keyframe;
+    uint32_t tile_count;
+    uint64_t size;          // bytes of tiles following the header
+} DeltaFrameHeader;
+
+typedef struct
+{
+    uint32_t tile;          // tile index, row major
+    uint32_t size;          // bytes of runs following the header
+} DeltaTileHeader;
+
+// Runs of XORed words: a varint count << 2 | kind, then the words of the run.
+enum
+{
+    DELTA_RUN_ZERO,         // count unchanged pixels, no words
+    DELTA_RUN_REPEAT,       // count pixels XORed with the same word
+    DELTA_RUN_LITERAL,      // count pixels, one word each
+};
+
+struct DeltaWriter
+{
+    WriteFunc write;
+    void *context;
+    FILE *file;             // closed with the writer, NULL when writing to a callback
+    int keyframe_interval;
+    size_t width;
+    size_t height;
+    uint32_t *previous;     // straight pixels of the last frame, NULL before the first
+    size_t frame_count;
+    int failed;
+};
+
+/**
+ * @brief Creates a writer storing canvases as a keyframe followed by deltas.
+ * 
+ * Every frame stores the TILE_SIZE x TILE_SIZE tiles that differ from the
+ * previous frame, as the run-length encoded XOR of both, so unchanged tiles
+ * cost nothing and changed ones little more than their changed pixels.
+ * 
+ * @param write Called with consecutive pieces of the file, returns 0 on error.
+ * @param context Passed to write.
+ * @param keyframe_interval A frame in this many is stored whole, bounding the
+ * work of reading a frame. 0 picks DEFAULT_KEYFRAME_INTERVAL, a negative
+ * interval only stores the first frame whole.
+ * @return The writer, to close with close_delta_writer(), or NULL if out of memory.
+ */
+DeltaWriter *create_delta_writer(WriteFunc write, void *context, int keyframe_interval)
+{
+    DeltaWriter *writer = calloc(1, sizeof(DeltaWriter));
+    if (writer == NULL) return NULL;
+    writer->write = write;
+    writer->context = context;
+    writer->keyframe_interval = keyframe_interval ? keyframe_interval : DEFAULT_KEYFRAME_INTERVAL;
+    return writer;
+}
+
+/**
+ * @brief Creates a delta file, see create_delta_writer().
+ * 
+ * @return The writer, or NULL if the file can't be created.
+ */
+DeltaWriter *create_delta_file(const char *filename, int keyframe_interval)
+{
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) return NULL;
+
+    DeltaWriter *writer = create_delta_writer(write_to_file, file, keyframe_interval);
+    if (writer == NULL)
+    {
+        fclose(file);
+        return NULL;
+    }
+    writer->file = file;
+    return writer;
+}
+
+static void put_varint(BitWriter *w, uint64_t value)
+{
+    unsigned char bytes[10];
+    int count = 0;
+    do
+    {
+        bytes[count] = (value & 0x7F) | (value >= 0x80 ? 0x80 : 0);
+        value >>= 7;
+        count++;
+    } while (value != 0);
+    put_bytes(w, bytes, count);
+}
+
+/**
+ * @brief Run-length encodes the XORed words of a tile.
+ */
+static void put_delta_runs(BitWriter *w, const uint32_t *words, size_t count)
+{
+    size_t i = 0, literals = 0;   // literals: words before i not encoded yet
+    while (i < count)
+    {
+        size_t run = 1;
+        while (i + run < count && words[i + run] == words[i]) run++;
+
+        // Zero runs always pay off, repeats once they save two words.
+        int kind = words[i] == 0 ? DELTA_RUN_ZERO : run >= 3 ? DELTA_RUN_REPEAT : DELTA_RUN_LITERAL;
+        if (kind == DELTA_RUN_LITERAL)
+        {
+            literals += run;
+            i += run;
+            continue;
+        }
+
+        if (literals > 0)
+        {
+            put_varint(w, (uint64_t)literals << 2 | DELTA_RUN_LITERAL);
+            put_bytes(w, words + i - literals, literals * sizeof(uint32_t));
+            literals = 0;
+        }
+        put_varint(w, (uint64_t)run << 2 | kind);
+        if (kind == DELTA_RUN_REPEAT) put_bytes(w, &words[i], sizeof(uint32_t));
+        i += run;
+    }
+    if (literals > 0)
+    {
+        put_varint(w, (uint64_t)literals << 2 | DELTA_RUN_LITERAL);
+        put_bytes(w, words + i - literals, literals * sizeof(uint32_t));
+    }
+}
+
+typedef struct
+{
+    DeltaWriter *writer;
+    Canvas canvas;
+    size_t tiles_x;
+    BitWriter *rows;        // encoded tiles of every row of tiles
+    uint32_t *tile_counts;  // changed tiles of every row of tiles
+} DeltaJob;
+
+/**
+ * @brief XORs a row of tiles with the previous frame, which it then replaces,
+ * and encodes the tiles that changed.
+ */
+static void encode_delta_row(void *context, size_t item)
+{
+    DeltaJob *job = context;
+    DeltaWriter *writer = job->writer;
+    Canvas canvas = job->canvas;
+    size_t y0 = item * TILE_SIZE;
+    size_t h = writer->height - y0 < TILE_SIZE ? writer->height - y0 : TILE_SIZE;
+    BitWriter *w = &job->rows[item];
+
+    // XOR of the whole row of tiles, then of every tile, row major.
+    uint32_t *band = malloc(sizeof(uint32_t) * writer->width * h);
+    uint32_t *tile = malloc(sizeof(uint32_t) * TILE_SIZE * TILE_SIZE);
+    if (band == NULL || tile == NULL)
+    {
+        free(band);
+        free(tile);
+        w->failed = 1;
+        return;
+    }
+
+    for (size_t row = 0; row < h; row++)
     {
-        int P = 2 * dx - dy;
-        while(y != y1)
+        const uint32_t *src = &PIXEL(canvas, 0, y0 + row);
+        uint32_t *previous = &writer->previous[(y0 + row) * writer->width];
+        uint32_t *xor = &band[row * writer->width];
+        if (canvas.format == PIXEL_PREMULTIPLIED)
         {
-            draw_pixel(canvas, x, y, color);
-            y += yi;
-            if(P < 0)
+            for (size_t x = 0; x < writer->width; x++)
             {
-                P = P + (2 * dx);
+                uint32_t pixel = unpremultiply(src[x]);
+                xor[x] = pixel ^ previous[x];
+                previous[x] = pixel;
             }
-            else
+            continue;
+        }
+        for (size_t x = 0; x < writer->width; x++)
+        {
+            xor[x] = src[x] ^ previous[x];
+            previous[x] = src[x];
+        }
+    }
+
+    for (size_t tx = 0; tx < job->tiles_x; tx++)
+    {
+        size_t x0 = tx * TILE_SIZE;
+        size_t tw = writer->width - x0 < TILE_SIZE ? writer->width - x0 : TILE_SIZE;
+        int changed = 0;
+        for (size_t row = 0; row < h; row++)
+        {
+            const uint32_t *xor = &band[row * writer->width + x0];
+            memcpy(&tile[row * tw], xor, tw * sizeof(uint32_t));
+            for (size_t x = 0; x < tw; x++)
+            {
+                changed |= xor[x] != 0;
+            }
+        }
+        if (!changed) continue;
+
+        // The size is patched once the runs are written.
+        size_t start = w->size;
+        DeltaTileHeader header = { .tile = item * job->tiles_x + tx, .size = 0 };
+        put_bytes(w, &header, sizeof(header));
+        put_delta_runs(w, tile, tw * h);
+        if (w->failed) break;
+
+        header.size = w->size - start - sizeof(header);
+        memcpy(w->data + start, &header, sizeof(header));
+        job->tile_counts[item]++;
+    }
+
+    free(band);
+    free(tile);
+}
+
+/**
+ * @brief Appends a frame to a delta file.
+ * 
+ * The first frame sets the size of the file, every frame must have it. The
+ * pixels are stored straight, like the other writers do, the clip is ignored.
+ * 
+ * @return 1 on success, 0 on failure, after which the writer only fails.
+ */
+int write_delta_frame(DeltaWriter *writer, Canvas canvas)
+{
+    if (writer->failed) return 0;
+    if (writer->previous == NULL)
+    {
+        if (canvas.width == 0 || canvas.height == 0 || canvas.width > UINT32_MAX || canvas.height > UINT32_MAX ||
+            canvas.height > SIZE_MAX / sizeof(uint32_t) / canvas.width) return 0;
+        writer->previous = malloc(sizeof(uint32_t) * canvas.width * canvas.height);
+        if (writer->previous == NULL) return 0;
+        writer->width = canvas.width;
+        writer->height = canvas.height;
+
+        DeltaFileHeader header = {
+            .magic     = DELTA_FILE_MAGIC,
+            .version   = DELTA_FILE_VERSION,
+            .tile_size = TILE_SIZE,
+            .width     = canvas.width,
+            .height    = canvas.height,
+        };
+        if (!writer->write(writer->context, &header, sizeof(header)))
+        {
+            writer->failed = 1;
+            return 0;
+        }
+    }
+    if (canvas.width != writer->width || canvas.height != writer->height) return 0;
+
+    int keyframe = writer->keyframe_interval > 0 ? writer->frame_count % writer->keyframe_interval == 0 : writer->frame_count == 0;
+    if (keyframe) memset(writer->previous, 0, sizeof(uint32_t) * writer->width * writer->height);
+
+    size_t tiles_y = (writer->height + TILE_SIZE - 1) / TILE_SIZE;
+    DeltaJob job = {
+        .writer      = writer,
+        .canvas      = canvas,
+        .tiles_x     = (writer->width + TILE_SIZE - 1) / TILE_SIZE,
+        .rows        = calloc(tiles_y, sizeof(BitWriter)),
+        .tile_counts = calloc(tiles_y, sizeof(uint32_t)),
+    };
+    int ok = job.rows != NULL && job.tile_counts != NULL;
+    if (ok)
+    {
+        // Threads don't pay off for small canvases.
+        int thread_count = writer->width * writer->height < (1 << 16) ? 1 : 0;
+        parallel_for(tiles_y, thread_count, encode_delta_row, &job);
+    }
+
+    DeltaFrameHeader header = { .keyframe = keyframe };
+    for (size_t r = 0; ok && r < tiles_y; r++)
+    {
+        ok = !job.rows[r].failed;
+        header.tile_count += job.tile_counts[r];
+        header.size += job.rows[r].size;
+    }
+    ok = ok && writer->write(writer->context, &header, sizeof(header));
+    for (size_t r = 0; ok && r < tiles_y; r++)
+    {
+        ok = job.rows[r].size == 0 || writer->write(writer->context, job.rows[r].data, job.rows[r].size);
+    }
+
+    for (size_t r = 0; job.rows != NULL && r < tiles_y; r++)
+    {
+        free(job.rows[r].data);
+    }
+    free(job.rows);
+    free(job.tile_counts);
+
+    // The previous frame no longer matches the file.
+    if (!ok) writer->failed = 1;
+    writer->frame_count++;
+    return ok;
+}
+
+/**
+ * @brief Frees the writer and closes the file of create_delta_file().
+ * 
+ * @return 1 if every frame was written, 0 otherwise.
+ */
+int close_delta_writer(DeltaWriter *writer)
+{
+    if (writer == NULL) return 0;
+
+    int ok = !writer->failed;
+    if (writer->file != NULL) ok = fclose(writer->file) == 0 && ok;
+    free(writer->previous);
+    free(writer);
+    return ok;
+}
+
+struct DeltaReader
+{
+    const unsigned char *data;  // the mapped file
+    size_t size;
+    size_t width;
+    size_t height;
+    size_t tiles_x;
+    const unsigned char **frames;   // header of every complete frame
+    size_t frame_count;
+    uint32_t *pixels;           // straight pixels of frame current
+    size_t current;             // SIZE_MAX when pixels hold no frame
+};
+
+/**
+ * @brief Opens a delta file written by a DeltaWriter.
+ * 
+ * The file is mapped and its frames indexed. A frame cut short, by a writer
+ * that didn't finish, ends the file.
+ * 
+ * @return The reader, to close with close_delta_reader(), or NULL if the file
+ * can't be opened or isn't a delta file.
+ */
+DeltaReader *open_delta_file(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    DeltaFileHeader header;
+    struct stat info;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || fstat(fd, &info) != 0 ||
+        memcmp(header.magic, DELTA_FILE_MAGIC, sizeof(DELTA_FILE_MAGIC)) != 0 ||
+        header.version != DELTA_FILE_VERSION || header.tile_size != TILE_SIZE ||
+        header.width == 0 || header.height == 0 || header.width > UINT32_MAX || header.height > UINT32_MAX ||
+        header.height > SIZE_MAX / sizeof(uint32_t) / header.width)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = info.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return NULL;
+
+    DeltaReader *reader = calloc(1, sizeof(DeltaReader));
+    uint32_t *pixels = malloc(sizeof(uint32_t) * header.width * header.height);
+    if (reader == NULL || pixels == NULL)
+    {
+        free(reader);
+        free(pixels);
+        munmap(mapping, size);
+        return NULL;
+    }
+    reader->data = mapping;
+    reader->size = size;
+    reader->width = header.width;
+    reader->height = header.height;
+    reader->tiles_x = (header.width + TILE_SIZE - 1) / TILE_SIZE;
+    reader->pixels = pixels;
+    reader->current = SIZE_MAX;
+
+    size_t capacity = 0;
+    size_t offset = sizeof(DeltaFileHeader);
+    while (size - offset >= sizeof(DeltaFrameHeader))
+    {
+        DeltaFrameHeader frame;
+        memcpy(&frame, reader->data + offset, sizeof(frame));
+        if (frame.size > size - offset - sizeof(frame)) break;
+
+        if (reader->frame_count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            const unsigned char **frames = realloc(reader->frames, sizeof(*frames) * capacity);
+            if (frames == NULL)
+            {
+                close_delta_reader(reader);
+                return NULL;
+            }
+            reader->frames = frames;
+        }
+        reader->frames[reader->frame_count++] = reader->data + offset;
+        offset += sizeof(frame) + frame.size;
+    }
+    return reader;
+}
+
+/**
+ * @brief Returns the size and number of frames of a delta file.
+ */
+DeltaInfo delta_file_info(const DeltaReader *reader)
+{
+    DeltaInfo info = {
+        .width       = reader->width,
+        .height      = reader->height,
+        .frame_count = reader->frame_count,
+    };
+    return info;
+}
+
+/**
+ * @brief XORs the tiles of a frame into the pixels of the reader.
+ * 
+ * @return 1 on success, 0 if the frame is corrupt.
+ */
+static int apply_delta_frame(DeltaReader *reader, size_t index)
+{
+    DeltaFrameHeader frame;
+    memcpy(&frame, reader->frames[index], sizeof(frame));
+    const unsigned char *p = reader->frames[index] + sizeof(frame);
+    const unsigned char *end = p + frame.size;
+    size_t tile_count = reader->tiles_x * ((reader->height + TILE_SIZE - 1) / TILE_SIZE);
+
+    if (frame.keyframe) memset(reader->pixels, 0, sizeof(uint32_t) * reader->width * reader->height);
+    for (uint32_t t = 0; t < frame.tile_count; t++)
+    {
+        DeltaTileHeader tile;
+        if ((size_t)(end - p) < sizeof(tile)) return 0;
+        memcpy(&tile, p, sizeof(tile));
+        p += sizeof(tile);
+        if (tile.tile >= tile_count || tile.size > (size_t)(end - p)) return 0;
+        const unsigned char *tile_end = p + tile.size;
+
+        size_t x0 = (tile.tile % reader->tiles_x) * TILE_SIZE, y0 = (tile.tile / reader->tiles_x) * TILE_SIZE;
+        size_t w = reader->width - x0 < TILE_SIZE ? reader->width - x0 : TILE_SIZE;
+        size_t h = reader->height - y0 < TILE_SIZE ? reader->height - y0 : TILE_SIZE;
+        size_t i = 0;
+        while (p < tile_end)
+        {
+            uint64_t token = 0;
+            for (int shift = 0; ; shift += 7)
+            {
+                if (p == tile_end || shift > 63) return 0;
+                token |= (uint64_t)(*p & 0x7F) << shift;
+                if (!(*p++ & 0x80)) break;
+            }
+
+            int kind = token & 3;
+            uint64_t count = token >> 2;
+            if (count > w * h - i) return 0;
+            size_t words = kind == DELTA_RUN_LITERAL ? count : kind == DELTA_RUN_REPEAT ? 1 : 0;
+            if (kind > DELTA_RUN_LITERAL || words > (size_t)(tile_end - p) / sizeof(uint32_t)) return 0;
+
+            for (uint64_t k = 0; k < count && kind != DELTA_RUN_ZERO; k++, i++)
             {
-                P = P + (2 * dx) - (2 * dy);
-                x = x + xi;
+                uint32_t word;
+                memcpy(&word, p + (kind == DELTA_RUN_LITERAL ? k : 0) * sizeof(uint32_t), sizeof(word));
+                reader->pixels[(y0 + i / w) * reader->width + x0 + i % w] ^= word;
             }
+            if (kind == DELTA_RUN_ZERO) i += count;
+            p += words * sizeof(uint32_t);
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Reconstructs a frame of a delta file into a canvas.
+ * 
+ * The deltas since the closest keyframe are applied, or since the frame read
+ * last when it is closer, so reading the frames in order applies each once.
+ * 
+ * @param reader Delta file.
+ * @param frame Index of the frame, from 0.
+ * @param canvas Canvas of the size of the file, all its pixels are replaced.
+ * @return 1 on success, 0 if the frame doesn't exist, the size differs or the
+ * file is corrupt.
+ */
+int read_delta_frame(DeltaReader *reader, size_t frame, Canvas canvas)
+{
+    if (frame >= reader->frame_count || canvas.width != reader->width || canvas.height != reader->height) return 0;
+
+    size_t keyframe = frame;
+    while (keyframe > 0)
+    {
+        DeltaFrameHeader header;
+        memcpy(&header, reader->frames[keyframe], sizeof(header));
+        if (header.keyframe) break;
+        keyframe--;
+    }
+
+    size_t next = reader->current != SIZE_MAX && reader->current >= keyframe && reader->current <= frame ? reader->current + 1 : keyframe;
+    if (next == keyframe) memset(reader->pixels, 0, sizeof(uint32_t) * reader->width * reader->height);
+    for (; next <= frame; next++)
+    {
+        if (!apply_delta_frame(reader, next))
+        {
+            reader->current = SIZE_MAX;
+            return 0;
+        }
+    }
+    reader->current = frame;
+
+    for (size_t y = 0; y < canvas.height; y++)
+    {
+        uint32_t *row = &PIXEL(canvas, 0, y);
+        const uint32_t *src = &reader->pixels[y * reader->width];
+        for (size_t x = 0; x < canvas.width; x++)
+        {
+            row[x] = source_color(canvas, src[x]);
         }
     }
+
+    Canvas whole = canvas;
+    whole.clip_stack = NULL;
+    add_damage(whole, 0, 0, canvas.width, canvas.height);
+    return 1;
+}
+
+/**
+ * @brief Unmaps the file and frees the reader.
+ */
+void close_delta_reader(DeltaReader *reader)
+{
+    if (reader == NULL) return;
+    munmap((void *)reader->data, reader->size);
+    free(reader->frames);
+    free(reader->pixels);
+    free(reader);
 }
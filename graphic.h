@@ -1,30 +1,292 @@
 #pragma once
 
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
 #define RGBA(r, g, b, a) ((((r)&0xFF)<<(8*0)) | (((g)&0xFF)<<(8*1)) | (((b)&0xFF)<<(8*2)) | (((a)&0xFF)<<(8*3)))
 #define PIXEL(oc, x, y)     (oc).pixels[(y)*(oc).stride + (x)]
 
+// Most rectangles get_damage() returns, further damage is merged into them.
+#define DAMAGE_RECTS 16
+
+// Side length, in pixels, of the aligned squares damage is rounded out to.
+#define DAMAGE_GRANULE 16
+
+typedef struct
+{
+    int x;
+    int y;
+} Point;
+
+// Rectangle of pixels.
+typedef struct
+{
+    int x0, y0;     // top left corner, inclusive
+    int x1, y1;     // bottom right corner, exclusive
+} Rect;
+
+typedef struct ClipStack ClipStack;
+typedef struct Damage Damage;
+
+// How the color channels of canvas pixels relate to their alpha.
+typedef enum
+{
+    PIXEL_STRAIGHT,         // color channels are independent of alpha
+    PIXEL_PREMULTIPLIED,    // color channels are multiplied by alpha / 255
+} PixelFormat;
+
+// How drawing combines a color with the pixels it covers. Modes are
+// Porter-Duff operators on premultiplied colors, alpha of the color
+// acting as coverage.
+typedef enum
+{
+    BLEND_SRC_OVER,     // color over the pixels
+    BLEND_DST_OVER,     // pixels over the color
+    BLEND_MULTIPLY,     // product of color and pixels, over each other elsewhere
+    BLEND_SCREEN,       // inverse of the product of the inverses
+    BLEND_ADD,          // sum, saturating at 255
+    BLEND_CLEAR,        // clears the pixels by the alpha of the color
+} BlendMode;
+
 typedef struct
 {
     uint32_t *pixels;
     size_t width;
     size_t height;
     size_t stride;
+    PixelFormat format;     // colors passed to drawing functions are straight either way
+    BlendMode blend_mode;   // used by every primitive that blends, BLEND_SRC_OVER by default
+    Rect clip;              // drawing only touches pixels inside, if clip_stack isn't NULL
+    ClipStack *clip_stack;  // clips saved by push_clip(), NULL when unclipped
+    Damage *damage;         // rectangles drawn on, see track_damage(), NULL when untracked
+    size_t origin_x;        // position in the framebuffer of views made by canvas_subview(), 0 otherwise
+    size_t origin_y;
 } Canvas;
 
+// A canvas file mapped into memory, see create_mapped_canvas().
+typedef struct MappedCanvas MappedCanvas;
+
+// Alpha of a whole image row.
+enum
+{
+    ROW_MIXED,
+    ROW_OPAQUE,
+    ROW_TRANSPARENT,
+};
+
+// A decoded image, pixels are packed like canvas pixels.
+typedef struct
+{
+    uint32_t *pixels;
+    int width;
+    int height;
+    unsigned char *rows;    // ROW_* kind of every row
+    uint32_t *premultiplied;    // pixels with premultiplied colors, NULL if no row is ROW_MIXED
+    atomic_int references;  // see release_image()
+} Image;
+
+typedef struct ImageCache ImageCache;
+
+typedef struct
+{
+    size_t hits;        // lookups served from the cache
+    size_t misses;      // lookups that decoded the file
+    size_t evictions;   // images dropped to stay within the budget
+    size_t bytes;       // decoded pixel bytes currently cached
+    size_t count;       // images currently cached
+} ImageCacheStats;
+
+typedef enum
+{
+    COMMAND_LINE,
+    COMMAND_TRIANGLE,
+    COMMAND_FILLED_TRIANGLE,
+    COMMAND_RECT,
+    COMMAND_CIRCLE,
+    COMMAND_FILLED_CIRCLE,
+    COMMAND_IMAGE,
+} CommandType;
+
+// A recorded draw call. The coordinates are the arguments of the matching draw_*
+// function: x1/y1 hold the size for rects and images, x1 the radius for circles.
+typedef struct
+{
+    CommandType type;
+    int x0, y0;
+    int x1, y1;
+    int x2, y2;
+    uint32_t color;
+    Image *image;       // image of COMMAND_IMAGE, referenced by the list
+} DrawCommand;
+
+typedef struct
+{
+    DrawCommand *commands;
+    size_t count;
+    size_t capacity;
+} CommandList;
+
+typedef struct LayerStack LayerStack;
+typedef struct IncrementalPng IncrementalPng;
+typedef struct DeltaWriter DeltaWriter;
+typedef struct DeltaReader DeltaReader;
+
+typedef struct
+{
+    size_t width;
+    size_t height;
+    size_t frame_count;
+} DeltaInfo;
+
+// Receives consecutive pieces of an encoded file, returns 0 on error.
+typedef int (*WriteFunc)(void *context, const void *data, size_t size);
+
+typedef struct
+{
+    int level;          // 0 (store, fastest) to 9 (smallest)
+    int thread_count;   // 0 for one thread per CPU
+    int band_rows;      // rows per independently compressed band, 0 for automatic
+} PngOptions;
+
+typedef enum
+{
+    FILL_EVEN_ODD,      // inside where a ray crosses an odd number of edges
+    FILL_NONZERO,       // inside where the outline winds around a nonzero number of times
+} FillRule;
+
+typedef struct
+{
+    float x0, y0;
+    float x1, y1;
+} PathSegment;
+
+// Outline for fill_path(), curves are flattened to segments as they are added.
+typedef struct
+{
+    PathSegment *segments;
+    size_t count;
+    size_t capacity;
+    float start_x, start_y;     // first point of the current contour
+    float x, y;                 // current point
+} Path;
+
+typedef enum
+{
+    NOISE_UNIFORM,      // offsets in (-amplitude, amplitude)
+    NOISE_GAUSSIAN,     // normally distributed offsets, amplitude is the standard deviation
+} NoiseDistribution;
+
+// Settings of add_noise(), see create_noise().
+typedef struct
+{
+    uint64_t seed;
+    int amplitude;
+    int monochrome;     // same offset for R, G and B, otherwise one per channel
+    NoiseDistribution distribution;
+} Noise;
+
+typedef enum
+{
+    FORMAT_PNG,
+    FORMAT_RAW,     // RGBA bytes row after row, no header
+    FORMAT_PPM,     // binary PPM (P6), alpha is dropped
+    FORMAT_PAM,     // PAM (P7) with RGB_ALPHA tuples
+    FORMAT_QOI,     // Quite OK Image format
+} ImageFormat;
+
 Canvas create_canvas(uint32_t *pixels, size_t width, size_t height, size_t stride);
+MappedCanvas *create_mapped_canvas(const char *filename, size_t width, size_t height, PixelFormat format);
+MappedCanvas *open_mapped_canvas(const char *filename);
+Canvas *mapped_canvas(MappedCanvas *mapped);
+int sync_mapped_canvas(MappedCanvas *mapped);
+void close_mapped_canvas(MappedCanvas *mapped);
+void push_clip(Canvas *canvas, int x, int y, int width, int height);
+void pop_clip(Canvas *canvas);
+Canvas canvas_subview(Canvas canvas, int x, int y, int w, int h);
+void convert_canvas(Canvas *canvas, PixelFormat format);
+int track_damage(Canvas *canvas);
+void untrack_damage(Canvas *canvas);
+size_t get_damage(Canvas canvas, Rect *rects, size_t max);
+void checkpoint_damage(Canvas canvas);
 int* create_grid(Canvas canvas, int x_count, int y_count, int margin);
 void draw_pixel(Canvas canvas, int x, int y, uint32_t color);
 void draw_line(Canvas canvas, int x0, int y0, int x1, int y1, uint32_t color);
 void draw_triangle(Canvas canvas, int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color);
 void draw_filled_triangle(Canvas canvas, int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color);
+void draw_triangles(Canvas canvas, const Point *points, const uint32_t *colors, size_t count);
 void draw_rect(Canvas canvas, int x, int y, int width, int height, uint32_t color);
 void draw_circle(Canvas canvas, int x, int y, int radius, uint32_t color);
 void draw_filled_circle(Canvas canvas, int x, int y, int radius, uint32_t color);
+void draw_filled_ellipse(Canvas canvas, int x, int y, int rx, int ry, uint32_t color);
+void draw_line_aa(Canvas canvas, int x0, int y0, int x1, int y1, uint32_t color);
+void draw_circle_aa(Canvas canvas, int x, int y, int radius, uint32_t color);
+void draw_polygon(Canvas canvas, const Point *points, size_t count, FillRule rule, uint32_t color);
+void draw_filled_triangle_aa(Canvas canvas, int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color);
+Path create_path(void);
+void free_path(Path *path);
+void path_move_to(Path *path, float x, float y);
+void path_line_to(Path *path, float x, float y);
+void path_quad_to(Path *path, float cx, float cy, float x, float y);
+void path_cubic_to(Path *path, float cx0, float cy0, float cx1, float cy1, float x, float y);
+void path_close(Path *path);
+void fill_path(Canvas canvas, const Path *path, FillRule rule, uint32_t color);
 void draw_grid(Canvas canvas, int x_count, int y_count, int margin, uint32_t color);
 void fill_canvas(Canvas canvas, uint32_t color);
 void add_grain(Canvas canvas, int grain);
+Noise create_noise(uint64_t seed, int amplitude);
+void add_noise(Canvas canvas, const Noise *noise);
 void insert_image(Canvas canvas, char *image, int x, int y);
+Image *load_image(const char *filename);
+void release_image(Image *image);
+void draw_image(Canvas canvas, const Image *image, int x, int y);
+ImageCache *create_image_cache(size_t budget);
+ImageCache *default_image_cache(void);
+Image *image_cache_get(ImageCache *cache, const char *filename);
+void set_image_cache_budget(ImageCache *cache, size_t budget);
+ImageCacheStats image_cache_stats(ImageCache *cache);
+void free_image_cache(ImageCache *cache);
 void save_canvas(Canvas canvas, const char *filename);
+PngOptions default_png_options(void);
+int write_canvas_png(Canvas canvas, WriteFunc write, void *context, PngOptions options);
+int write_canvas_png_file(Canvas canvas, FILE *file, PngOptions options);
+int save_canvas_png(Canvas canvas, const char *filename, PngOptions options);
+IncrementalPng *create_incremental_png(PngOptions options);
+void free_incremental_png(IncrementalPng *png);
+int write_canvas_png_incremental(IncrementalPng *png, Canvas canvas, WriteFunc write, void *context);
+int save_canvas_png_incremental(IncrementalPng *png, Canvas canvas, const char *filename);
+int write_canvas(Canvas canvas, ImageFormat format, WriteFunc write, void *context);
+int save_canvas_as(Canvas canvas, const char *filename, ImageFormat format);
+DeltaWriter *create_delta_writer(WriteFunc write, void *context, int keyframe_interval);
+DeltaWriter *create_delta_file(const char *filename, int keyframe_interval);
+int write_delta_frame(DeltaWriter *writer, Canvas canvas);
+int close_delta_writer(DeltaWriter *writer);
+DeltaReader *open_delta_file(const char *filename);
+DeltaInfo delta_file_info(const DeltaReader *reader);
+int read_delta_frame(DeltaReader *reader, size_t frame, Canvas canvas);
+void close_delta_reader(DeltaReader *reader);
 void blend_pixel(Canvas canvas, int x, int y, uint32_t src);
+void blend_span(Canvas canvas, int x, int y, int len, uint32_t src);
+
+CommandList create_command_list(void);
+void free_command_list(CommandList *list);
+void record_line(CommandList *list, int x0, int y0, int x1, int y1, uint32_t color);
+void record_triangle(CommandList *list, int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color);
+void record_filled_triangle(CommandList *list, int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color);
+void record_rect(CommandList *list, int x, int y, int width, int height, uint32_t color);
+void record_circle(CommandList *list, int x, int y, int radius, uint32_t color);
+void record_filled_circle(CommandList *list, int x, int y, int radius, uint32_t color);
+int record_image(CommandList *list, char *image, int x, int y);
+void execute_command_list(Canvas canvas, const CommandList *list, int thread_count);
+
+LayerStack *create_layer_stack(size_t width, size_t height);
+void free_layer_stack(LayerStack *stack);
+int add_layer(LayerStack *stack, BlendMode mode);
+Canvas layer_canvas(LayerStack *stack, int layer);
+void mark_layer_dirty(LayerStack *stack, int layer, int x, int y, int width, int height);
+void set_layer_visible(LayerStack *stack, int layer, int visible);
+void set_layer_blend_mode(LayerStack *stack, int layer, BlendMode mode);
+long composite_layers(LayerStack *stack, Canvas output, int thread_count);
 
-int variable = 0;
\ No newline at end of file
+extern int variable;
\ No newline at end of file
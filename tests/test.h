@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdio.h>
+
+// Failed checks so far, main() returns it.
+static int failures;
+
+#define CHECK(cond, ...)                                        \
+    do {                                                        \
+        if (!(cond))                                            \
+        {                                                       \
+            failures++;                                         \
+            printf("%s:%d: check failed: ", __FILE__, __LINE__);\
+            printf(__VA_ARGS__);                                \
+            printf("\n");                                       \
+        }                                                       \
+    } while (0)
@@ -0,0 +1,86 @@
+// Checks the internal SIMD kernels, so it is built from graphic.c itself.
+#include "graphic.c"
+#include "test.h"
+
+#define ROW 80
+
+// Loads the kernels of one instruction set, blend_span() uses them from then on.
+#define USE_KERNELS(isa)                                                    \
+    do {                                                                    \
+        cpu_kernels();                                                      \
+        SET_MODE_KERNELS(isa);                                              \
+        kernels.blend_span = blend_span_##isa;                              \
+        kernels.span_modes[PIXEL_STRAIGHT][BLEND_SRC_OVER] = blend_span_##isa; \
+    } while (0)
+
+static uint32_t random_color(void)
+{
+    static const uint32_t alphas[] = { 0, 1, 127, 128, 254, 255 };
+    uint32_t color = ((uint32_t)rand() << 16 ^ (uint32_t)rand()) & 0x00FFFFFF;
+    uint32_t alpha = rand() % 2 ? alphas[rand() % 6] : (uint32_t)(rand() % 256);
+    return color | alpha << 24;
+}
+
+/**
+ * @brief Blends random spans with blend_span() and pixel by pixel with
+ * blend_pixel(), for every pixel format and blend mode.
+ */
+static void check_spans(const char *isa)
+{
+    uint32_t span[ROW], pixels[ROW];
+    for (int format = PIXEL_STRAIGHT; format <= PIXEL_PREMULTIPLIED; format++)
+    {
+        for (int mode = 0; mode < BLEND_MODE_COUNT; mode++)
+        {
+            int mismatches = 0;
+            for (int trial = 0; trial < 2000; trial++)
+            {
+                for (int i = 0; i < ROW; i++)
+                {
+                    uint32_t color = random_color();
+                    span[i] = pixels[i] = format == PIXEL_PREMULTIPLIED ? premultiply(color) : color;
+                }
+
+                Canvas a = create_canvas(span, ROW, 1, ROW);
+                Canvas b = create_canvas(pixels, ROW, 1, ROW);
+                a.format = b.format = format;
+                a.blend_mode = b.blend_mode = mode;
+
+                // Lengths around the vector widths, at every alignment, partly clipped.
+                int x = rand() % (ROW + 8) - 8;
+                int len = rand() % 4 ? rand() % 40 : rand() % (ROW + 16);
+                uint32_t src = random_color();
+                blend_span(a, x, 0, len, src);
+                for (int i = 0; i < len; i++)
+                {
+                    blend_pixel(b, x + i, 0, src);
+                }
+                mismatches += memcmp(span, pixels, sizeof(span)) != 0;
+            }
+            CHECK(mismatches == 0, "%s kernels, format %d, mode %d: %d spans differ", isa, format, mode, mismatches);
+        }
+    }
+}
+
+int main(void)
+{
+    srand(5);
+    USE_KERNELS(scalar);
+    check_spans("scalar");
+#if defined(__SSE2__)
+    USE_KERNELS(sse2);
+    check_spans("sse2");
+#endif
+#if defined(HAVE_AVX2_KERNELS)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        USE_KERNELS(avx2);
+        check_spans("avx2");
+    }
+    else
+    {
+        printf("avx2 kernels not tested, the CPU doesn't support them\n");
+    }
+#endif
+    return failures != 0;
+}
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+#include "graphic.h"
+#include "test.h"
+
+#define SIZE 64
+
+/**
+ * @brief Records the half width the midpoint walk of a filled circle gives row k
+ * if that row is on the canvas.
+ */
+static void widen(long long *half, long long y, long long k, long long width)
+{
+    long long rows[2] = { y - k, y + k };
+    for (int i = 0; i < 2; i++)
+    {
+        if (rows[i] >= 0 && rows[i] < SIZE && width > half[rows[i]]) half[rows[i]] = width;
+    }
+}
+
+/**
+ * @brief Fills the circle with the midpoint walk of draw_circle(), in 64 bits and
+ * for any radius.
+ */
+static void reference_circle(uint32_t *pixels, long long x, long long y, long long radius, uint32_t color)
+{
+    long long half[SIZE];
+    for (int row = 0; row < SIZE; row++)
+    {
+        half[row] = -1;
+    }
+
+    long long x1 = 0, y1 = radius, d = 3 - 2 * radius;
+    while (y1 >= x1)
+    {
+        widen(half, y, y1, x1);
+        widen(half, y, x1, y1);
+
+        if (d < 0)
+            d += 4 * x1 + 6;
+        else
+        {
+            d += 4 * (x1 - y1) + 10;
+            y1--;
+        }
+        x1++;
+    }
+
+    for (long long row = 0; row < SIZE; row++)
+    {
+        if (half[row] < 0) continue;
+        for (long long col = x - half[row] > 0 ? x - half[row] : 0; col <= x + half[row] && col < SIZE; col++)
+        {
+            pixels[row * SIZE + col] = color;
+        }
+    }
+}
+
+static void check_circle(int x, int y, int radius)
+{
+    static uint32_t pixels[SIZE * SIZE], expected[SIZE * SIZE];
+    for (size_t i = 0; i < SIZE * SIZE; i++)
+    {
+        pixels[i] = expected[i] = 0xFF000000;
+    }
+
+    Canvas canvas = create_canvas(pixels, SIZE, SIZE, SIZE);
+    draw_filled_circle(canvas, x, y, radius, 0xFFFFFFFF);
+    reference_circle(expected, x, y, radius, 0xFFFFFFFF);
+
+    CHECK(memcmp(pixels, expected, sizeof(pixels)) == 0, "circle (%d, %d) radius %d", x, y, radius);
+}
+
+int main(void)
+{
+    srand(15);
+
+    // Whole circles and circles cut by the edges of the canvas.
+    for (int radius = 0; radius < 80; radius++)
+    {
+        for (int i = 0; i < 20; i++)
+        {
+            check_circle(rand() % (3 * SIZE) - SIZE, rand() % (3 * SIZE) - SIZE, radius);
+        }
+    }
+
+    // Circles far taller than the canvas, the edge of which crosses it.
+    int radii[] = { 1000, 4097, 123457, 20000000 };
+    for (size_t i = 0; i < sizeof(radii) / sizeof(radii[0]); i++)
+    {
+        int r = radii[i];
+        check_circle(SIZE / 2, r + SIZE / 2, r);
+        check_circle(SIZE / 2, SIZE / 2 - r, r);
+        check_circle(r / 2, r / 2 + 20, r);
+        check_circle(-r + 10, SIZE / 2, r);
+        check_circle(r + SIZE - 7, -r / 3, r);
+    }
+
+    // Radii the walk would take seconds over: covering the canvas and missing it.
+    static uint32_t pixels[SIZE * SIZE];
+    Canvas canvas = create_canvas(pixels, SIZE, SIZE, SIZE);
+    for (size_t i = 0; i < SIZE * SIZE; i++)
+    {
+        pixels[i] = 0xFF000000;
+    }
+    draw_filled_circle(canvas, SIZE / 2, SIZE / 2, 2000000000, 0xFFFFFFFF);
+    draw_filled_circle(canvas, -2000000000, -2000000000, 2000000000, 0xFF00FF00);
+    draw_filled_circle(canvas, 2000000000, 2000000000, 1999999000, 0xFF00FF00);
+    for (size_t i = 0; i < SIZE * SIZE; i++)
+    {
+        CHECK(pixels[i] == 0xFFFFFFFF, "pixel %zu is %08x", i, (unsigned)pixels[i]);
+    }
+
+    return failures != 0;
+}
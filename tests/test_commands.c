@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <string.h>
+#include "graphic.h"
+#include "test.h"
+
+#define WIDTH 517
+#define HEIGHT 389
+#define COMMANDS 3000
+
+static int random_coordinate(int size)
+{
+    return rand() % (size + 80) - 40;
+}
+
+/**
+ * @brief Records random commands into the list and draws the same ones on the
+ * canvas directly, in order.
+ */
+static void record_random(CommandList *list, Canvas canvas)
+{
+    for (int i = 0; i < COMMANDS; i++)
+    {
+        uint32_t color = RGBA(rand() % 256, rand() % 256, rand() % 256, rand() % 2 ? 255 : rand() % 256);
+        int x0 = random_coordinate(WIDTH), y0 = random_coordinate(HEIGHT);
+        int x1 = x0 + rand() % 121 - 60, y1 = y0 + rand() % 121 - 60;
+        int x2 = x0 + rand() % 121 - 60, y2 = y0 + rand() % 121 - 60;
+        int radius = rand() % 40;
+        switch (rand() % 6)
+        {
+        case 0:
+            record_line(list, x0, y0, x1, y1, color);
+            draw_line(canvas, x0, y0, x1, y1, color);
+            break;
+        case 1:
+            record_triangle(list, x0, y0, x1, y1, x2, y2, color);
+            draw_triangle(canvas, x0, y0, x1, y1, x2, y2, color);
+            break;
+        case 2:
+            record_filled_triangle(list, x0, y0, x1, y1, x2, y2, color);
+            draw_filled_triangle(canvas, x0, y0, x1, y1, x2, y2, color);
+            break;
+        case 3:
+            record_rect(list, x0, y0, x1 - x0, y1 - y0, color);
+            draw_rect(canvas, x0, y0, x1 - x0, y1 - y0, color);
+            break;
+        case 4:
+            record_circle(list, x0, y0, radius, color);
+            draw_circle(canvas, x0, y0, radius, color);
+            break;
+        default:
+            record_filled_circle(list, x0, y0, radius, color);
+            draw_filled_circle(canvas, x0, y0, radius, color);
+            break;
+        }
+    }
+}
+
+int main(void)
+{
+    static uint32_t background[WIDTH * HEIGHT], expected[WIDTH * HEIGHT], pixels[WIDTH * HEIGHT];
+    const int thread_counts[] = { 1, 2, 3, 8, 0 };
+    const BlendMode modes[] = { BLEND_SRC_OVER, BLEND_MULTIPLY, BLEND_ADD };
+
+    for (int format = PIXEL_STRAIGHT; format <= PIXEL_PREMULTIPLIED; format++)
+    {
+        for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+        {
+            srand(format * 16 + m);
+            for (size_t i = 0; i < WIDTH * HEIGHT; i++)
+            {
+                background[i] = rand() | 0xFF000000;
+            }
+
+            memcpy(expected, background, sizeof(expected));
+            Canvas canvas = create_canvas(expected, WIDTH, HEIGHT, WIDTH);
+            canvas.format = format;
+            canvas.blend_mode = modes[m];
+            push_clip(&canvas, 7, 5, WIDTH - 20, HEIGHT - 11);
+
+            CommandList list = create_command_list();
+            record_random(&list, canvas);
+
+            // Tiles run in any order on any thread, the pixels must be the same.
+            for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++)
+            {
+                memcpy(pixels, background, sizeof(pixels));
+                canvas.pixels = pixels;
+                execute_command_list(canvas, &list, thread_counts[t]);
+                CHECK(memcmp(pixels, expected, sizeof(pixels)) == 0,
+                      "format %d, mode %d, %d threads", format, modes[m], thread_counts[t]);
+            }
+
+            pop_clip(&canvas);
+            free_command_list(&list);
+        }
+    }
+
+    return failures != 0;
+}
@@ -0,0 +1,152 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "graphic.h"
+#include "test.h"
+
+#define SIZE 64
+
+static long long floor_div(__int128 a, __int128 b)
+{
+    __int128 q = a / b;
+    if ((a % b != 0) && ((a < 0) != (b < 0))) q--;
+    return (long long)q;
+}
+
+/**
+ * @brief Draws the line the way draw_line() is documented to: one pixel per
+ * step of the major axis, the minor coordinate rounded down.
+ */
+static void reference_line(uint32_t *pixels, int x0, int y0, int x1, int y1, uint32_t color)
+{
+    long long dx = (long long)x1 - x0, dy = (long long)y1 - y0;
+    int steep = llabs(dy) >= llabs(dx);
+    if (dx == 0 && dy == 0)
+    {
+        if (x0 >= 0 && x0 < SIZE && y0 >= 0 && y0 < SIZE) pixels[y0 * SIZE + x0] = color;
+        return;
+    }
+    if (steep ? dy < 0 : dx < 0)
+    {
+        int t = x0; x0 = x1; x1 = t;
+        t = y0; y0 = y1; y1 = t;
+        dx = -dx;
+        dy = -dy;
+    }
+    for (long long major = 0; major < SIZE; major++)
+    {
+        long long i = major - (steep ? y0 : x0);
+        if (i < 0 || i > (steep ? dy : dx)) continue;
+        long long minor = steep ? x0 + floor_div((__int128)dx * i, dy) : y0 + floor_div((__int128)dy * i, dx);
+        if (minor < 0 || minor >= SIZE) continue;
+        if (steep) pixels[major * SIZE + minor] = color;
+        else       pixels[minor * SIZE + major] = color;
+    }
+}
+
+static void check_line(int x0, int y0, int x1, int y1)
+{
+    static uint32_t pixels[SIZE * SIZE], expected[SIZE * SIZE];
+    // Straight source over keeps the alpha of the pixels, start opaque.
+    for (size_t i = 0; i < SIZE * SIZE; i++)
+    {
+        pixels[i] = expected[i] = 0xFF000000;
+    }
+
+    Canvas canvas = create_canvas(pixels, SIZE, SIZE, SIZE);
+    draw_line(canvas, x0, y0, x1, y1, 0xFFFFFFFF);
+    reference_line(expected, x0, y0, x1, y1, 0xFFFFFFFF);
+    CHECK(memcmp(pixels, expected, sizeof(pixels)) == 0, "draw_line(%d, %d, %d, %d)", x0, y0, x1, y1);
+}
+
+/**
+ * @brief Draws the line the way draw_line_aa() is documented to: one step per
+ * pixel of the major axis, the 32.32 fixed point minor position split between
+ * the pixel it falls in and the next one.
+ */
+static void reference_line_aa(Canvas canvas, int x0, int y0, int x1, int y1, uint32_t color)
+{
+    long long dx = (long long)x1 - x0, dy = (long long)y1 - y0;
+    int steep = llabs(dy) > llabs(dx);
+    if (steep)
+    {
+        int t = x0; x0 = y0; y0 = t;
+        t = x1; x1 = y1; y1 = t;
+        long long d = dx; dx = dy; dy = d;
+    }
+    if (dx < 0)
+    {
+        int t = x0; x0 = x1; x1 = t;
+        t = y0; y0 = y1; y1 = t;
+        dx = -dx;
+        dy = -dy;
+    }
+
+    __int128 gradient = dx == 0 ? 0 : (__int128)dy * ((int64_t)1 << 32) / dx;
+    for (long long major = 0; major < SIZE; major++)
+    {
+        if (major < x0 || major > x1) continue;
+        __int128 position = (__int128)y0 * ((int64_t)1 << 32) + gradient * (major - x0);
+        long long minor = (long long)(position >> 32);
+        uint32_t fraction = (uint32_t)(position >> 24) & 0xFF;
+        uint32_t coverage[2] = { 255 - fraction, fraction };
+        for (int k = 0; k < 2; k++)
+        {
+            uint32_t alpha = (color >> 24) * coverage[k] + 128;
+            alpha = (alpha + (alpha >> 8)) >> 8;
+            if (alpha == 0 || minor + k < 0 || minor + k >= SIZE) continue;
+
+            uint32_t src = (color & 0x00FFFFFF) | (alpha << 24);
+            if (steep) blend_pixel(canvas, (int)(minor + k), (int)major, src);
+            else       blend_pixel(canvas, (int)major, (int)(minor + k), src);
+        }
+    }
+}
+
+static void check_line_aa(int x0, int y0, int x1, int y1)
+{
+    static uint32_t pixels[SIZE * SIZE], expected[SIZE * SIZE];
+    for (size_t i = 0; i < SIZE * SIZE; i++)
+    {
+        pixels[i] = expected[i] = 0xFF000000;
+    }
+
+    draw_line_aa(create_canvas(pixels, SIZE, SIZE, SIZE), x0, y0, x1, y1, 0xFFFFFFFF);
+    reference_line_aa(create_canvas(expected, SIZE, SIZE, SIZE), x0, y0, x1, y1, 0xFFFFFFFF);
+    CHECK(memcmp(pixels, expected, sizeof(pixels)) == 0, "draw_line_aa(%d, %d, %d, %d)", x0, y0, x1, y1);
+}
+
+int main(void)
+{
+    check_line(3, 5, 60, 20);
+    check_line(60, 2, 10, 50);
+    check_line(-20, 70, 80, -10);
+    check_line(7, 7, 7, 7);
+
+    // Endpoints far off the canvas, the deltas don't fit in an int.
+    check_line(0, 40, 1200000000, 10);
+    check_line(-1, 31, 2147483646, 0);
+    check_line(0, 0, 0, INT_MIN);
+    check_line(INT_MIN, INT_MIN, INT_MAX, INT_MAX);
+    check_line(INT_MAX, INT_MIN, INT_MIN, 32);
+    check_line(32, INT_MAX, 31, INT_MIN);
+    check_line(-1000000000, 63, 1000000000, 0);
+
+    check_line_aa(3, 5, 60, 20);
+    check_line_aa(60, 2, 10, 50);
+    check_line_aa(-20, 70, 80, -10);
+    check_line_aa(5, 9, 50, 9);
+    check_line_aa(7, 7, 7, 7);
+
+    // The same for anti-aliased lines, where the fixed point setup overflowed.
+    check_line_aa(0, 40, 1200000000, 10);
+    check_line_aa(-1, 31, 2147483646, 0);
+    check_line_aa(0, 0, 0, INT_MIN);
+    check_line_aa(INT_MIN, INT_MIN, INT_MAX, INT_MAX);
+    check_line_aa(INT_MAX, INT_MIN, INT_MIN, 32);
+    check_line_aa(32, INT_MAX, 31, INT_MIN);
+    check_line_aa(-1000000000, 63, 1000000000, 0);
+    check_line_aa(INT_MIN, 20, INT_MAX, 40);
+
+    return failures != 0;
+}
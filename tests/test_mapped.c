@@ -0,0 +1,50 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "graphic.h"
+#include "test.h"
+
+int main(void)
+{
+    char filename[] = "/tmp/test_mapped_XXXXXX";
+    int fd = mkstemp(filename);
+    if (fd < 0) return 1;
+    close(fd);
+
+    MappedCanvas *mapped = create_mapped_canvas(filename, 100, 70, PIXEL_PREMULTIPLIED);
+    CHECK(mapped != NULL, "create_mapped_canvas");
+    if (mapped == NULL) return 1;
+
+    Canvas canvas = *mapped_canvas(mapped);
+    CHECK(canvas.format == PIXEL_PREMULTIPLIED, "created format %d", canvas.format);
+    draw_filled_circle(canvas, 50, 35, 30, 0x80FF8040);
+
+    // A view is drawn on like the canvas, syncing and closing go through the handle.
+    Canvas view = canvas_subview(canvas, 10, 10, 40, 40);
+    draw_line(view, 0, 0, 39, 39, 0xFF00FF00);
+    uint32_t *expected = malloc(100 * 70 * sizeof(uint32_t));
+    memcpy(expected, canvas.pixels, 100 * 70 * sizeof(uint32_t));
+    CHECK(sync_mapped_canvas(mapped), "sync_mapped_canvas");
+    close_mapped_canvas(mapped);
+
+    mapped = open_mapped_canvas(filename);
+    CHECK(mapped != NULL, "open_mapped_canvas");
+    if (mapped != NULL)
+    {
+        canvas = *mapped_canvas(mapped);
+        CHECK(canvas.width == 100 && canvas.height == 70, "reopened size %zu x %zu", canvas.width, canvas.height);
+        CHECK(canvas.format == PIXEL_PREMULTIPLIED, "reopened format %d", canvas.format);
+        CHECK(memcmp(canvas.pixels, expected, 100 * 70 * sizeof(uint32_t)) == 0, "reopened pixels");
+
+        // Converting in place is recorded when the file is closed.
+        convert_canvas(mapped_canvas(mapped), PIXEL_STRAIGHT);
+        close_mapped_canvas(mapped);
+        mapped = open_mapped_canvas(filename);
+        CHECK(mapped != NULL && mapped_canvas(mapped)->format == PIXEL_STRAIGHT, "converted format");
+        close_mapped_canvas(mapped);
+    }
+
+    free(expected);
+    unlink(filename);
+    return failures != 0;
+}
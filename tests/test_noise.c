@@ -0,0 +1,75 @@
+#include <stdlib.h>
+#include <string.h>
+#include "graphic.h"
+#include "test.h"
+
+#define WIDTH 300
+#define HEIGHT 200
+#define TILE 64
+
+static void gray(uint32_t *pixels)
+{
+    for (size_t i = 0; i < WIDTH * HEIGHT; i++)
+    {
+        pixels[i] = 0xFF808080;
+    }
+}
+
+int main(void)
+{
+    static uint32_t whole[WIDTH * HEIGHT], tiled[WIDTH * HEIGHT];
+    Noise settings[2] = { create_noise(42, 60), create_noise(7, 20) };
+    settings[1].monochrome = 0;
+    settings[1].distribution = NOISE_GAUSSIAN;
+
+    for (int n = 0; n < 2; n++)
+    {
+        const Noise *noise = &settings[n];
+        gray(whole);
+        gray(tiled);
+        Canvas a = create_canvas(whole, WIDTH, HEIGHT, WIDTH);
+        Canvas b = create_canvas(tiled, WIDTH, HEIGHT, WIDTH);
+        add_noise(a, noise);
+
+        // Workers graining their own tile of the framebuffer grain it like the whole.
+        for (int y = 0; y < HEIGHT; y += TILE)
+        {
+            for (int x = 0; x < WIDTH; x += TILE)
+            {
+                Canvas tile = canvas_subview(b, x, y, TILE, TILE);
+                add_noise(canvas_subview(tile, 5, 3, TILE, TILE), noise);
+                add_noise(canvas_subview(tile, 0, 0, 5, TILE), noise);
+                add_noise(canvas_subview(tile, 5, 0, TILE, 3), noise);
+            }
+        }
+        CHECK(memcmp(whole, tiled, sizeof(whole)) == 0, "noise %d: tiles differ from the whole canvas", n);
+
+        // Clipping keeps the offsets of the pixels it lets through.
+        gray(tiled);
+        push_clip(&b, 17, 11, 150, 90);
+        add_noise(b, noise);
+        pop_clip(&b);
+        int clipped_equal = 1;
+        for (int y = 0; y < HEIGHT; y++)
+        {
+            for (int x = 0; x < WIDTH; x++)
+            {
+                int inside = x >= 17 && x < 167 && y >= 11 && y < 101;
+                uint32_t expected = inside ? whole[y * WIDTH + x] : 0xFF808080;
+                clipped_equal &= tiled[y * WIDTH + x] == expected;
+            }
+        }
+        CHECK(clipped_equal, "noise %d: clipping changed the offsets", n);
+
+        // No two tiles get the same pattern.
+        int repeated = 0;
+        for (int y = 0; y < TILE; y++)
+        {
+            repeated += memcmp(&whole[y * WIDTH], &whole[y * WIDTH + TILE], TILE * sizeof(uint32_t)) == 0;
+            repeated += memcmp(&whole[y * WIDTH], &whole[(y + TILE) * WIDTH], TILE * sizeof(uint32_t)) == 0;
+        }
+        CHECK(repeated == 0, "noise %d: %d tile rows repeat", n, repeated);
+    }
+
+    return failures != 0;
+}
@@ -0,0 +1,80 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "graphic.h"
+#include "test.h"
+
+#define SIZE 64
+
+static long long floor_div(__int128 a, __int128 b)
+{
+    __int128 q = a / b;
+    if ((a % b != 0) && ((a < 0) != (b < 0))) q--;
+    return (long long)q;
+}
+
+static long long edge_x(long long x0, long long y0, long long x1, long long y1, long long y)
+{
+    return x0 + floor_div((__int128)(x1 - x0) * (y - y0), y1 - y0);
+}
+
+/**
+ * @brief Fills the triangle the way draw_filled_triangle() does: rows y0 to
+ * y2 - 1 of the sorted vertices, from one edge to the other, both included.
+ */
+static void reference_triangle(uint32_t *pixels, long long x0, long long y0, long long x1, long long y1,
+                               long long x2, long long y2, uint32_t color)
+{
+    long long t;
+    if (y1 < y0) { t = x0; x0 = x1; x1 = t; t = y0; y0 = y1; y1 = t; }
+    if (y2 < y0) { t = x0; x0 = x2; x2 = t; t = y0; y0 = y2; y2 = t; }
+    if (y2 < y1) { t = x1; x1 = x2; x2 = t; t = y1; y1 = y2; y2 = t; }
+
+    for (long long y = y0 > 0 ? y0 : 0; y < y2 && y < SIZE; y++)
+    {
+        long long a = edge_x(x0, y0, x2, y2, y);
+        long long b = y < y1 ? edge_x(x0, y0, x1, y1, y) : edge_x(x1, y1, x2, y2, y);
+
+        // The long edge is on the same side on every row, the middle row decides.
+        long long middle = y0 + (y2 - y0) / 2;
+        long long am = edge_x(x0, y0, x2, y2, middle);
+        long long bm = middle < y1 ? edge_x(x0, y0, x1, y1, middle) : edge_x(x1, y1, x2, y2, middle);
+        long long left = am < bm ? a : b, right = am < bm ? b : a;
+
+        for (long long x = left > 0 ? left : 0; x <= right && x < SIZE; x++)
+        {
+            pixels[y * SIZE + x] = color;
+        }
+    }
+}
+
+static void check_triangle(int x0, int y0, int x1, int y1, int x2, int y2)
+{
+    static uint32_t pixels[SIZE * SIZE], expected[SIZE * SIZE];
+    for (size_t i = 0; i < SIZE * SIZE; i++)
+    {
+        pixels[i] = expected[i] = 0xFF000000;
+    }
+
+    Canvas canvas = create_canvas(pixels, SIZE, SIZE, SIZE);
+    draw_filled_triangle(canvas, x0, y0, x1, y1, x2, y2, 0xFFFFFFFF);
+    reference_triangle(expected, x0, y0, x1, y1, x2, y2, 0xFFFFFFFF);
+    CHECK(memcmp(pixels, expected, sizeof(pixels)) == 0,
+          "draw_filled_triangle(%d, %d, %d, %d, %d, %d)", x0, y0, x1, y1, x2, y2);
+}
+
+int main(void)
+{
+    check_triangle(5, 3, 60, 20, 12, 58);
+    check_triangle(40, -10, 70, 70, -5, 30);
+    check_triangle(10, 10, 50, 10, 30, 40);
+
+    // Vertices far off the canvas, differences and products overflow 32 and 64 bits.
+    check_triangle(INT_MIN, INT_MIN, INT_MAX, 0, 0, INT_MAX);
+    check_triangle(INT_MAX, INT_MIN, INT_MIN, INT_MIN + 1, 32, INT_MAX);
+    check_triangle(-2000000000, 10, 2000000000, 20, 31, 2000000000);
+    check_triangle(0, -2147483000, 63, 2147483000, -2147483000, 31);
+    check_triangle(INT_MIN, 0, INT_MAX, 63, INT_MIN, 63);
+
+    return failures != 0;
+}